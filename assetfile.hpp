@@ -0,0 +1,243 @@
+#pragma once
+
+#include "image.hpp"
+#include "camerapath.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace kd
+{
+    //
+    // Asset archives hold what main() loads at startup in the form it is
+    // used in: images decoded to RGBA8 with Image's row stride, camera
+    // paths as compressed keys, and anything else (the music) as the
+    // original bytes. The archive is mapped and images and files are views
+    // into it, so startup does no decoding or copying. Built by assetpack.
+    // Little-endian only.
+    //
+    //   header | entries | data
+    //
+    // Every data block starts on a 64 byte boundary.
+    //
+    // An archive entry is skipped when the file it was packed from is
+    // newer than the archive, so an edited camera.txt or image is used
+    // without rerunning assetpack.
+    //
+
+    enum AssetType
+    {
+        ASSET_FILE,
+        ASSET_IMAGE,
+        ASSET_CAMERA_PATH,
+    };
+
+    struct AssetFileHeader
+    {
+        char magic[4];          // "KDAR"
+        uint32 version;
+        uint32 numEntries;
+        uint32 reserved;
+        uint64 size;
+    };
+
+    struct AssetFileEntry
+    {
+        char name[64];          // path the asset was packed from
+        uint32 type;            // AssetType
+        int32 w, h, stride;     // images; key count in w for camera paths
+        uint64 offset;          // from the start of the file
+        uint64 size;            // bytes
+    };
+
+    static const uint32 assetFileVersion = 2;
+
+    // Camera keys are stored as t, pos, vel, rot, spin.
+    static const int assetCameraKeyFloats = 14;
+
+    static inline void packCameraKey(float* f, const CameraKey& k)
+    {
+        const float v[assetCameraKeyFloats] = {
+            k.t, k.pos.x, k.pos.y, k.pos.z, k.vel.x, k.vel.y, k.vel.z,
+            k.rot.v.x, k.rot.v.y, k.rot.v.z, k.rot.v.w, k.spin.x, k.spin.y, k.spin.z };
+        memcpy(f, v, sizeof(v));
+    }
+
+    static inline void unpackCameraKey(CameraKey& k, const float* f)
+    {
+        k.t = f[0];
+        k.pos = Vector3f(f + 1);
+        k.vel = Vector3f(f + 4);
+        k.rot = Quaternionf(f[7], f[8], f[9], f[10]);
+        k.spin = Vector3f(f + 11);
+    }
+
+    static inline uint64 assetFileAlign(uint64 offset)
+    {
+        return (offset + 63) & ~uint64(63);
+    }
+
+    class AssetArchive
+    {
+    public:
+        AssetArchive() : mapped(0), mappedSize(0), mtime(0), entries(0), numEntries(0) {}
+        ~AssetArchive() { close(); }
+
+        // Quietly returns false when fn does not exist, so callers can
+        // fall back to the loose files.
+        bool open(const char* fn)
+        {
+            close();
+
+            int fd = ::open(fn, O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(AssetFileHeader))
+            {
+                fprintf(stderr, "%s: not an asset archive\n", fn);
+                ::close(fd);
+                return false;
+            }
+
+            void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+
+            if (p == MAP_FAILED)
+            {
+                fprintf(stderr, "can't map %s\n", fn);
+                return false;
+            }
+
+            const AssetFileHeader& h = *(const AssetFileHeader*)p;
+            const uint64 tableEnd = sizeof(AssetFileHeader) + uint64(h.numEntries) * sizeof(AssetFileEntry);
+
+            bool ok = memcmp(h.magic, "KDAR", 4) == 0 && h.version == assetFileVersion &&
+                      h.size <= uint64(st.st_size) && tableEnd <= h.size;
+
+            const AssetFileEntry* e = (const AssetFileEntry*)((const char*)p + sizeof(AssetFileHeader));
+            for (uint32 i = 0; ok && i < h.numEntries; i++)
+                ok = e[i].offset % 64 == 0 && e[i].offset >= tableEnd &&
+                     e[i].size <= h.size && e[i].offset <= h.size - e[i].size &&
+                     e[i].name[sizeof(e[i].name) - 1] == 0 && validEntry(e[i]);
+
+            if (!ok)
+            {
+                fprintf(stderr, "%s: not an asset archive or wrong version\n", fn);
+                munmap(p, st.st_size);
+                return false;
+            }
+
+            mapped = p;
+            mappedSize = st.st_size;
+            mtime = st.st_mtime;
+            entries = e;
+            numEntries = h.numEntries;
+            return true;
+        }
+
+        void close()
+        {
+            if (mapped)
+                munmap(mapped, mappedSize);
+            mapped = 0;
+            mappedSize = 0;
+            entries = 0;
+            numEntries = 0;
+        }
+
+        bool isOpen() const { return mapped != 0; }
+
+        const AssetFileEntry* find(const char* name, AssetType type) const
+        {
+            for (int i = 0; i < numEntries; i++)
+                if (entries[i].type == uint32(type) && strcmp(entries[i].name, name) == 0)
+                    return stale(entries[i]) ? 0 : &entries[i];
+            return 0;
+        }
+
+        const void* data(const AssetFileEntry& e) const
+        {
+            return (const char*)mapped + e.offset;
+        }
+
+        // The view points into the read-only mapping: read it, don't draw
+        // into it.
+        bool image(const char* name, ImageView& v) const
+        {
+            const AssetFileEntry* e = find(name, ASSET_IMAGE);
+            if (!e)
+                return false;
+
+            v = ImageView();
+            v.data = (uint32*)data(*e);
+            v.w = e->w;
+            v.h = e->h;
+            v.stride = e->stride;
+            return true;
+        }
+
+        bool file(const char* name, const void** p, size_t* size) const
+        {
+            const AssetFileEntry* e = find(name, ASSET_FILE);
+            if (!e)
+                return false;
+
+            *p = data(*e);
+            *size = size_t(e->size);
+            return true;
+        }
+
+        // Camera paths are small and edited while recording, so the
+        // keys are copied out. The path has no frames.
+        bool cameraPath(const char* name, CameraPath& path) const
+        {
+            const AssetFileEntry* e = find(name, ASSET_CAMERA_PATH);
+            if (!e)
+                return false;
+
+            const float* f = (const float*)data(*e);
+            std::vector<CameraKey> keys(e->w);
+            for (int i = 0; i < e->w; i++)
+                unpackCameraKey(keys[i], f + assetCameraKeyFloats * i);
+
+            path.frames.clear();
+            path.setKeys(keys);
+            return true;
+        }
+
+    private:
+        // The views and copies made from an entry stay within its bytes.
+        static bool validEntry(const AssetFileEntry& e)
+        {
+            if (e.type == ASSET_IMAGE)
+                return e.w >= 0 && e.h >= 0 && e.stride >= e.w &&
+                       uint64(e.stride) * uint64(e.h) * 4 <= e.size;
+            if (e.type == ASSET_CAMERA_PATH)
+                return e.w >= 0 && uint64(e.w) * assetCameraKeyFloats * sizeof(float) <= e.size;
+            return true;
+        }
+
+        bool stale(const AssetFileEntry& e) const
+        {
+            struct stat st;
+            if (stat(e.name, &st) != 0 || st.st_mtime <= mtime)
+                return false;
+            fprintf(stderr, "%s is newer than the asset archive, using it instead\n", e.name);
+            return true;
+        }
+
+        void* mapped;
+        size_t mappedSize;
+        time_t mtime;
+        const AssetFileEntry* entries;
+        int numEntries;
+
+        AssetArchive(const AssetArchive&);
+        AssetArchive& operator=(const AssetArchive&);
+    };
+}
@@ -0,0 +1,169 @@
+#include "assetfile.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace kd;
+
+//
+// Packs the startup assets into one archive for AssetArchive:
+//
+//   assetpack assets.kda assets/title.png camera.txt assets/musa.ogg ...
+//
+// .png files are decoded to images, .txt files are read as camera paths
+// and compressed to keys, and everything else is stored as it is. Assets
+// are looked up by the path given here.
+//
+
+static bool endsWith(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static bool readFile(const char* fn, std::vector<uint8>& out)
+{
+    FILE* fp = fopen(fn, "rb");
+    if (!fp)
+        return false;
+
+    fseek(fp, 0, SEEK_END);
+    long n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    out.resize(n);
+    bool ok = n == 0 || fread(&out[0], 1, n, fp) == size_t(n);
+    fclose(fp);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s output.kda input...\n", argv[0]);
+        return 1;
+    }
+
+    const int numEntries = argc - 2;
+    std::vector<AssetFileEntry> entries(numEntries);
+    std::vector<std::vector<uint8> > blobs(numEntries);
+
+    uint64 offset = assetFileAlign(sizeof(AssetFileHeader) + numEntries * sizeof(AssetFileEntry));
+
+    for (int i = 0; i < numEntries; i++)
+    {
+        const std::string fn = argv[i + 2];
+        AssetFileEntry& e = entries[i];
+        std::vector<uint8>& b = blobs[i];
+
+        memset(&e, 0, sizeof(e));
+        if (fn.size() >= sizeof(e.name))
+        {
+            fprintf(stderr, "%s: name too long\n", fn.c_str());
+            return 1;
+        }
+        strcpy(e.name, fn.c_str());
+
+        if (endsWith(fn, ".png") || endsWith(fn, ".PNG"))
+        {
+            FILE* fp = fopen(fn.c_str(), "rb");
+            if (!fp)
+            {
+                fprintf(stderr, "can't open %s\n", fn.c_str());
+                return 1;
+            }
+            fclose(fp);
+
+            Image img(fn);
+            e.type = ASSET_IMAGE;
+            e.w = img.w;
+            e.h = img.h;
+            e.stride = img.stride;
+            // Row padding stays zero, so the same inputs give the same
+            // archive.
+            b.resize(size_t(img.stride) * img.h * 4);
+            for (int y = 0; y < img.h; y++)
+                memcpy(&b[size_t(y) * img.stride * 4], img.row(y), size_t(img.w) * 4);
+        }
+        else if (endsWith(fn, ".txt"))
+        {
+            FILE* fp = fopen(fn.c_str(), "r");
+            if (!fp)
+            {
+                fprintf(stderr, "can't open %s\n", fn.c_str());
+                return 1;
+            }
+            fclose(fp);
+
+            CameraPath path;
+            path.load(fn.c_str());
+            path.compress();
+            e.type = ASSET_CAMERA_PATH;
+            e.w = (int32)path.keys.size();
+            b.resize(path.keys.size() * assetCameraKeyFloats * sizeof(float));
+            for (size_t k = 0; k < path.keys.size(); k++)
+                packCameraKey((float*)&b[k * assetCameraKeyFloats * sizeof(float)], path.keys[k]);
+        }
+        else
+        {
+            if (!readFile(fn.c_str(), b))
+            {
+                fprintf(stderr, "can't read %s\n", fn.c_str());
+                return 1;
+            }
+            e.type = ASSET_FILE;
+        }
+
+        e.offset = offset;
+        e.size = b.size();
+        offset = assetFileAlign(offset + b.size());
+    }
+
+    AssetFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "KDAR", 4);
+    h.version = assetFileVersion;
+    h.numEntries = numEntries;
+    h.size = offset;
+
+    FILE* fp = fopen(argv[1], "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "can't write %s\n", argv[1]);
+        return 1;
+    }
+
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(&entries[0], sizeof(AssetFileEntry), numEntries, fp);
+
+    // Zero fill up to each entry's aligned offset and after the last one.
+    static const char zeros[64] = { 0 };
+    for (int i = 0; i <= numEntries; i++)
+    {
+        const uint64 to = i < numEntries ? entries[i].offset : h.size;
+        long pos = ftell(fp);
+        if (uint64(pos) < to)
+            fwrite(zeros, 1, size_t(to - pos), fp);
+
+        if (i < numEntries && !blobs[i].empty())
+            fwrite(&blobs[i][0], 1, blobs[i].size(), fp);
+    }
+
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok)
+    {
+        fprintf(stderr, "error writing %s\n", argv[1]);
+        return 1;
+    }
+
+    for (int i = 0; i < numEntries; i++)
+        printf("%-24s %s %llu bytes\n", entries[i].name,
+            entries[i].type == ASSET_IMAGE ? "image " : entries[i].type == ASSET_CAMERA_PATH ? "camera" : "file  ",
+            (unsigned long long)entries[i].size);
+    return 0;
+}
@@ -0,0 +1,443 @@
+#include "math.hpp"
+#include "image.hpp"
+#include "wobbler.hpp"
+#include "blur.hpp"
+#include "camerapath.hpp"
+#include "present.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+using namespace kd;
+
+//
+// Microbenchmarks for the math and pixel kernels. Run without arguments for
+// everything or give group names ("math", "pixels", "tiles", "camera") to
+// pick. "present" opens a window and runs only when named.
+//
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static volatile float sink;
+
+// Makes the compiler assume memory was read and changed, so repeated
+// passes over the same data are not folded together.
+static inline void clobber()
+{
+    __asm__ volatile("" ::: "memory");
+}
+
+//
+// Math.
+//
+
+static double ulpError(float approx, double ref)
+{
+    float r = float(ref);
+    float ulp = std::nextafter(std::fabs(r), 1e38f) - std::fabs(r);
+    return std::fabs(double(approx) - ref) / ulp;
+}
+
+template<typename F, typename M>
+static void measureError(const char* name, float lo, float hi, int which)
+{
+    const int n = 1 << 22;
+    double maxUlp = 0.0;
+    double maxAbs = 0.0;
+
+    for (int i = 0; i < n; i += F::width)
+    {
+        float t[F::width];
+        for (int j = 0; j < F::width; j++)
+            t[j] = lo + (hi - lo) * float(i + j) / float(n);
+
+        F x = load(t, F());
+        F y = which == 0 ? M::sin(x) : which == 1 ? M::cos(x) : M::exp(x);
+
+        float r[F::width];
+        store(r, y);
+        for (int j = 0; j < F::width; j++)
+        {
+            double ref = which == 0 ? sin(double(t[j])) : which == 1 ? cos(double(t[j])) : exp(double(t[j]));
+            double e = std::fabs(double(r[j]) - ref);
+            maxAbs = std::max(maxAbs, e);
+            if (std::fabs(ref) > 1e-3)
+                maxUlp = std::max(maxUlp, ulpError(r[j], ref));
+        }
+    }
+
+    printf("  %-24s [%9.2f, %9.2f]  max %5.2f ulp  max abs %.3g\n", name, lo, hi, maxUlp, maxAbs);
+}
+
+template<typename F, typename M>
+static double timeMath(const std::vector<float>& in, std::vector<float>& out, int which)
+{
+    const int reps = 20;
+    double t0 = now();
+    for (int r = 0; r < reps; r++)
+        for (size_t i = 0; i < in.size(); i += F::width)
+        {
+            F x = load(&in[i], F());
+            F y = which == 0 ? M::sin(x) : which == 1 ? M::cos(x) : M::exp(x);
+            store(&out[i], y);
+        }
+    sink = out[out.size() / 2];
+    return (now() - t0) / (reps * double(in.size())) * 1e9;
+}
+
+static void benchMath()
+{
+    printf("math: accuracy\n");
+    measureError<floatx4, FastMath>("sin_approx x4", -8192.f, 8192.f, 0);
+    measureError<floatx4, FastMath>("cos_approx x4", -8192.f, 8192.f, 1);
+    measureError<floatx4, FastMath>("exp_approx x4", -87.3f, 88.3f, 2);
+    measureError<floatx8, FastMath>("sin_approx x8", -8192.f, 8192.f, 0);
+    measureError<floatx8, FastMath>("cos_approx x8", -8192.f, 8192.f, 1);
+    measureError<floatx8, FastMath>("exp_approx x8", -87.3f, 88.3f, 2);
+    measureError<floatx4, LibmMath>("libm sinf", -8192.f, 8192.f, 0);
+    measureError<floatx4, LibmMath>("libm expf", -87.3f, 88.3f, 2);
+
+    std::vector<float> in(1 << 16), out(1 << 16);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = (float(i) / in.size() - .5f) * 100.f;
+
+    static const char* names[] = { "sin", "cos", "exp" };
+
+    printf("math: ns per element\n");
+    for (int which = 0; which < 3; which++)
+    {
+        printf("  %s  libm %6.2f  x4 %6.2f  x8 %6.2f\n", names[which],
+            timeMath<floatx4, LibmMath>(in, out, which),
+            timeMath<floatx4, FastMath>(in, out, which),
+            timeMath<floatx8, FastMath>(in, out, which));
+    }
+}
+
+//
+// Colour conversion.
+//
+
+static uint32 packScalar(const Vector4f& c)
+{
+    int r = std::max(0, std::min(255, int(c.x * 256.f)));
+    int g = std::max(0, std::min(255, int(c.y * 256.f)));
+    int b = std::max(0, std::min(255, int(c.z * 256.f)));
+    int a = std::max(0, std::min(255, int(c.w * 256.f)));
+    return r | (g<<8) | (b<<16) | (a<<24);
+}
+
+static void benchPixels()
+{
+    const int n = 1 << 16, reps = 200;
+
+    std::vector<Vector4f> colors(n);
+    std::vector<float> soa(4 * n);
+    std::vector<uint32> pixels(n);
+    for (int i = 0; i < n; i++)
+    {
+        colors[i] = Vector4f(float(i % 311) / 256.f - .1f, float(i % 257) / 256.f, float(i % 101) / 80.f, 1.f);
+        for (int k = 0; k < 4; k++)
+            soa[k * n + i] = colors[i][k];
+    }
+
+    int mismatch = 0;
+
+    double t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int i = 0; i < n; i++)
+            pixels[i] = packScalar(colors[i]);
+        clobber();
+    }
+    double tScalar = now() - t0;
+    std::vector<uint32> ref = pixels;
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        packColors(&pixels[0], &colors[0], n);
+        clobber();
+    }
+    double tSpan = now() - t0;
+    mismatch += pixels != ref;
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int i = 0; i < n; i += floatx8::width)
+        {
+            Vector4x<floatx8> c(load(&soa[i], floatx8()), load(&soa[n + i], floatx8()),
+                                load(&soa[2*n + i], floatx8()), load(&soa[3*n + i], floatx8()));
+            store((int32*)&pixels[i], packColor(c));
+        }
+        clobber();
+    }
+    double tPacket = now() - t0;
+    mismatch += pixels != ref;
+
+    printf("pixels: ns per pixel\n");
+    printf("  pack    scalar %6.3f  span %6.3f  soa x8 %6.3f%s\n",
+        tScalar / (reps * double(n)) * 1e9, tSpan / (reps * double(n)) * 1e9,
+        tPacket / (reps * double(n)) * 1e9, mismatch ? "  MISMATCH" : "");
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            uint32 p = ref[i];
+            colors[i] = Vector4f(float(p & 0xff) / 255.f, float((p>>8) & 0xff) / 255.f,
+                                 float((p>>16) & 0xff) / 255.f, float(p>>24) / 255.f);
+        }
+        clobber();
+    }
+    tScalar = now() - t0;
+
+    t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        unpackColors(&colors[0], &ref[0], n);
+        clobber();
+    }
+    tSpan = now() - t0;
+
+    printf("  unpack  scalar %6.3f  span %6.3f\n",
+        tScalar / (reps * double(n)) * 1e9, tSpan / (reps * double(n)) * 1e9);
+}
+
+//
+// Tiled frames. Jobs that walk the frame tile by tile are where row-major
+// costs: a 32x32 job touches 32 rows, i.e. 32 pages at 4K. The wobbler's
+// gathers are measured too, from row-major and tiled sources. linearize
+// is the price paid per frame.
+//
+
+static double timeWobbler(const ImageView& dst, const ImageView& src, const TiledImage* tiled, float amp)
+{
+    const int reps = 10;
+    double t0 = now();
+    for (int r = 0; r < reps; r++)
+    {
+        if (tiled)
+            wobbler<FastMath>(dst, *tiled, float(r), float(r) * .7f, amp);
+        else
+            wobbler<FastMath>(dst, src, float(r), float(r) * .7f, amp);
+        clobber();
+    }
+    return (now() - t0) / (reps * double(dst.w) * dst.h) * 1e9;
+}
+
+static void benchTiles()
+{
+    static const int sizes[][2] = { { 640, 480 }, { 1920, 1080 }, { 3840, 2160 } };
+
+    printf("tiles: ns per pixel\n");
+    for (int i = 0; i < 3; i++)
+    {
+        const int w = sizes[i][0], h = sizes[i][1];
+
+        Image src, dst;
+        src.resize(w, h);
+        dst.resize(w, h);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                src.row(y)[x] = x * 2654435761u ^ y * 40503u;
+
+        TiledImage t8, t32;
+        t8.resize(w, h, 8);
+        t32.resize(w, h, 32);
+        tileRows(t8, src, 0, h);
+        tileRows(t32, src, 0, h);
+
+        const int reps = 10;
+        double t0 = now();
+        for (int r = 0; r < reps; r++)
+        {
+            linearize(dst, t32, 0, h);
+            clobber();
+        }
+        const double tLinear = (now() - t0) / (reps * double(w) * h) * 1e9;
+
+        // A vertical pass over 32x32 tile jobs, walking tile columns the
+        // way a scheduler handing out tiles in Morton or column order
+        // would: each job touches 32 rows, i.e. 32 pages at 4K.
+        double tRows = 0.0, tTiled = 0.0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            t0 = now();
+            for (int r = 0; r < reps; r++)
+            {
+                for (int tx = 0; tx < t32.tilesX; tx++)
+                    for (int ty = 0; ty < t32.tilesY; ty++)
+                    {
+                        ImageView v = t32.tile(tx, ty);
+                        if (pass == 0)
+                            v = ImageView(dst).sub(v.x, v.y, v.w, v.h);
+                        blurv(v, v);
+                    }
+                clobber();
+            }
+            (pass == 0 ? tRows : tTiled) = (now() - t0) / (reps * double(w) * h) * 1e9;
+        }
+
+        printf("  %4dx%-4d  linearize %5.2f  tile blurv rows %5.2f  32x32 %5.2f\n", w, h, tLinear, tRows, tTiled);
+        for (int a = 0; a < 3; a++)
+        {
+            const float amp = a == 0 ? 2.f : a == 1 ? 10.f : 40.f;
+            printf("             wobble amp %2.0f  rows %5.2f  8x8 %5.2f  32x32 %5.2f\n", amp,
+                timeWobbler(dst, src, 0, amp), timeWobbler(dst, src, &t8, amp), timeWobbler(dst, src, &t32, amp));
+        }
+    }
+}
+
+//
+// Camera paths.
+//
+
+static double timeCameraGet(const CameraPath& path, float length)
+{
+    const int n = 1000000;
+    double t0 = now();
+    for (int i = 0; i < n; i++)
+        sink += path.get(length * (i * 0.6180339887f - int(i * 0.6180339887f)))[3];
+    return (now() - t0) / n * 1e9;
+}
+
+static void benchCamera()
+{
+    CameraPath frames;
+    FILE* fp = fopen("camera.txt", "r");
+    if (!fp)
+    {
+        printf("camera: no camera.txt\n");
+        return;
+    }
+    fclose(fp);
+    frames.load("camera.txt");
+
+    CameraPath keys = frames;
+    double t0 = now();
+    keys.compress();
+    const double tCompress = (now() - t0) * 1e3;
+
+    // Distance between the recorded and the fitted camera position.
+    float maxError = 0.f;
+    for (size_t i = 0; i < frames.frames.size(); i++)
+    {
+        const Matrix4x4f a = invert_affine(frames.frames[i]);
+        const Matrix4x4f b = invert_affine(keys.get(i / CameraPath::frameRate));
+        maxError = std::max(maxError, length(Vector3f(a[3] - b[3], a[7] - b[7], a[11] - b[11])));
+    }
+
+    const float length = frames.frames.size() / CameraPath::frameRate;
+    printf("camera: %d frames, %d keys, compress %.1f ms, max position error %.3f\n",
+        (int)frames.frames.size(), (int)keys.keys.size(), tCompress, maxError);
+    printf("  get ns: frames %5.1f  keys %5.1f\n", timeCameraGet(frames, length), timeCameraGet(keys, length));
+}
+
+//
+// Presenting frames.
+//
+
+// Milliseconds per frame: a frame from put() until the GPU has it, and
+// frames back to back, the ring buffers kept full.
+static void timePresent(Presenter& p, Image& img, int w, int h, double& latency, double& perFrame)
+{
+    const int n = 100;
+    for (int i = 0; i < 10; i++)
+        p.put(img, w, h);
+    glFinish();
+
+    latency = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        img.row(i % img.h)[0] += 1;     // not the same frame every time
+        double t0 = now();
+        p.put(img, w, h);
+        glFinish();
+        latency += now() - t0;
+    }
+    latency = latency / n * 1e3;
+
+    double t0 = now();
+    for (int i = 0; i < n; i++)
+    {
+        img.row(i % img.h)[0] += 1;
+        p.put(img, w, h);
+    }
+    glFinish();
+    perFrame = (now() - t0) / n * 1e3;
+}
+
+static void benchPresent()
+{
+    const int w = 1280, h = 720;
+    if (SDL_Init(SDL_INIT_VIDEO) != 0 || !SDL_SetVideoMode(w, h, 0, SDL_OPENGL))
+    {
+        printf("present: no display\n");
+        return;
+    }
+    printf("present: %s, %dx%d window\n", (const char*)glGetString(GL_RENDERER), w, h);
+
+    static const int sizes[][2] = { { 256, 256 }, { 1280, 720 }, { 1920, 1080 } };
+    std::vector<Image> images(3);
+    for (int i = 0; i < 3; i++)
+    {
+        images[i].resize(sizes[i][0], sizes[i][1]);
+        for (int y = 0; y < images[i].h; y++)
+            for (int x = 0; x < images[i].w; x++)
+                images[i].row(y)[x] = 0xff000000 | (x * 0x010203 + y * 0x030201);
+    }
+
+    for (int m = PRESENT_DRAW_PIXELS; m <= PRESENT_AUTO; m++)
+    {
+        Presenter p;
+        if (p.init(PresentMode(m)) != m && m != PRESENT_AUTO)
+        {
+            printf("  %-10s  not supported\n", presentModeName(PresentMode(m)));
+            continue;
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            double latency, perFrame;
+            timePresent(p, images[i], w, h, latency, perFrame);
+            printf("  %-10s %4dx%-4d  latency %7.3f ms  back to back %7.3f ms\n",
+                presentModeName(PresentMode(m)), images[i].w, images[i].h, latency, perFrame);
+        }
+        p.shutdown();
+    }
+
+    SDL_Quit();
+}
+
+static bool wanted(int argc, char* argv[], const char* group)
+{
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], group) == 0)
+            return true;
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    if (wanted(argc, argv, "math"))
+        benchMath();
+    if (wanted(argc, argv, "pixels"))
+        benchPixels();
+    if (wanted(argc, argv, "tiles"))
+        benchTiles();
+    if (wanted(argc, argv, "camera"))
+        benchCamera();
+    if (argc >= 2 && wanted(argc, argv, "present"))
+        benchPresent();
+
+    return 0;
+}
@@ -1,35 +1,48 @@
 #pragma once
 
+#include "image.hpp"
+
 namespace kd
 {
-    static void blurh(Image& dst, const Image& src)
+    static void blurh(const ImageView& dst, const ImageView& src)
     {
+        kd_assert(dst.w == src.w && dst.h == src.h);
+
         for (int y = 0; y < src.h; y++)
         {
+            const uint32* s = src.row(y);
+            uint32* d = dst.row(y);
+
             for (int x = 1; x < src.w; x++)
             {
-                uint32 c1 = src.data[y*src.w+x-1];
-                uint32 c2 = src.data[y*src.w+x];
+                uint32 c1 = s[x-1];
+                uint32 c2 = s[x];
 
                 uint32 c = ((c1 >> 1) & 0x7F7F7F7F) + ((c2 >> 1) & 0x7F7F7F7F);
 
-                dst.data[y*dst.w+x] = c;
+                d[x] = c;
             }
         }
     }
 
-    static void blurv(Image& dst, const Image& src)
+    static void blurv(const ImageView& dst, const ImageView& src)
     {
+        kd_assert(dst.w == src.w && dst.h == src.h);
+
         for (int y = 1; y < src.h; y++)
         {
+            const uint32* s1 = src.row(y);
+            const uint32* s2 = src.row(y-1);
+            uint32* d = dst.row(y);
+
             for (int x = 0; x < src.w; x++)
             {
-                uint32 c1 = src.data[y*src.w+x];
-                uint32 c2 = src.data[(y-1)*src.w+x];
+                uint32 c1 = s1[x];
+                uint32 c2 = s2[x];
 
                 uint32 c = ((c1 >> 1) & 0x7F7F7F7F) + ((c2 >> 1) & 0x7F7F7F7F);
 
-                dst.data[y*dst.w+x] = c;
+                d[x] = c;
             }
         }
     }
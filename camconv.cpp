@@ -0,0 +1,62 @@
+#include "camerajournal.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+using namespace kd;
+
+//
+// Converts camera paths between the text format (camera.txt) and the
+// binary recording journal:
+//
+//   camconv camera.kdcj camera.txt
+//   camconv camera.txt camera.kdcj
+//
+// Files ending in .txt are text, anything else is a journal.
+//
+
+static bool isText(const std::string& s)
+{
+    return s.size() >= 4 && s.compare(s.size() - 4, 4, ".txt") == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s input output\n", argv[0]);
+        return 1;
+    }
+
+    CameraPath path;
+
+    if (isText(argv[1]))
+    {
+        FILE* fp = fopen(argv[1], "r");
+        if (!fp)
+        {
+            fprintf(stderr, "can't open %s\n", argv[1]);
+            return 1;
+        }
+        fclose(fp);
+        path.load(argv[1]);
+    }
+    else if (loadCameraJournal(path, argv[1]) < 0)
+        return 1;
+
+    if (isText(argv[2]))
+        path.save(argv[2]);
+    else
+    {
+        CameraJournal journal;
+        if (!journal.open(argv[2], false))
+            return 1;
+        for (size_t i = 0; i < path.frames.size(); i++)
+            journal.add(path.frames[i]);
+        journal.close();
+    }
+
+    printf("%s: %d frames\n", argv[2], (int)path.frames.size());
+    return 0;
+}
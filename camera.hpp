@@ -7,7 +7,7 @@ namespace kd
     class Camera
     {
     public:
-        Camera() : targetCamera(true) {}
+        Camera() : targetCamera(true), aspect(1.f) {}
         ~Camera() {}
 
         void translateLocal(const Vector3f& v)
@@ -24,18 +24,26 @@ namespace kd
         {
             if (targetCamera)
                 view = look_at(position, target, Vector3f(0.f, 1.f, 0.f));
-            else
+
+            // View is always affine and the projection comes from
+            // perspective(), so both invert analytically.
+            Matrix4x4f viewInv = invert_affine(view);
+
+            if (!targetCamera)
             {
-                Vector4f p = invert(view) * Vector4f(0.f, 0.f, 0.f, 1.f);
-                p /= p.w;
+                Vector4f p = viewInv * Vector4f(0.f, 0.f, 0.f, 1.f);
                 position = p.xyz();
             }
 
-            Matrix4x4f m = perspective(fov, 1.f, 0.1f, 100.f) * view;
-            viewToClip = m;
+            Matrix4x4f proj = perspective(fov, aspect, 0.1f, 100.f);
+            viewToClip = proj * view;
+            clipToView = viewInv * invert_perspective(proj);
+        }
 
-            clipToView = viewToClip;
-            clipToView.invert();
+        // Conservative: false only for boxes certainly out of view.
+        bool isVisible(const AABBf& b) const
+        {
+            return !outside_frustum(viewToClip, b);
         }
 
         bool targetCamera;
@@ -43,6 +51,7 @@ namespace kd
         Vector3f position;
         Vector3f target;
         float fov;
+        float aspect;       // width / height
 
         Matrix4x4f view;
 
@@ -0,0 +1,287 @@
+#pragma once
+
+#include "camerapath.hpp"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kd
+{
+    //
+    // Append-only binary journal for recording camera paths. add() only
+    // queues the frame; a background thread appends queued frames in
+    // batches, so recording costs the main thread nothing however long
+    // the path grows.
+    //
+    //   header | record | record | ...
+    //
+    // Each record carries its index and a CRC, so after a crash the
+    // journal is read up to the last complete record and a torn or stale
+    // tail is dropped. Little-endian only.
+    //
+
+    struct CameraJournalHeader
+    {
+        char magic[4];          // "KDCJ"
+        uint32 version;
+    };
+
+    struct CameraJournalRecord
+    {
+        uint32 index;
+        float m[16];
+        uint32 crc;             // of index and m
+    };
+
+    static const uint32 cameraJournalVersion = 1;
+
+    struct Crc32Table
+    {
+        Crc32Table()
+        {
+            for (uint32 i = 0; i < 256; i++)
+            {
+                uint32 c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+        }
+
+        uint32 t[256];
+    };
+
+    static uint32 crc32(const void* data, size_t size)
+    {
+        static const Crc32Table table;     // built once, thread safe
+
+        uint32 c = 0xffffffff;
+        for (size_t i = 0; i < size; i++)
+            c = table.t[(c ^ ((const uint8*)data)[i]) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffff;
+    }
+
+    static void makeRecord(CameraJournalRecord& r, uint32 index, const Matrix4x4f& m)
+    {
+        r.index = index;
+        memcpy(r.m, m.data(), sizeof(r.m));
+        r.crc = crc32(&r, offsetof(CameraJournalRecord, crc));
+    }
+
+    // Appends the valid records of fn to path and returns how many there
+    // were, or -1 if fn is missing or not a journal.
+    static int loadCameraJournal(CameraPath& path, const char* fn)
+    {
+        FILE* fp = fopen(fn, "rb");
+        if (!fp)
+            return -1;
+
+        CameraJournalHeader h;
+        if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, "KDCJ", 4) != 0 || h.version != cameraJournalVersion)
+        {
+            fprintf(stderr, "%s: not a camera journal\n", fn);
+            fclose(fp);
+            return -1;
+        }
+
+        int n = 0;
+        CameraJournalRecord r;
+        while (fread(&r, sizeof(r), 1, fp) == 1)
+        {
+            if (r.index != uint32(n) || r.crc != crc32(&r, offsetof(CameraJournalRecord, crc)))
+                break;
+
+            Matrix4x4f m;
+            memcpy(m.data(), r.m, sizeof(r.m));
+            path.add(m);
+            n++;
+        }
+
+        fclose(fp);
+        return n;
+    }
+
+    class CameraJournal
+    {
+    public:
+        CameraJournal() : fp(0), added(0), written(0), stop(false), flushNow(false) {}
+        ~CameraJournal() { close(); }
+
+        // Starts a new journal, or with append continues the valid part
+        // of an existing one. With append, a file that is there but can't
+        // be read as a journal (another version, damaged, a read error) is
+        // left alone and open fails; only a missing or empty file is
+        // started afresh.
+        bool open(const char* fn, bool append)
+        {
+            close();
+
+            uint32 count = 0;
+            if (append)
+            {
+                CameraPath old;
+                int n = loadCameraJournal(old, fn);
+                if (n >= 0)
+                {
+                    // Cut off anything after the last good record.
+                    count = n;
+                    if (truncate(fn, sizeof(CameraJournalHeader) + count * sizeof(CameraJournalRecord)) != 0)
+                        return false;
+                    fp = fopen(fn, "ab");
+                }
+                else
+                {
+                    struct stat st;
+                    const bool fresh = stat(fn, &st) == 0 ? st.st_size == 0 : errno == ENOENT;
+                    if (!fresh)
+                    {
+                        fprintf(stderr, "%s is not a journal this version can continue, not overwriting it\n", fn);
+                        return false;
+                    }
+                }
+            }
+
+            if (!fp)
+            {
+                count = 0;
+                fp = fopen(fn, "wb");
+                if (!fp)
+                {
+                    fprintf(stderr, "can't write %s\n", fn);
+                    return false;
+                }
+
+                CameraJournalHeader h;
+                memcpy(h.magic, "KDCJ", 4);
+                h.version = cameraJournalVersion;
+                if (fwrite(&h, sizeof(h), 1, fp) != 1 || fflush(fp) != 0)
+                {
+                    fprintf(stderr, "error writing %s\n", fn);
+                    fclose(fp);
+                    fp = 0;
+                    return false;
+                }
+            }
+
+            added = written = count;
+            stop = flushNow = false;
+            writer = std::thread(&CameraJournal::run, this);
+            return true;
+        }
+
+        // Writes what is queued and stops the writer.
+        void close()
+        {
+            if (!fp)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_one();
+            writer.join();
+
+            fclose(fp);
+            fp = 0;
+            pending.clear();
+        }
+
+        bool isOpen() const { return fp != 0; }
+
+        // Frames in the journal, written or queued.
+        uint32 size()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return added;
+        }
+
+        void add(const Matrix4x4f& m)
+        {
+            bool full;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(m);
+                added++;
+                full = pending.size() >= batchSize;
+            }
+            if (full)
+                wake.notify_one();
+        }
+
+        // Waits until everything added so far is in the file.
+        void sync()
+        {
+            if (!fp)
+                return;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            const uint32 target = added;
+            flushNow = true;
+            wake.notify_one();
+            done.wait(lock, [&] { return written >= target; });
+        }
+
+    private:
+        // Frames are written when this many are queued, on sync() and
+        // close(), and otherwise every flushInterval.
+        static const size_t batchSize = 256;
+        static const int flushInterval = 250;      // ms
+
+        void run()
+        {
+            std::vector<Matrix4x4f> batch;
+            std::vector<CameraJournalRecord> records;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                wake.wait_for(lock, std::chrono::milliseconds(int(flushInterval)),
+                    [&] { return stop || flushNow || pending.size() >= batchSize; });
+
+                const bool last = stop;
+                flushNow = false;
+                batch.swap(pending);
+                const uint32 first = added - uint32(batch.size());
+                lock.unlock();
+
+                if (!batch.empty())
+                {
+                    records.resize(batch.size());
+                    for (size_t i = 0; i < batch.size(); i++)
+                        makeRecord(records[i], first + uint32(i), batch[i]);
+
+                    fwrite(&records[0], sizeof(CameraJournalRecord), records.size(), fp);
+                    fflush(fp);
+                    batch.clear();
+                }
+
+                lock.lock();
+                written = first + uint32(records.size());
+                records.clear();
+                done.notify_all();
+
+                if (last && pending.empty())
+                    break;
+            }
+        }
+
+        FILE* fp;
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable wake, done;
+        std::vector<Matrix4x4f> pending;
+        uint32 added, written;     // frames
+        bool stop, flushNow;
+
+        CameraJournal(const CameraJournal&);
+        CameraJournal& operator=(const CameraJournal&);
+    };
+}
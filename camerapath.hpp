@@ -1,28 +1,159 @@
 #pragma once
 
 #include "math.hpp"
+#include <stdio.h>
+#include <algorithm>
 #include <vector>
 
 namespace kd
 {
+    //
+    // Camera paths are recorded as one view matrix per frame. compress()
+    // fits keyframes to them: camera position on a cubic Hermite spline
+    // with tangents taken from the recording, and rotation with squad,
+    // with keys added until every recorded frame is within the given
+    // tolerance. get() then interpolates between keys, so playback is
+    // smooth at any frame rate. Keys are approximate, so the frames stay
+    // the source whenever a path is recorded on.
+    //
+
+    struct CameraKey
+    {
+        float t;
+        Vector3f pos;           // camera position, not the view translation
+        Vector3f vel;           // d pos / dt
+        Quaternionf rot;        // view rotation
+        Vector3f spin;          // angular velocity, relative to rot
+    };
+
     class CameraPath
     {
     public:
+        // Recorded frames are this far apart in path time.
+        static constexpr float frameRate = 10.f;
+        static const int tangentWindow = 2;     // frames
+
         void add(const Matrix4x4f& m)
         {
             frames.push_back(m);
+            keys.clear();
         }
 
-        Matrix4x4f get(float t)
+        Matrix4x4f get(float t) const
         {
-            int i = int(t * 10.f);
+            if (!keys.empty())
+                return evaluate(t);
+
+            int i = int(t * frameRate);
             if (i < 0)
                 return frames[0];
-            if (i >= frames.size())
+            if (i >= (int)frames.size())
                 return frames[frames.size()-1];
             return frames[i];
         }
 
+        // Fits keys to frames. Tolerances are in world units and radians;
+        // the default angle is above the one degree a key press turns the
+        // camera, so recorded turns come out smooth instead of stepped.
+        void compress(float posTolerance = 0.25f, float angleTolerance = 0.03f)
+        {
+            const int n = (int)frames.size();
+            keys.clear();
+            if (n == 0)
+                return;
+
+            std::vector<CameraKey> samples(n);
+            for (int i = 0; i < n; i++)
+            {
+                samples[i] = toKey(frames[i], i / frameRate);
+                // q and -q are the same rotation; keep neighbours on the
+                // same side so that interpolation takes the short way.
+                if (i > 0 && dot(samples[i].rot, samples[i-1].rot) < 0.f)
+                    samples[i].rot = samples[i].rot * -1.f;
+            }
+
+            // Tangents come from the recording, not from the neighbouring
+            // keys, so they stay right however unevenly the keys end up
+            // spaced. Recording jitters, hence the wider difference.
+            for (int i = 0; i < n; i++)
+            {
+                const CameraKey& a = samples[std::max(i - tangentWindow, 0)];
+                const CameraKey& b = samples[std::min(i + tangentWindow, n - 1)];
+                CameraKey& c = samples[i];
+                if (b.t <= a.t)
+                    continue;
+
+                const float s = 1.f / (b.t - a.t);
+                c.vel = (b.pos - a.pos) * s;
+
+                const Quaternionf inv = conjugate(c.rot);
+                const Quaternionf w = quat_log(inv * b.rot) + quat_log(inv * a.rot) * -1.f;
+                c.spin = Vector3f(w.v.y, w.v.z, w.v.w) * s;
+            }
+
+            // Split every segment whose worst frame is off by more than
+            // the tolerance at that frame, until none is.
+            std::vector<int> index;
+            index.push_back(0);
+            if (n > 1)
+                index.push_back(n - 1);
+
+            for (;;)
+            {
+                useSamples(samples, index);
+
+                std::vector<int> split;
+                for (size_t k = 0; k + 1 < index.size(); k++)
+                {
+                    int worst = -1;
+                    float worstError = 1.f;
+                    for (int i = index[k] + 1; i < index[k+1]; i++)
+                    {
+                        const CameraKey& s = samples[i];
+                        Vector3f p;
+                        Quaternionf q;
+                        interpolate(k, s.t, p, q);
+
+                        const float e = std::max(length(p - s.pos) / posTolerance,
+                                                 rotationAngle(q, s.rot) / angleTolerance);
+                        if (e > worstError)
+                        {
+                            worst = i;
+                            worstError = e;
+                        }
+                    }
+                    if (worst >= 0)
+                        split.push_back(worst);
+                }
+
+                if (split.empty())
+                    break;
+
+                index.insert(index.end(), split.begin(), split.end());
+                std::sort(index.begin(), index.end());
+            }
+        }
+
+        // Keys as given, e.g. from an asset archive.
+        void setKeys(const std::vector<CameraKey>& k)
+        {
+            keys = k;
+            prepare();
+        }
+
+        // Samples the keys back into frames. Only as good as the keys, so
+        // not for anything that is saved as a recording.
+        void expand()
+        {
+            frames.clear();
+            if (keys.empty())
+                return;
+
+            const int n = int(keys.back().t * frameRate + 0.5f) + 1;
+            for (int i = 0; i < n; i++)
+                frames.push_back(evaluate(i / frameRate));
+        }
+
         void save(const char* fn)
         {
             FILE* fp = fopen(fn, "w");
@@ -35,9 +166,12 @@ namespace kd
             fclose(fp);
         }
 
-        void load(const char* fn)
+        // Returns false if fn can't be opened.
+        bool load(const char* fn)
         {
             FILE* fp = fopen(fn, "r");
+            if (!fp)
+                return false;
 
             for (;;)
             {
@@ -55,8 +189,131 @@ namespace kd
             }
 
             fclose(fp);
+            keys.clear();
+            return true;
+        }
+
+        bool empty() const
+        {
+            return frames.empty() && keys.empty();
         }
 
         std::vector<Matrix4x4f> frames;
+        std::vector<CameraKey> keys;
+
+    private:
+        static CameraKey toKey(const Matrix4x4f& m, float t)
+        {
+            // view = R * translate(-pos), so pos = -R^T * translation.
+            const Vector3f tr(m[3], m[7], m[11]);
+            CameraKey k;
+            k.t = t;
+            k.pos = -Vector3f(m[0] * tr.x + m[4] * tr.y + m[8] * tr.z,
+                              m[1] * tr.x + m[5] * tr.y + m[9] * tr.z,
+                              m[2] * tr.x + m[6] * tr.y + m[10] * tr.z);
+            k.rot = to_quaternion(m);
+            return k;
+        }
+
+        static Matrix4x4f toMatrix(const Vector3f& pos, const Quaternionf& rot)
+        {
+            Matrix4x4f m = to_matrix(rot);
+            const Vector3f tr = -Vector3f(m[0] * pos.x + m[1] * pos.y + m[2] * pos.z,
+                                          m[4] * pos.x + m[5] * pos.y + m[6] * pos.z,
+                                          m[8] * pos.x + m[9] * pos.y + m[10] * pos.z);
+            m[3] = tr.x;
+            m[7] = tr.y;
+            m[11] = tr.z;
+            return m;
+        }
+
+        // Not acos(dot(a, b)), which is too coarse near 1 in floats.
+        static float rotationAngle(const Quaternionf& a, const Quaternionf& b)
+        {
+            const Quaternionf d = conjugate(a) * b;
+            return 2.f * std::atan2(Vector3f(d.v.y, d.v.z, d.v.w).length(), std::abs(d.v.x));
+        }
+
+        void useSamples(const std::vector<CameraKey>& samples, const std::vector<int>& index)
+        {
+            keys.resize(index.size());
+            for (size_t k = 0; k < index.size(); k++)
+                keys[k] = samples[index[k]];
+            prepare();
+        }
+
+        // Squad controls for every key. Keys are unevenly spaced, so each
+        // has its own control for the segment before and after it, both
+        // from the key's angular velocity.
+        void prepare()
+        {
+            const int n = (int)keys.size();
+            controlsIn.resize(n);
+            controlsOut.resize(n);
+
+            for (int k = 0; k < n; k++)
+            {
+                if (k > 0 && dot(keys[k].rot, keys[k-1].rot) < 0.f)
+                    keys[k].rot = keys[k].rot * -1.f;
+            }
+
+            for (int k = 0; k < n; k++)
+            {
+                const CameraKey& a = keys[k > 0 ? k - 1 : k];
+                const CameraKey& b = keys[k + 1 < n ? k + 1 : k];
+                const CameraKey& c = keys[k];
+
+                const Quaternionf inv = conjugate(c.rot);
+                const Quaternionf in = quat_log(inv * a.rot);
+                const Quaternionf out = quat_log(inv * b.rot);
+                const Quaternionf w(0.f, c.spin.x, c.spin.y, c.spin.z);
+
+                controlsIn[k] = normalize(c.rot * quat_exp((w * (c.t - a.t) + in) * -0.5f));
+                controlsOut[k] = normalize(c.rot * quat_exp((w * (b.t - c.t) + out * -1.f) * 0.5f));
+            }
+        }
+
+        // Segment k runs from keys[k] to keys[k+1].
+        void interpolate(int k, float t, Vector3f& pos, Quaternionf& rot) const
+        {
+            const CameraKey& a = keys[k];
+            const CameraKey& b = keys[k+1];
+
+            const float h = b.t - a.t;
+            const float u = (t - a.t) / h;
+            const float u2 = u * u, u3 = u2 * u;
+
+            // Cubic Hermite with tangents scaled to the segment length.
+            const float h00 = 2.f*u3 - 3.f*u2 + 1.f;
+            const float h10 = u3 - 2.f*u2 + u;
+            const float h01 = -2.f*u3 + 3.f*u2;
+            const float h11 = u3 - u2;
+
+            pos = a.pos * h00 + a.vel * (h10 * h) + b.pos * h01 + b.vel * (h11 * h);
+            rot = squad(a.rot, controlsOut[k], controlsIn[k+1], b.rot, u);
+        }
+
+        static bool keyBefore(float t, const CameraKey& k)
+        {
+            return t < k.t;
+        }
+
+        // Binary search for the segment, O(log keys).
+        Matrix4x4f evaluate(float t) const
+        {
+            if (t <= keys.front().t || keys.size() == 1)
+                return toMatrix(keys.front().pos, keys.front().rot);
+            if (t >= keys.back().t)
+                return toMatrix(keys.back().pos, keys.back().rot);
+
+            const int k = int(std::upper_bound(keys.begin(), keys.end(), t, keyBefore) - keys.begin()) - 1;
+
+            Vector3f pos;
+            Quaternionf rot;
+            interpolate(k, t, pos, rot);
+            return toMatrix(pos, rot);
+        }
+
+        std::vector<Quaternionf> controlsIn, controlsOut;
     };
 }
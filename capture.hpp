@@ -0,0 +1,214 @@
+#pragma once
+
+#include "image.hpp"
+#include "framewriter.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kd
+{
+    //
+    // Records the live output. add() copies the frame into one of a fixed
+    // number of buffers and returns; a background thread encodes and
+    // writes the buffers in order. When encoding falls behind and every
+    // buffer is taken, add() drops the frame instead of waiting, so the
+    // render loop never stalls on the disk. Drops are reported from the
+    // background thread, at most once a second.
+    //
+    // The output runs at a fixed rate, so frames are placed by the time
+    // they are shown at: frame n of the output is the last one shown
+    // before (n + 0.5) / fps seconds. Where nothing was captured for a
+    // frame, because it was dropped or rendering was slower than the
+    // rate, the previous frame is written again. Frames shown faster than
+    // the rate are skipped. The stream then lasts as long as the show.
+    //
+
+    class FrameCapture
+    {
+    public:
+        FrameCapture()
+        :   fps(0), startTime(0.0), nextFrame(0), written(0), repeated(0), dropped(0), skipped(0),
+            stop(false), running(false)
+        {
+        }
+        ~FrameCapture() { close(); }
+
+        bool open(const char* name, FrameFormat format, int w, int h, int fps, int numBuffers = 8)
+        {
+            close();
+            if (!writer.open(name, format, w, h, fps))
+                return false;
+
+            buffers.resize(numBuffers);
+            frameNumbers.resize(numBuffers);
+            free.clear();
+            for (int i = 0; i < numBuffers; i++)
+            {
+                // Touched now so that the first frames don't page fault.
+                buffers[i].resize(w, h);
+                memset(buffers[i].row(0), 0, size_t(buffers[i].stride) * h * 4);
+                free.push_back(i);
+            }
+            queue.clear();
+
+            this->fps = fps;
+            nextFrame = 0;
+            written = repeated = dropped = skipped = 0;
+            stop = false;
+            running = true;
+            thread = std::thread(&FrameCapture::run, this);
+            return true;
+        }
+
+        // Writes what is queued, stops the thread and reports the drops.
+        // Returns false if anything failed to write.
+        bool close()
+        {
+            if (!running)
+                return true;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_one();
+            thread.join();
+            running = false;
+
+            fprintf(stderr, "capture: %d frames written, %d of them repeats; %d dropped, %d skipped\n",
+                written, repeated, dropped, skipped);
+            return writer.close();
+        }
+
+        bool isOpen() const { return running; }
+
+        // time is when the frame is shown, in seconds on any clock.
+        void add(const ImageView& img, double time)
+        {
+            int b = -1;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (nextFrame == 0)
+                    startTime = time;
+
+                const int64 frame = std::max(int64(0), int64(std::floor((time - startTime) * fps + 0.5)));
+                if (frame < nextFrame)
+                {
+                    skipped++;
+                    return;
+                }
+
+                nextFrame = frame + 1;
+                if (free.empty())
+                {
+                    dropped++;
+                    return;
+                }
+
+                b = free.back();
+                free.pop_back();
+                frameNumbers[b] = frame;
+            }
+
+            // The buffer is ours until it is queued.
+            Image& dst = buffers[b];
+            kd_assert(img.w == dst.w && img.h == dst.h);
+            for (int y = 0; y < img.h; y++)
+                memcpy(dst.row(y), img.row(y), size_t(img.w) * 4);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(b);
+            }
+            wake.notify_one();
+        }
+
+        int droppedFrames()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return dropped;
+        }
+
+    private:
+        void run()
+        {
+            std::vector<uint8> bytes, last;
+            int64 next = 0;         // output frame
+            int reported = 0;
+            std::chrono::steady_clock::time_point lastReport;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                wake.wait(lock, [&] { return stop || !queue.empty(); });
+                if (queue.empty())
+                    break;
+
+                const int b = queue.front();
+                queue.pop_front();
+                const int64 frame = frameNumbers[b];
+                lock.unlock();
+
+                writer.encode(bytes, buffers[b]);
+                const int repeats = writeRepeats(next, frame, last);
+                writer.write(int(frame), bytes);
+                next = frame + 1;
+                last.swap(bytes);
+
+                lock.lock();
+                free.push_back(b);
+                written += repeats + 1;
+                repeated += repeats;
+
+                const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if (dropped != reported && now - lastReport >= std::chrono::seconds(1))
+                {
+                    fprintf(stderr, "capture: encoding behind, %d frames dropped\n", dropped - reported);
+                    reported = dropped;
+                    lastReport = now;
+                }
+            }
+
+            // Drops after the last frame written.
+            const int repeats = writeRepeats(next, nextFrame, last);
+            written += repeats;
+            repeated += repeats;
+        }
+
+        // The last frame again for output frames [begin, end).
+        int writeRepeats(int64 begin, int64 end, const std::vector<uint8>& last)
+        {
+            if (last.empty())
+                return 0;
+            for (int64 n = begin; n < end; n++)
+                writer.write(int(n), last);
+            return int(std::max(int64(0), end - begin));
+        }
+
+        FrameWriter writer;
+        std::vector<Image> buffers;
+        std::vector<int64> frameNumbers;    // output frame of each buffer
+        int fps;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<int> free;              // buffers
+        std::deque<int> queue;              // buffers in frame order
+        double startTime;                   // of output frame 0
+        int64 nextFrame;                    // after the last one added
+        int written, repeated, dropped, skipped;
+        bool stop, running;
+
+        FrameCapture(const FrameCapture&);
+        FrameCapture& operator=(const FrameCapture&);
+    };
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "music.hpp"
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace kd
+{
+    //
+    // Schedules frames against vsync. With swaps locked to the display,
+    // the refresh period and the time of a vblank are estimated from when
+    // the swaps return, and from those the next vblank a frame can make
+    // given how long frames take to render. begin() sleeps until the
+    // latest start that still makes it and returns how far ahead of now
+    // the frame will be shown, so input is read as late as possible and
+    // the frame is rendered for the moment it is on screen rather than
+    // the moment it was begun.
+    //
+    // Swaps return at a vblank or, when the thread is slow to wake, after
+    // it. The period is the median of recent gaps, which a late return or
+    // a missed vblank doesn't move, and the vblank follows early returns
+    // at once and late ones only a little. A missed vblank widens the
+    // safety margin; frames that make it narrow it again slowly.
+    //
+    // Without vsync nothing sleeps and the lead is the render time.
+    //
+
+    class FramePacer
+    {
+    public:
+        FramePacer()
+        :   vsync(false), period(0.0), vblank(-1.0), renderTime(0.0), margin(minMargin),
+            frameStart(0.0), target(-1.0), lastSwap(-1.0), nextGap(0)
+        {
+        }
+
+        void setVsync(bool on) { vsync = on; }
+
+        // Call before reading input. Returns the seconds until the frame
+        // begun now will be on screen.
+        double begin()
+        {
+            double now = clockSeconds();
+
+            if (!vsync || vblank < 0.0)
+            {
+                frameStart = now;
+                target = -1.0;
+                return renderTime;
+            }
+
+            // The first vblank the frame can still make.
+            const double ready = now + renderTime + margin;
+            target = vblank + period * std::ceil((ready - vblank) / period);
+
+            const double start = target - renderTime - margin;
+            if (start > now)
+            {
+                std::this_thread::sleep_for(std::chrono::duration<double>(start - now));
+                now = std::max(start, clockSeconds());
+            }
+
+            frameStart = now;
+            return target - now;
+        }
+
+        // Call right before the swap.
+        void rendered()
+        {
+            // Render time follows increases at once and decreases slowly,
+            // a late frame costs more than an early one.
+            const double d = clockSeconds() - frameStart;
+            renderTime = d > renderTime ? d : renderTime + (d - renderTime) * 0.05;
+        }
+
+        // Call right after the swap.
+        void swapped()
+        {
+            const double now = clockSeconds();
+            if (!vsync)
+                return;
+
+            if (lastSwap >= 0.0 && (period <= 0.0 || now - lastSwap < period * 1.5))
+                addGap(now - lastSwap);
+            lastSwap = now;
+            if (period <= 0.0)
+                return;
+
+            if (vblank < 0.0)
+            {
+                vblank = now;
+                return;
+            }
+
+            const double k = std::max(1.0, std::floor((now - vblank) / period + 0.5));
+            const double expected = vblank + k * period;
+            const double err = now - expected;
+            if (std::fabs(err) > period * 0.25)
+                vblank = now;           // lost track
+            else
+                vblank = expected + std::min(err, period * maxLateStep);
+
+            // Shown a vblank later than planned.
+            if (target >= 0.0 && now > target + period * 0.5)
+                margin = std::min(period * 0.5, margin + 0.001);
+            else
+                margin = std::max(minMargin, margin * 0.99);
+        }
+
+        double getPeriod() const { return period; }
+
+    private:
+        static const int maxGaps = 15;
+        static const int minGaps = 5;
+        static constexpr double minMargin = 0.001;
+        static constexpr double maxLateStep = 0.01;     // periods per frame
+
+        void addGap(double d)
+        {
+            if ((int)gaps.size() < maxGaps)
+                gaps.push_back(d);
+            else
+                gaps[nextGap] = d;
+            nextGap = (nextGap + 1) % maxGaps;
+
+            if ((int)gaps.size() >= minGaps)
+            {
+                sorted = gaps;
+                std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+                period = sorted[sorted.size() / 2];
+            }
+        }
+
+        bool vsync;
+        double period;          // of the display, 0 until measured
+        double vblank;          // a recent one, -1 until measured
+        double renderTime;      // from begin() to rendered()
+        double margin;
+        double frameStart;
+        double target;          // vblank the frame is for, -1 if none
+        double lastSwap;
+        std::vector<double> gaps, sorted;
+        int nextGap;
+    };
+}
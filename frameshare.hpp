@@ -0,0 +1,312 @@
+#pragma once
+
+#include "image.hpp"
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+namespace kd
+{
+    //
+    // Finished frames in POSIX shared memory, for a compositor on the same
+    // machine. The writer copies each frame into the next slot of a ring;
+    // readers use the pixels where they are, with no copy of their own.
+    //
+    //   header | slot 0 | slot 1 | ...       slots page aligned
+    //
+    // Each slot has a sequence number that is odd while the slot is being
+    // written and 2n + 2 once it holds frame n, so a reader checks it
+    // before and after using the pixels to know they were not overwritten
+    // meanwhile: with the default three slots a reader has two frames'
+    // time. Readers sleep on a futex that the writer bumps after every
+    // frame and on close. It lives in the mapping, so unlike an eventfd
+    // there is no descriptor to hand over, and readers need only read
+    // access. Pixels are RGBA8, bottom row first.
+    //
+
+    struct FrameShareSlot
+    {
+        std::atomic<uint32> seq;
+        uint32 pad;
+        double time;                // demo time of the frame
+    };
+
+    struct FrameShareHeader
+    {
+        static const int maxSlots = 16;
+
+        std::atomic<uint32> magic;  // "KDFS" once the rest is filled in
+        uint32 version;
+        uint32 width, height;
+        uint32 stride;              // pixels
+        uint32 slots;
+        uint32 slotOffset;          // bytes from the start, of slot 0
+        uint32 slotBytes;
+
+        std::atomic<uint32> published;      // frames
+        std::atomic<uint32> closed;         // the writer is gone
+        std::atomic<uint32> wake;           // the futex
+
+        FrameShareSlot slot[maxSlots];
+    };
+
+    static const uint32 frameShareMagic = 0x5346444b;      // "KDFS"
+    static const uint32 frameShareVersion = 1;
+
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "atomics in shared memory must be lock free");
+
+    // Not the private variants, the word is shared between processes.
+    static long futexWait(const std::atomic<uint32>* word, uint32 value, const timespec* timeout)
+    {
+        return syscall(SYS_futex, (const uint32*)word, FUTEX_WAIT, value, timeout, 0, 0);
+    }
+
+    static long futexWakeAll(std::atomic<uint32>* word)
+    {
+        return syscall(SYS_futex, (uint32*)word, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+    }
+
+    static size_t frameShareSize(const FrameShareHeader& h)
+    {
+        return h.slotOffset + size_t(h.slotBytes) * h.slots;
+    }
+
+    class FrameShare
+    {
+    public:
+        FrameShare() : header(0), size(0), frames(0) {}
+        ~FrameShare() { close(); }
+
+        // name is a shm name such as /kakkidemo.
+        bool open(const char* shmName, int w, int h, int numSlots = 3)
+        {
+            close();
+            kd_assert(numSlots >= 2 && numSlots <= FrameShareHeader::maxSlots);
+
+            const size_t page = sysconf(_SC_PAGESIZE);
+            const uint32 stride = (w + Image::rowAlign - 1) & ~(Image::rowAlign - 1);
+            const size_t slotBytes = (size_t(stride) * h * 4 + page - 1) & ~(page - 1);
+            const size_t slotOffset = (sizeof(FrameShareHeader) + page - 1) & ~(page - 1);
+            size = slotOffset + slotBytes * numSlots;
+
+            // A fresh object each time, so that readers of an old run
+            // keep their mapping and don't see this one change under them.
+            shm_unlink(shmName);
+            const int fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 || ftruncate(fd, size) != 0)
+            {
+                fprintf(stderr, "can't create shared memory %s\n", shmName);
+                if (fd >= 0)
+                    ::close(fd);
+                return false;
+            }
+
+            void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED)
+            {
+                fprintf(stderr, "can't map shared memory %s\n", shmName);
+                shm_unlink(shmName);
+                return false;
+            }
+
+            // ftruncate zeroed it: every slot is empty and nothing is
+            // published.
+            header = (FrameShareHeader*)p;
+            header->version = frameShareVersion;
+            header->width = w;
+            header->height = h;
+            header->stride = stride;
+            header->slots = numSlots;
+            header->slotOffset = uint32(slotOffset);
+            header->slotBytes = uint32(slotBytes);
+            header->magic.store(frameShareMagic, std::memory_order_release);
+
+            name = shmName;
+            frames = 0;
+            return true;
+        }
+
+        // Wakes the readers, who then see closed, and removes the name.
+        void close()
+        {
+            if (!header)
+                return;
+
+            header->closed.store(1);
+            header->wake.fetch_add(1);
+            futexWakeAll(&header->wake);
+
+            munmap(header, size);
+            shm_unlink(name.c_str());
+            header = 0;
+        }
+
+        bool isOpen() const { return header != 0; }
+
+        void publish(const ImageView& img, double time)
+        {
+            kd_assert(uint32(img.w) == header->width && uint32(img.h) == header->height);
+
+            const uint32 n = frames++;
+            FrameShareSlot& s = header->slot[n % header->slots];
+            uint32* dst = (uint32*)((uint8*)header + header->slotOffset + size_t(header->slotBytes) * (n % header->slots));
+
+            // Seqlock: odd first, then the pixels, then even again.
+            s.seq.store(2 * n + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            s.time = time;
+            for (int y = 0; y < img.h; y++)
+                memcpy(dst + size_t(y) * header->stride, img.row(y), size_t(img.w) * 4);
+
+            s.seq.store(2 * n + 2, std::memory_order_release);
+
+            header->published.store(n + 1);
+            header->wake.fetch_add(1);
+            futexWakeAll(&header->wake);
+        }
+
+    private:
+        FrameShareHeader* header;
+        size_t size;
+        std::string name;
+        uint32 frames;
+
+        FrameShare(const FrameShare&);
+        FrameShare& operator=(const FrameShare&);
+    };
+
+    class FrameShareReader
+    {
+    public:
+        FrameShareReader() : header(0), size(0) {}
+        ~FrameShareReader() { close(); }
+
+        bool open(const char* shmName)
+        {
+            close();
+
+            const int fd = shm_open(shmName, O_RDONLY, 0);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            void* p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(FrameShareHeader))
+                p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED)
+                return false;
+
+            header = (FrameShareHeader*)p;
+            size = st.st_size;
+
+            // No magic yet means the writer is still setting up.
+            const uint32 magic = header->magic.load(std::memory_order_acquire);
+            const bool ok = magic == frameShareMagic && header->version == frameShareVersion &&
+                            frameShareSize(*header) <= size;
+            if (!ok && magic != 0)
+                fprintf(stderr, "%s: not a frame share\n", shmName);
+            if (!ok)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (header)
+                munmap((void*)header, size);
+            header = 0;
+        }
+
+        int width() const { return header->width; }
+        int height() const { return header->height; }
+        int stride() const { return header->stride; }
+
+        // Frames published so far.
+        uint32 published() const { return header->published.load(); }
+
+        bool closed() const { return header->closed.load() != 0; }
+
+        // Waits until more than seen frames are published, the writer
+        // closes, or timeoutMs passes, and returns published().
+        uint32 wait(uint32 seen, int timeoutMs)
+        {
+            timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            end.tv_sec += timeoutMs / 1000;
+            end.tv_nsec += (timeoutMs % 1000) * 1000000L;
+            if (end.tv_nsec >= 1000000000L)
+            {
+                end.tv_sec++;
+                end.tv_nsec -= 1000000000L;
+            }
+
+            // wake is read before published and closed, so a frame or
+            // close after the check changes it and the wait returns.
+            for (;;)
+            {
+                const uint32 w = header->wake.load();
+                if (header->published.load() != seen || closed())
+                    break;
+
+                timespec now, left;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                left.tv_sec = end.tv_sec - now.tv_sec;
+                left.tv_nsec = end.tv_nsec - now.tv_nsec;
+                if (left.tv_nsec < 0)
+                {
+                    left.tv_sec--;
+                    left.tv_nsec += 1000000000L;
+                }
+                if (left.tv_sec < 0)
+                    break;
+
+                futexWait(&header->wake, w, &left);
+            }
+            return header->published.load();
+        }
+
+        // Frame n in place, or 0 if it is not (or no longer) in the ring.
+        // Check valid(n) once done with the pixels.
+        const uint32* pixels(uint32 n) const
+        {
+            const FrameShareSlot& s = header->slot[n % header->slots];
+            if (s.seq.load(std::memory_order_acquire) != 2 * n + 2)
+                return 0;
+            return (const uint32*)((const uint8*)header + header->slotOffset + size_t(header->slotBytes) * (n % header->slots));
+        }
+
+        // True if frame n was not overwritten since pixels(n).
+        bool valid(uint32 n) const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return header->slot[n % header->slots].seq.load(std::memory_order_relaxed) == 2 * n + 2;
+        }
+
+        double time(uint32 n) const
+        {
+            return header->slot[n % header->slots].time;
+        }
+
+    private:
+        const FrameShareHeader* header;
+        size_t size;
+
+        FrameShareReader(const FrameShareReader&);
+        FrameShareReader& operator=(const FrameShareReader&);
+    };
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include "image.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace kd
+{
+    //
+    // Output for headless rendering. encode() turns a frame into bytes and
+    // can run for several frames at once; write() must then be called in
+    // frame order. Images are stored bottom row first as OpenGL draws
+    // them, so every format flips them to top row first.
+    //
+    //   raw  RGBA8 frames back to back, e.g. for ffmpeg -f rawvideo
+    //   y4m  YUV4MPEG2, 4:4:4, BT.709 limited range
+    //   png  one file per frame, the name a printf pattern like %05d.png
+    //
+    // Streams go to a file or, given "-", to stdout.
+    //
+
+    enum FrameFormat
+    {
+        FRAME_RAW,
+        FRAME_Y4M,
+        FRAME_PNG,
+    };
+
+    static bool parseFrameFormat(const char* s, FrameFormat& f)
+    {
+        if (strcmp(s, "raw") == 0)
+            f = FRAME_RAW;
+        else if (strcmp(s, "y4m") == 0)
+            f = FRAME_Y4M;
+        else if (strcmp(s, "png") == 0)
+            f = FRAME_PNG;
+        else
+            return false;
+        return true;
+    }
+
+    //
+    // Encoders.
+    //
+
+    static void encodeRaw(std::vector<uint8>& out, const ImageView& img)
+    {
+        const size_t rowBytes = size_t(img.w) * 4;
+        out.resize(rowBytes * img.h);
+        for (int y = 0; y < img.h; y++)
+            memcpy(&out[rowBytes * y], img.row(img.h - 1 - y), rowBytes);
+    }
+
+    // BT.709 in 16.16 fixed point, rounded.
+    static void encodeY4m(std::vector<uint8>& out, const ImageView& img)
+    {
+        static const char tag[] = "FRAME\n";
+        const size_t plane = size_t(img.w) * img.h;
+        out.resize(sizeof(tag) - 1 + 3 * plane);
+        memcpy(&out[0], tag, sizeof(tag) - 1);
+
+        uint8* py = &out[sizeof(tag) - 1];
+        uint8* pu = py + plane;
+        uint8* pv = pu + plane;
+
+        for (int y = 0; y < img.h; y++)
+        {
+            const uint32* src = img.row(img.h - 1 - y);
+            for (int x = 0; x < img.w; x++)
+            {
+                const int r = src[x] & 0xff, g = (src[x] >> 8) & 0xff, b = (src[x] >> 16) & 0xff;
+                *py++ = uint8(( 11966 * r + 40254 * g +  4064 * b + (16 << 16) + 32768) >> 16);
+                *pu++ = uint8((- 6596 * r - 22189 * g + 28784 * b + (128 << 16) + 32768) >> 16);
+                *pv++ = uint8(( 28784 * r - 26145 * g -  2639 * b + (128 << 16) + 32768) >> 16);
+            }
+        }
+    }
+
+    static void pngChunk(std::vector<uint8>& out, const char* type, const uint8* data, size_t size)
+    {
+        const uint8 len[4] = { uint8(size >> 24), uint8(size >> 16), uint8(size >> 8), uint8(size) };
+        out.insert(out.end(), len, len + 4);
+
+        const size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + size);
+
+        const uLong crc = ::crc32(0L, &out[start], uInt(out.size() - start));
+        const uint8 c[4] = { uint8(crc >> 24), uint8(crc >> 16), uint8(crc >> 8), uint8(crc) };
+        out.insert(out.end(), c, c + 4);
+    }
+
+    // RGB without alpha, each row with the Sub filter. Level 3 is several
+    // times faster than the default and barely larger on these frames.
+    static void encodePng(std::vector<uint8>& out, const ImageView& img)
+    {
+        const size_t rowBytes = 1 + size_t(img.w) * 3;
+        std::vector<uint8> raw(rowBytes * img.h);
+
+        for (int y = 0; y < img.h; y++)
+        {
+            const uint32* src = img.row(img.h - 1 - y);
+            uint8* dst = &raw[rowBytes * y];
+            *dst++ = 1;
+
+            uint32 prev = 0;
+            for (int x = 0; x < img.w; x++)
+            {
+                const uint32 p = src[x];
+                *dst++ = uint8(p - prev);
+                *dst++ = uint8((p >> 8) - (prev >> 8));
+                *dst++ = uint8((p >> 16) - (prev >> 16));
+                prev = p;
+            }
+        }
+
+        uLongf packedSize = compressBound(uLong(raw.size()));
+        std::vector<uint8> packed(packedSize);
+        if (compress2(&packed[0], &packedSize, &raw[0], uLong(raw.size()), 3) != Z_OK)
+            packedSize = 0;
+
+        static const uint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        const uint8 header[13] = {
+            uint8(img.w >> 24), uint8(img.w >> 16), uint8(img.w >> 8), uint8(img.w),
+            uint8(img.h >> 24), uint8(img.h >> 16), uint8(img.h >> 8), uint8(img.h),
+            8, 2, 0, 0, 0 };    // 8 bits, RGB, deflate, filtered, not interlaced
+
+        out.clear();
+        out.insert(out.end(), signature, signature + 8);
+        pngChunk(out, "IHDR", header, sizeof(header));
+        pngChunk(out, "IDAT", &packed[0], packedSize);
+        pngChunk(out, "IEND", 0, 0);
+    }
+
+    //
+    // Writer.
+    //
+
+    class FrameWriter
+    {
+    public:
+        FrameWriter() : format(FRAME_RAW), fp(0), ok(true) {}
+        ~FrameWriter() { close(); }
+
+        bool open(const char* name, FrameFormat f, int w, int h, int fps)
+        {
+            close();
+            format = f;
+            pattern = name;
+            ok = true;
+
+            if (format == FRAME_PNG)
+                return true;
+
+            fp = strcmp(name, "-") == 0 ? stdout : fopen(name, "wb");
+            if (!fp)
+            {
+                fprintf(stderr, "can't write %s\n", name);
+                return false;
+            }
+
+            if (format == FRAME_Y4M)
+                fprintf(fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n", w, h, fps);
+            return true;
+        }
+
+        // Returns false if anything failed to write.
+        bool close()
+        {
+            if (fp)
+            {
+                if (fflush(fp) != 0 || ferror(fp))
+                    ok = false;
+                if (fp != stdout)
+                    fclose(fp);
+                fp = 0;
+            }
+            return ok;
+        }
+
+        void encode(std::vector<uint8>& out, const ImageView& img) const
+        {
+            if (format == FRAME_RAW)
+                encodeRaw(out, img);
+            else if (format == FRAME_Y4M)
+                encodeY4m(out, img);
+            else
+                encodePng(out, img);
+        }
+
+        bool write(int frame, const std::vector<uint8>& data)
+        {
+            if (format != FRAME_PNG)
+            {
+                if (fwrite(&data[0], 1, data.size(), fp) != data.size())
+                    ok = false;
+                return ok;
+            }
+
+            char fn[1024];
+            snprintf(fn, sizeof(fn), pattern.c_str(), frame);
+            FILE* f = fopen(fn, "wb");
+            bool written = f && fwrite(&data[0], 1, data.size(), f) == data.size();
+            if (f && fclose(f) != 0)
+                written = false;
+            if (!written)
+            {
+                fprintf(stderr, "can't write %s\n", fn);
+                ok = false;
+            }
+            return ok;
+        }
+
+    private:
+        FrameFormat format;
+        std::string pattern;
+        FILE* fp;
+        bool ok;
+
+        FrameWriter(const FrameWriter&);
+        FrameWriter& operator=(const FrameWriter&);
+    };
+}
@@ -1,20 +1,244 @@
 #pragma once
 
 #include "defs.hpp"
+#include "math.hpp"
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <mutex>
+#include <new>
+#include <vector>
 
 #include "SDL_image.h"
 
 namespace kd
 {
+    //
+    // Colour conversion. Pixels are RGBA8 with red in the low byte; a
+    // float channel c becomes int(c * 256) clamped to [0, 255] and a code
+    // k becomes k * (1 / 255), which is what -ffast-math made of the
+    // division anyway. The clamp is done by the saturating packs, so a
+    // pixel costs a handful of instructions instead of four clamps and
+    // shifts per channel.
+    //
+
+    static inline uint32 packColor(const Vector4f& c)
+    {
+        // min with 255 first keeps huge values from wrapping in the
+        // conversion; NaN still ends up as 0.
+        __m128i i = _mm_cvttps_epi32(_mm_min_ps(_mm_set1_ps(255.f), _mm_mul_ps(c.simd().v, _mm_set1_ps(256.f))));
+        i = _mm_packs_epi32(i, i);
+        return _mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+    }
+
+    static inline Vector4f unpackColor(uint32 pixel)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+        return floatx4(_mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.f / 255.f)));
+    }
+
+    // n pixels, four per step.
+    static void packColors(uint32* dst, const Vector4f* src, int n)
+    {
+        const __m128 s = _mm_set1_ps(256.f), lim = _mm_set1_ps(255.f);
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i p[4];
+            for (int k = 0; k < 4; k++)
+                p[k] = _mm_cvttps_epi32(_mm_min_ps(lim, _mm_mul_ps(src[i+k].simd().v, s)));
+
+            __m128i lo = _mm_packs_epi32(p[0], p[1]);
+            __m128i hi = _mm_packs_epi32(p[2], p[3]);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+        for (; i < n; i++)
+            dst[i] = packColor(src[i]);
+    }
+
+    static void unpackColors(Vector4f* dst, const uint32* src, int n)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 s = _mm_set1_ps(1.f / 255.f);
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+            dst[i+0] = floatx4(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), s));
+            dst[i+1] = floatx4(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), s));
+            dst[i+2] = floatx4(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), s));
+            dst[i+3] = floatx4(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), s));
+        }
+        for (; i < n; i++)
+            dst[i] = unpackColor(src[i]);
+    }
+
+    // Same conversions for a packet of pixels with the channels in SoA
+    // form, one pixel per lane.
+    template<typename F>
+    inline typename simd_traits<F>::int_type packColor(const Vector4x<F>& c)
+    {
+        const F hi(255.f), s(256.f);
+
+        return pack_rgba8(
+            to_int(min(hi, c.x * s)),
+            to_int(min(hi, c.y * s)),
+            to_int(min(hi, c.z * s)),
+            to_int(min(hi, c.w * s)));
+    }
+
+    template<typename F>
+    inline Vector4x<F> unpackColor(const typename simd_traits<F>::int_type& pixels)
+    {
+        typedef typename simd_traits<F>::int_type I;
+
+        const I mask(0xff);
+        const F s(1.f / 255.f);
+
+        return Vector4x<F>(
+            to_float(pixels & mask) * s,
+            to_float((pixels >> 8) & mask) * s,
+            to_float((pixels >> 16) & mask) * s,
+            to_float((pixels >> 24) & mask) * s);
+    }
+
+    //
+    // Pixel memory for Images. Blocks are 64 byte aligned and go back to
+    // the pool instead of the heap, so images that are resized or created
+    // per frame reuse earlier blocks. The cache is bounded: past
+    // maxBlocks blocks or maxBytes bytes the oldest blocks go back to the
+    // heap. Thread safe.
+    //
+
+    class ImagePool
+    {
+    public:
+        // At least `bytes` bytes; *capacity receives the real size.
+        void* acquire(size_t bytes, size_t* capacity)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Best fit, but never more than twice the request.
+            int best = -1;
+            for (int i = 0; i < (int)blocks.size(); i++)
+                if (blocks[i].size >= bytes && blocks[i].size <= 2 * bytes &&
+                    (best < 0 || blocks[i].size < blocks[best].size))
+                    best = i;
+
+            if (best >= 0)
+            {
+                Block b = blocks[best];
+                blocks.erase(blocks.begin() + best);
+                cached -= b.size;
+                *capacity = b.size;
+                return b.data;
+            }
+
+            // Out of memory, the cache is the first thing to give up.
+            *capacity = (bytes + 63) & ~size_t(63);
+            void* p = aligned_alloc(64, *capacity);
+            if (!p && !blocks.empty())
+            {
+                evict(0, 0);
+                p = aligned_alloc(64, *capacity);
+            }
+            if (!p)
+                throw std::bad_alloc();
+            return p;
+        }
+
+        void release(void* data, size_t capacity)
+        {
+            if (!data)
+                return;
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (capacity > maxBytes)
+            {
+                free(data);
+                return;
+            }
+
+            evict(maxBlocks - 1, maxBytes - capacity);
+            Block b = { data, capacity };
+            blocks.push_back(b);
+            cached += capacity;
+        }
+
+        // Returns every cached block to the heap.
+        void trim()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            evict(0, 0);
+        }
+
+        size_t cachedBytes()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return cached;
+        }
+
+    private:
+        struct Block
+        {
+            void* data;
+            size_t size;
+        };
+
+        static const int maxBlocks = 64;
+        static const size_t maxBytes = size_t(256) << 20;
+
+        // Frees the oldest blocks until at most n and bytes are left. With
+        // the mutex held.
+        void evict(int n, size_t bytes)
+        {
+            size_t i = 0;
+            for (; i < blocks.size() && (int(blocks.size() - i) > n || cached > bytes); i++)
+            {
+                free(blocks[i].data);
+                cached -= blocks[i].size;
+            }
+            blocks.erase(blocks.begin(), blocks.begin() + i);
+        }
+
+        std::mutex mutex;
+        std::vector<Block> blocks;      // oldest first
+        size_t cached;
+
+        ImagePool() : cached(0) {}
+        friend ImagePool& imagePool();
+    };
+
+    // One pool for the whole program. Never destroyed, so static Images
+    // can still release into it at exit.
+    inline ImagePool& imagePool()
+    {
+        static ImagePool* pool = new ImagePool;
+        return *pool;
+    }
+
+    //
+    // RGBA8 image. Rows start on 64 byte boundaries: pixel (x, y) is
+    // data[y*stride+x] and stride may be larger than w. Images own their
+    // pixels and can be moved but not copied.
+    //
+
     class Image
     {
     public:
-        Image() : w(0), h(0), data(0) {}
+        static const int rowAlign = 16;     // pixels, 64 bytes
+
+        Image() : w(0), h(0), stride(0), data(0), capacity(0) {}
         ~Image() { destroy(); }
 
-        Image(std::string filename)
+        Image(std::string filename) : w(0), h(0), stride(0), data(0), capacity(0)
         {
             SDL_Surface* surface = IMG_Load(filename.c_str());
 
@@ -24,7 +248,7 @@ namespace kd
 
             for (int y = 0; y < surface->h; y++)
             {
-                memcpy(static_cast<uint32*>(data) + y*w,
+                memcpy(row(y),
                         static_cast<uint8*>(surface->pixels) + y*surface->pitch,
                         w*4);
             }
@@ -32,54 +256,412 @@ namespace kd
             SDL_FreeSurface(surface);
         }
 
+        Image(Image&& o) : w(o.w), h(o.h), stride(o.stride), data(o.data), capacity(o.capacity)
+        {
+            o.w = o.h = o.stride = 0;
+            o.data = 0;
+            o.capacity = 0;
+        }
+
+        Image& operator=(Image&& o)
+        {
+            if (this != &o)
+            {
+                destroy();
+                w = o.w;
+                h = o.h;
+                stride = o.stride;
+                data = o.data;
+                capacity = o.capacity;
+                o.w = o.h = o.stride = 0;
+                o.data = 0;
+                o.capacity = 0;
+            }
+            return *this;
+        }
+
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
         void destroy()
         {
-            if (data)
-                free(data);
-            w = h = 0;
+            imagePool().release(data, capacity);
+            w = h = stride = 0;
             data = 0;
+            capacity = 0;
         }
 
+        // Contents are undefined afterwards. Keeps the current block when
+        // it is big enough.
         void resize(int nw, int nh)
         {
-            destroy();
+            const int nstride = (nw + rowAlign - 1) & ~(rowAlign - 1);
+            const size_t bytes = size_t(nstride) * nh * 4;
+
+            if (bytes > capacity || !data)
+            {
+                imagePool().release(data, capacity);
+                data = (uint32*)imagePool().acquire(std::max(bytes, size_t(64)), &capacity);
+            }
 
             w = nw;
             h = nh;
-            data = (uint32*)malloc(w*h*4);
+            stride = nstride;
         }
 
-        void put(int x, int y, Vector4f c)
+        uint32* row(int y) { return data + size_t(y) * stride; }
+        const uint32* row(int y) const { return data + size_t(y) * stride; }
+
+        void put(int x, int y, const Vector4f& c)
         {
             kd_assert(x >= 0 && x < w);
             kd_assert(y >= 0 && y < h);
 
-            int r = std::max(0, std::min(255, int(c.x * 256.f)));
-            int g = std::max(0, std::min(255, int(c.y * 256.f)));
-            int b = std::max(0, std::min(255, int(c.z * 256.f)));
-            int a = std::max(0, std::min(255, int(c.w * 256.f)));
+            data[y*stride+x] = packColor(c);
+        }
+
+        Vector4f get(int x, int y) const
+        {
+            return unpackColor(data[y*stride+x]);
+        }
+
+        int w, h;
+        int stride;     // pixels
+        uint32* data;
+
+    private:
+        size_t capacity;    // bytes
+    };
+
+    //
+    // Non-owning rectangle of an Image. data points at the view's first
+    // pixel, so kernels address it as row(y)[x] like a whole image; x and
+    // y give its origin in the image for kernels whose result depends on
+    // absolute position. Views do not carry constness: kernels take the
+    // images they only read as const ImageView&.
+    //
+
+    struct ImageView
+    {
+        ImageView() : data(0), x(0), y(0), w(0), h(0), stride(0) {}
+
+        ImageView(const Image& img)
+        :   data(const_cast<uint32*>(img.data)), x(0), y(0), w(img.w), h(img.h), stride(img.stride)
+        {
+        }
+
+        ImageView sub(int sx, int sy, int sw, int sh) const
+        {
+            kd_assert(sx >= 0 && sy >= 0 && sw >= 0 && sh >= 0);
+            kd_assert(sx + sw <= w && sy + sh <= h);
+
+            ImageView v = *this;
+            v.data = data + size_t(sy) * stride + sx;
+            v.x = x + sx;
+            v.y = y + sy;
+            v.w = sw;
+            v.h = sh;
+            return v;
+        }
+
+        uint32* row(int r) const { return data + size_t(r) * stride; }
+
+        void put(int px, int py, const Vector4f& c) const
+        {
+            kd_assert(px >= 0 && px < w);
+            kd_assert(py >= 0 && py < h);
+
+            data[py*stride+px] = packColor(c);
+        }
+
+        Vector4f get(int px, int py) const
+        {
+            return unpackColor(data[py*stride+px]);
+        }
+
+        uint32* data;
+        int x, y;       // origin in the image
+        int w, h;
+        int stride;     // pixels
+    };
+
+    //
+    // Image stored as square tiles (8x8 or 32x32, any power of two from 4),
+    // each tile row-major and contiguous, tiles in row-major order. A
+    // 32x32 tile is one 4 KB page, so tile jobs and 2D gathers touch a few
+    // pages where row-major rows at high resolution are each a page apart.
+    // tile() is an ordinary ImageView with the tile size as stride, so
+    // every kernel can draw into it. linearize() converts for presenting.
+    //
+
+    class TiledImage
+    {
+    public:
+        TiledImage() : w(0), h(0), shift(0), tilesX(0), tilesY(0), data(0), capacity(0) {}
+        ~TiledImage() { destroy(); }
 
-            data[y*w+x] = r | (g<<8) | (b<<16) | (a<<24);
+        void destroy()
+        {
+            imagePool().release(data, capacity);
+            w = h = shift = tilesX = tilesY = 0;
+            data = 0;
+            capacity = 0;
         }
 
-        float toF(const uint8& comp)
+        // Contents are undefined afterwards.
+        void resize(int nw, int nh, int tileSize)
         {
-            return float(comp) / float(255);
+            kd_assert(tileSize >= 4 && (tileSize & (tileSize - 1)) == 0);
+
+            int nshift = 0;
+            while ((1 << nshift) < tileSize)
+                nshift++;
+
+            const int ntx = (nw + tileSize - 1) >> nshift;
+            const int nty = (nh + tileSize - 1) >> nshift;
+            const size_t bytes = (size_t(ntx) * nty << (2 * nshift)) * 4;
+
+            if (bytes > capacity || !data)
+            {
+                imagePool().release(data, capacity);
+                data = (uint32*)imagePool().acquire(std::max(bytes, size_t(64)), &capacity);
+            }
+
+            w = nw;
+            h = nh;
+            shift = nshift;
+            tilesX = ntx;
+            tilesY = nty;
         }
 
-        Vector4f get(int x, int y)
+        int tileSize() const { return 1 << shift; }
+
+        uint32* tileData(int tx, int ty) const
         {
-            const uint32& pixel = data[y*w+x];
+            return data + ((size_t(ty) * tilesX + tx) << (2 * shift));
+        }
 
-            const uint8 r = pixel & 0xff;
-            const uint8 g = (pixel>> 8) & 0xff;
-            const uint8 b = (pixel>>16) & 0xff;
-            const uint8 a = (pixel>>24) & 0xff;
+        uint32* pixel(int x, int y) const
+        {
+            const int mask = (1 << shift) - 1;
+            return tileData(x >> shift, y >> shift) + ((y & mask) << shift) + (x & mask);
+        }
 
-            return Vector4f(toF(r), toF(g), toF(b), toF(a));
+        // Edge tiles are clipped to the image.
+        ImageView tile(int tx, int ty) const
+        {
+            ImageView v;
+            v.data = tileData(tx, ty);
+            v.x = tx << shift;
+            v.y = ty << shift;
+            v.w = std::min(tileSize(), w - v.x);
+            v.h = std::min(tileSize(), h - v.y);
+            v.stride = tileSize();
+            return v;
         }
 
         int w, h;
+        int shift;      // log2 of the tile size
+        int tilesX, tilesY;
         uint32* data;
+
+    private:
+        size_t capacity;    // bytes
+
+        TiledImage(const TiledImage&);
+        TiledImage& operator=(const TiledImage&);
+    };
+
+    static inline uint32* pixelAt(const ImageView& v, int x, int y) { return v.row(y) + x; }
+    static inline uint32* pixelAt(const TiledImage& t, int x, int y) { return t.pixel(x, y); }
+
+    // Copies rows [y0, y1) of src into the same rows of dst.
+    static void linearize(const ImageView& dst, const TiledImage& src, int y0, int y1)
+    {
+        kd_assert(dst.w == src.w && dst.h == src.h);
+
+        const int T = src.tileSize();
+
+        for (int y = y0; y < y1; y++)
+        {
+            uint32* d = dst.row(y);
+            const uint32* s = src.pixel(0, y);
+            const size_t tileStep = size_t(T) * T;
+
+            int x = 0;
+            for (; x + T <= dst.w; x += T, d += T, s += tileStep)
+                for (int i = 0; i < T; i += 4)
+                    _mm_storeu_si128((__m128i*)(d + i), _mm_load_si128((const __m128i*)(s + i)));
+            if (x < dst.w)
+                memcpy(d, s, (dst.w - x) * 4);
+        }
+    }
+
+    // Inverse of linearize.
+    static void tileRows(const TiledImage& dst, const ImageView& src, int y0, int y1)
+    {
+        kd_assert(dst.w == src.w && dst.h == src.h);
+
+        const int T = dst.tileSize();
+
+        for (int y = y0; y < y1; y++)
+        {
+            const uint32* s = src.row(y);
+            uint32* d = dst.pixel(0, y);
+            const size_t tileStep = size_t(T) * T;
+
+            int x = 0;
+            for (; x + T <= src.w; x += T, s += T, d += tileStep)
+                for (int i = 0; i < T; i += 4)
+                    _mm_store_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(s + i)));
+            if (x < src.w)
+                memcpy(d, s, (src.w - x) * 4);
+        }
+    }
+
+    //
+    // Additive accumulation target for splats. Holds premultiplied colour
+    // sums per pixel, as floats or as saturating 16-bit fixed point in
+    // 1/256 units, and is added onto an RGBA8 image in one pass by
+    // resolveAccum(). Alpha is never accumulated.
+    //
+
+    class AccumImage
+    {
+    public:
+        enum Format
+        {
+            FLOAT32,    // 4 x float per pixel
+            UINT16,     // 4 x uint16 per pixel
+        };
+
+        AccumImage() : w(0), h(0), format(FLOAT32), data(0), capacity(0) {}
+        ~AccumImage() { destroy(); }
+
+        void destroy()
+        {
+            imagePool().release(data, capacity);
+            w = h = 0;
+            data = 0;
+            capacity = 0;
+        }
+
+        void resize(int nw, int nh, Format f)
+        {
+            if (nw == w && nh == h && f == format)
+                return;
+
+            destroy();
+
+            // From the pool like Image's pixels, so running out of memory
+            // evicts the cache and then throws std::bad_alloc.
+            format = f;
+            data = imagePool().acquire(std::max(size_t(nw) * nh * pixelSize(), size_t(64)), &capacity);
+            w = nw;
+            h = nh;
+            clear();
+        }
+
+        void clear()
+        {
+            memset(data, 0, size_t(w) * h * pixelSize());
+        }
+
+        int pixelSize() const
+        {
+            return format == FLOAT32 ? 16 : 8;
+        }
+
+        float* row32(int y)
+        {
+            kd_assert(format == FLOAT32);
+            return (float*)data + size_t(y) * w * 4;
+        }
+
+        uint16* row16(int y)
+        {
+            kd_assert(format == UINT16);
+            return (uint16*)data + size_t(y) * w * 4;
+        }
+
+        int w, h;
+        Format format;
+        void* data;
+
+    private:
+        size_t capacity;    // bytes
+
+        AccumImage(const AccumImage&);
+        AccumImage& operator=(const AccumImage&);
     };
+
+    // Adds an AccumImage onto one RGBA8 pixel per lane: i holds the pixel
+    // in 32-bit lanes, a the accumulated colour already scaled by 256.
+    static inline __m128i resolvePixel(__m128i i, __m128 a)
+    {
+        __m128 c = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(256.f / 255.f)), a);
+        return _mm_cvttps_epi32(c);
+    }
+
+    // dst += acc for rows [y0, y1), same rounding and clamping as
+    // Image::put. Clears those rows of acc for the next frame.
+    static void resolveAccum(const ImageView& dst, AccumImage& acc, int y0, int y1)
+    {
+        kd_assert(dst.w == acc.w && dst.h == acc.h);
+
+        const __m128i zero = _mm_setzero_si128();
+
+        for (int y = y0; y < y1; y++)
+        {
+            uint32* d = dst.row(y);
+
+            // Accumulator as four floats per pixel, scaled to output codes.
+            __m128 a[4];
+            float* a32 = acc.format == AccumImage::FLOAT32 ? acc.row32(y) : 0;
+            uint16* a16 = acc.format == AccumImage::UINT16 ? acc.row16(y) : 0;
+
+            int x = 0;
+            for (; x + 4 <= dst.w; x += 4)
+            {
+                for (int k = 0; k < 4; k++)
+                {
+                    if (a32)
+                        a[k] = _mm_mul_ps(_mm_load_ps(a32 + (x+k)*4), _mm_set1_ps(256.f));
+                    else
+                        a[k] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(a16 + (x+k)*4)), zero));
+                }
+
+                __m128i p = _mm_loadu_si128((const __m128i*)(d + x));
+                __m128i lo = _mm_unpacklo_epi8(p, zero);
+                __m128i hi = _mm_unpackhi_epi8(p, zero);
+
+                __m128i r0 = resolvePixel(_mm_unpacklo_epi16(lo, zero), a[0]);
+                __m128i r1 = resolvePixel(_mm_unpackhi_epi16(lo, zero), a[1]);
+                __m128i r2 = resolvePixel(_mm_unpacklo_epi16(hi, zero), a[2]);
+                __m128i r3 = resolvePixel(_mm_unpackhi_epi16(hi, zero), a[3]);
+
+                _mm_storeu_si128((__m128i*)(d + x),
+                    _mm_packus_epi16(_mm_packs_epi32(r0, r1), _mm_packs_epi32(r2, r3)));
+            }
+
+            for (; x < dst.w; x++)
+            {
+                __m128 ax;
+                if (a32)
+                    ax = _mm_mul_ps(_mm_load_ps(a32 + x*4), _mm_set1_ps(256.f));
+                else
+                    ax = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(a16 + x*4)), zero));
+
+                __m128i p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(d[x]), zero), zero);
+                __m128i r = resolvePixel(p, ax);
+                r = _mm_packus_epi16(_mm_packs_epi32(r, r), zero);
+                d[x] = _mm_cvtsi128_si32(r);
+            }
+
+            if (a32)
+                memset(a32, 0, size_t(acc.w) * 16);
+            else
+                memset(a16, 0, size_t(acc.w) * 8);
+        }
+    }
 }
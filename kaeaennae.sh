@@ -1 +1,26 @@
-g++ -DNDEBUG -g -O3 -ffast-math -fomit-frame-pointer -march=native -I/usr/include/SDL main.cpp -o kakkidemo -lSDL -lSDL_image -lSDL_mixer -lGL || exit 1
\ No newline at end of file
+FLAGS="-DNDEBUG -g -O3 -ffast-math -fomit-frame-pointer -I/usr/include/SDL"
+
+g++ $FLAGS -march=x86-64    -c main.cpp           -o main.o           || exit 1
+g++ $FLAGS -march=x86-64    -c kernels_sse2.cpp   -o kernels_sse2.o   || exit 1
+g++ $FLAGS -march=x86-64-v2 -c kernels_sse4.cpp   -o kernels_sse4.o   || exit 1
+g++ $FLAGS -march=x86-64-v3 -c kernels_avx2.cpp   -o kernels_avx2.o   || exit 1
+g++ $FLAGS -march=x86-64-v4 -c kernels_avx512.cpp -o kernels_avx512.o || exit 1
+
+# Inline code that the kernel files share would be merged by the linker
+# into one ISA's copy for all of them. Everything they instantiate carries
+# the ISA in its name instead (KD_SIMD_NAMESPACE, KernelAllocator); this
+# catches what slips through.
+if nm -C --defined-only kernels_*.o | grep ' [WVu] ' | grep -v 'simd_'
+then
+    echo "kernel objects share inline code, see simd.hpp"
+    exit 1
+fi
+g++ main.o kernels_sse2.o kernels_sse4.o kernels_avx2.o kernels_avx512.o -o kakkidemo -lSDL -lSDL_image -lSDL_mixer -lGL -lz -lpthread -lrt || exit 1
+
+g++ $FLAGS -march=native bench.cpp -o bench -lSDL -lGL || exit 1
+g++ $FLAGS -march=x86-64 pointconv.cpp -o pointconv || exit 1
+g++ $FLAGS -march=x86-64 camconv.cpp -o camconv -lpthread || exit 1
+g++ $FLAGS -march=x86-64 renderfarm.cpp -o renderfarm || exit 1
+g++ $FLAGS -march=x86-64 sharegrab.cpp -o sharegrab -lz -lrt || exit 1
+g++ $FLAGS -march=x86-64 assetpack.cpp -o assetpack -lSDL -lSDL_image || exit 1
+./assetpack assets.kda assets/title.png camera.txt assets/musa.ogg > /dev/null || exit 1
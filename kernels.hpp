@@ -0,0 +1,94 @@
+#pragma once
+
+#include "defs.hpp"
+#include "math.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace kd
+{
+    class Image;
+    struct ImageView;
+    class TiledImage;
+    class Camera;
+    struct RayTracer;
+    struct PlotPixels;
+    struct PlotBins;
+    struct ChunkDraw;
+    class AccumImage;
+
+    //
+    // The hot kernels are compiled once per ISA level (kernels_*.cpp, see
+    // kaeaennae.sh for the flags) and picked at startup from cpuid. Set
+    // KD_ISA=sse2|sse4|avx2|avx512 to force a level for testing.
+    //
+
+    struct Kernels
+    {
+        const char* name;
+
+        void (*raytraceSub)(RayTracer& rt, const ImageView& dst);
+        void (*blurh)(const ImageView& dst, const ImageView& src);
+        void (*blurv)(const ImageView& dst, const ImageView& src);
+        void (*wobbler)(const ImageView& dst, const ImageView& src, float a, float b, float c);
+        void (*binPixels)(PlotBins& bins, int slot, const Camera& cam, const PlotPixels& pp, const ChunkDraw* draws, int numDraws);
+        void (*splatTiles)(const ImageView& dst, const PlotBins& bins, int ty0, int ty1);
+        void (*splatTilesTiled)(const TiledImage& dst, const PlotBins& bins, int ty0, int ty1);
+        void (*splatTilesAccum)(AccumImage& acc, const PlotBins& bins, int ty0, int ty1);
+        void (*resolveAccum)(const ImageView& dst, AccumImage& acc, int y0, int y1);
+        void (*packPixels)(uint32* dst, const Vector4f* src, int n);
+        void (*unpackPixels)(Vector4f* dst, const uint32* src, int n);
+        void (*fillSphere)(PlotPixels& pp, int first, const Vector3f& p, float r, int n, int begin, int end);
+        void (*fillImage)(PlotPixels& pp, int first, const Vector3f& p, const ImageView& img, float sx, float sy, int y0, int y1);
+    };
+
+    extern const Kernels kernels_sse2;     // x86-64
+    extern const Kernels kernels_sse4;     // x86-64-v2
+    extern const Kernels kernels_avx2;     // x86-64-v3
+    extern const Kernels kernels_avx512;   // x86-64-v4
+
+    static bool cpuSupports(const Kernels& k)
+    {
+        __builtin_cpu_init();
+
+        if (&k == &kernels_avx512)
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                   __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl") &&
+                   cpuSupports(kernels_avx2);
+        if (&k == &kernels_avx2)
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+                   __builtin_cpu_supports("bmi2") && cpuSupports(kernels_sse4);
+        if (&k == &kernels_sse4)
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        return true;
+    }
+
+    static const Kernels* selectKernels()
+    {
+        static const Kernels* const levels[] = { &kernels_avx512, &kernels_avx2, &kernels_sse4, &kernels_sse2 };
+        const int numLevels = sizeof(levels) / sizeof(levels[0]);
+
+        const char* force = getenv("KD_ISA");
+        if (force)
+        {
+            for (int i = 0; i < numLevels; i++)
+            {
+                if (strcmp(force, levels[i]->name) != 0)
+                    continue;
+                if (cpuSupports(*levels[i]))
+                    return levels[i];
+                fprintf(stderr, "KD_ISA=%s not supported by this cpu\n", force);
+                break;
+            }
+            if (strcmp(force, "sse2") && strcmp(force, "sse4") && strcmp(force, "avx2") && strcmp(force, "avx512"))
+                fprintf(stderr, "unknown KD_ISA=%s\n", force);
+        }
+
+        for (int i = 0; i < numLevels; i++)
+            if (cpuSupports(*levels[i]))
+                return levels[i];
+
+        return &kernels_sse2;
+    }
+}
@@ -0,0 +1,9 @@
+// Kernels for -march=x86-64-v3 (AVX2, FMA).
+
+#ifndef __AVX2__
+#error "kernels_avx2.cpp must be built with -march=x86-64-v3"
+#endif
+
+#define KD_KERNELS      kernels_avx2
+#define KD_KERNELS_NAME "avx2"
+#include "kernels_impl.hpp"
@@ -0,0 +1,9 @@
+// Kernels for -march=x86-64-v4 (AVX-512 F/BW/DQ/VL).
+
+#ifndef __AVX512F__
+#error "kernels_avx512.cpp must be built with -march=x86-64-v4"
+#endif
+
+#define KD_KERNELS      kernels_avx512
+#define KD_KERNELS_NAME "avx512"
+#include "kernels_impl.hpp"
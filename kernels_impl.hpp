@@ -0,0 +1,50 @@
+#pragma once
+
+// Included once by each kernels_*.cpp with KD_KERNELS and KD_KERNELS_NAME
+// defined; everything here is compiled with that file's -march.
+
+#include "kernels.hpp"
+#include "image.hpp"
+#include "camera.hpp"
+#include "raytracer.hpp"
+#include "plotpixels.hpp"
+#include "wobbler.hpp"
+#include "blur.hpp"
+
+namespace kd
+{
+    static void wobblerFast(const ImageView& dst, const ImageView& src, float a, float b, float c)
+    {
+        wobbler<FastMath>(dst, src, a, b, c);
+    }
+
+    static void packPixels(uint32* dst, const Vector4f* src, int n)
+    {
+        packColors(dst, src, n);
+    }
+
+    static void unpackPixels(Vector4f* dst, const uint32* src, int n)
+    {
+        unpackColors(dst, src, n);
+    }
+
+    extern const Kernels KD_KERNELS;
+
+    const Kernels KD_KERNELS =
+    {
+        KD_KERNELS_NAME,
+        raytraceSub,
+        blurh,
+        blurv,
+        wobblerFast,
+        binPixels,
+        splatTiles,
+        splatTiles,
+        splatTilesAccum,
+        resolveAccum,
+        packPixels,
+        unpackPixels,
+        fillSphere,
+        fillImage,
+    };
+}
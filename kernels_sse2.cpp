@@ -0,0 +1,9 @@
+// Kernels for -march=x86-64.
+
+#ifndef __SSE2__
+#error "kernels_sse2.cpp must be built with -march=x86-64"
+#endif
+
+#define KD_KERNELS      kernels_sse2
+#define KD_KERNELS_NAME "sse2"
+#include "kernels_impl.hpp"
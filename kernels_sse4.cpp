@@ -0,0 +1,9 @@
+// Kernels for -march=x86-64-v2 (SSE4.2, POPCNT).
+
+#ifndef __SSE4_2__
+#error "kernels_sse4.cpp must be built with -march=x86-64-v2"
+#endif
+
+#define KD_KERNELS      kernels_sse4
+#define KD_KERNELS_NAME "sse4"
+#include "kernels_impl.hpp"
@@ -7,10 +7,20 @@
 #include "camera.hpp"
 #include "raytracer.hpp"
 #include "plotpixels.hpp"
+#include "pointfile.hpp"
+#include "assetfile.hpp"
 #include "camerapath.hpp"
+#include "camerajournal.hpp"
+#include "capture.hpp"
+#include "framewriter.hpp"
+#include "frameshare.hpp"
 #include "music.hpp"
+#include "framepacer.hpp"
+#include "present.hpp"
 #include "wobbler.hpp"
 #include "blur.hpp"
+#include "kernels.hpp"
+#include <thread>
 
 using namespace kd;
 
@@ -19,17 +29,31 @@ static int screen_width  = 600;
 static int screen_height = 600;
 static SDL_sem* sem;
 static SDL_mutex* mutex;
-static Image screen;
-static Image screen2;
 static float demoTime;
 static struct PlotPixels pixels;
-static RayTracer rt;
-static Camera camera;
+static const int plotSlots = 16;
+static PlotLod plotLod;
+static AccumImage::Format accumFormat = AccumImage::FLOAT32;    // or UINT16
+static bool useAccum = true;
+static int frameTileSize = 0;      // 0 renders row-major, else 8 or 32
+static const Kernels* kernels;
+static PresentMode presentMode = PRESENT_AUTO;
+static Presenter presenter;
+static bool vsync = true;
+static FramePacer pacer;
 
 static float demoLength = 2 * 60.f + 15.f;
+static const float pathSpeed = 3.f;     // camera path time per second
 static Music music("assets/musa.ogg", 130.0);
 
-static Image testImg("assets/title.png");
+// assets.kda from assetpack, when present, replaces the loose files.
+static AssetArchive assets;
+static Image titleImage;    // decoded here when there is no archive
+
+// Camera paths are recorded into a journal; camconv converts it to the
+// text format.
+static const char* journalName = "camera.kdcj";
+static CameraJournal journal;
 
 //
 // Job.
@@ -38,78 +62,348 @@ static Image testImg("assets/title.png");
 enum JobType
 {
     RAY_TRACE,
+    PLOT_BIN,
     PLOT_PIXEL,
+    FILL_SPHERE,
+    FILL_IMAGE,
+    CALL,
+};
+
+// Jobs put in one group can be waited for apart from the others. then,
+// if set, runs as the group's last job once the others are done.
+struct JobGroup
+{
+    JobGroup() : left(0), then(0) {}
+    int left;       // guarded by mutex
+    void (*then)();
 };
 
 struct Job
 {
     int type;
-    int x, y, w, h;
-    Image* img;
+    ImageView view;
+    int slot, begin, end;
+    const ChunkDraw* draws;
     const Camera* cam;
     RayTracer* rt;
     PlotPixels* plotPixels;
+    PlotBins* bins;
+    AccumImage* accum;
+    TiledImage* tiled;
+    Vector3f center;
+    float sx, sy;
+    int first, count;
+    void (*func)();
+    JobGroup* group;
 };
 
-static Job jobs[128];
+static Job jobs[256];
 static volatile int numJobs;
-static volatile int jobsLeft;
+static JobGroup frameJobs;
 
-static void putJob(Job& j)
+static void putJob(Job& j, JobGroup& group = frameJobs)
 {
     SDL_mutexP(mutex);
+    kd_assert(numJobs < int(sizeof(jobs) / sizeof(jobs[0])));
+    j.group = &group;
     jobs[numJobs++] = j;
-    jobsLeft++;
+    group.left++;
     SDL_mutexV(mutex);
     SDL_SemPost(sem);
 }
 
-static bool allJobsDone()
+static bool allJobsDone(JobGroup& group = frameJobs)
 {
     SDL_mutexP(mutex);
-    bool done = jobsLeft == 0;
+    bool done = group.left == 0;
     SDL_mutexV(mutex);
     return done;
 }
 
 //
-// Other.
+// Frame. Everything one frame is rendered into; the window has one and
+// headless rendering one per frame in flight.
+//
+
+struct Frame
+{
+    void resize(int w, int h)
+    {
+        screen.resize(w, h);
+        screen2.resize(w, h);
+        camera.aspect = w / float(h);
+    }
+
+    Image screen;
+    Image screen2;
+    Camera camera;
+    RayTracer rt;
+    PlotBins bins;
+    std::vector<ChunkDraw> chunkDraws;
+    AccumImage accum;
+    TiledImage tiled;
+    JobGroup jobs;
+};
+
+static Frame window;
+
 //
+// Startup loading. Each load is a job in its own group, started before
+// SDL and the audio are set up; the main thread waits for it only where
+// the result is first used.
+//
+
+class AssetLoad
+{
+public:
+    void start(void (*func)())
+    {
+        Job j;
+        j.type = CALL;
+        j.func = func;
+        putJob(j, group);
+    }
+
+    // From a job of this load: more jobs for it, and one to run after
+    // them.
+    void put(Job& j) { putJob(j, group); }
+
+    void then(void (*func)())
+    {
+        SDL_mutexP(mutex);
+        group.then = func;
+        SDL_mutexV(mutex);
+    }
+
+    bool ready() { return allJobsDone(group); }
 
-static void putImageFullScreen(const Image& img)
+    void wait()
+    {
+        while (!ready())
+            SDL_Delay(1);
+    }
+
+private:
+    JobGroup group;
+};
+
+static AssetLoad cameraLoad, musicLoad, pointsLoad;
+static CameraPath startupPath;
+static std::vector<uint8> musicBytes;
+static const void* musicData;
+static size_t musicSize;
+
+// The latest recording wins over the packed and the text path. Playback
+// uses the keys; the frames are kept as they are, as the source for
+// recording on top of the path.
+static void loadCameraPath()
 {
-    glPixelZoom(screen_width / float(img.w), screen_height / float(img.h));
-    glDrawPixels(img.w, img.h, GL_RGBA, GL_UNSIGNED_BYTE, img.data);
+    if (loadCameraJournal(startupPath, journalName) <= 0)
+    {
+        startupPath.frames.clear();
+        if (assets.cameraPath("camera.txt", startupPath))
+            return;
+        startupPath.load("camera.txt");
+    }
+
+    startupPath.compress();
 }
 
-void raytrace(Image& dst, const Camera& cam)
+// Reads and decodes the whole song, after music.open().
+static void loadMusic()
 {
+    if (assets.file(music.filename.c_str(), &musicData, &musicSize))
+    {
+        music.decode(musicData, musicSize);
+        return;
+    }
+
+    FILE* fp = fopen(music.filename.c_str(), "rb");
+    if (!fp)
+    {
+        music.decode(0, 0);     // reports it
+        return;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    musicBytes.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    if (!musicBytes.empty() && fread(&musicBytes[0], 1, musicBytes.size(), fp) == musicBytes.size())
+    {
+        musicData = &musicBytes[0];
+        musicSize = musicBytes.size();
+    }
+    fclose(fp);
+
+    music.decode(musicData, musicSize);
+}
+
+// The title as points: decoded on one worker, filled in row bands on all
+// of them and then quantized, all in pointsLoad. The pool is shared with
+// the first frames, which draw without points until this is done.
+static void quantizeTitlePoints()
+{
+    pixels.quantize();
+}
+
+static void loadTitlePoints()
+{
+    ImageView title;
+    if (!assets.image("assets/title.png", title))
+    {
+        titleImage = Image("assets/title.png");
+        title = titleImage;
+    }
+
+    pixels.create(title.w * title.h);
+    const int first = pixels.alloc(title.w * title.h);
+    const int parts = std::min(num_threads * 4, title.h);
+
+    pointsLoad.then(quantizeTitlePoints);
+    for (int i = 0; i < parts; i++)
+    {
+        Job j;
+        j.type = FILL_IMAGE;
+        j.plotPixels = &pixels;
+        j.first = first;
+        j.center = Vector3f(-2.f, -4.f, 0.f);
+        j.view = title;
+        j.sx = 4.f;
+        j.sy = 4.f;
+        j.begin = title.h * i / parts;
+        j.end = title.h * (i+1) / parts;
+        pointsLoad.put(j);
+    }
+}
+
+// --sphere n replaces the title with n points on a sphere, filled and
+// built the same way. The time it took is printed for comparing builds.
+static int spherePoints = 0;
+static uint32 sphereStart;
+
+static void quantizeSpherePoints()
+{
+    pixels.quantize();
+    fprintf(stderr, "sphere: %d points in %u ms\n", spherePoints, SDL_GetTicks() - sphereStart);
+}
+
+static void loadSpherePoints()
+{
+    sphereStart = SDL_GetTicks();
+    pixels.create(spherePoints);
+    const int first = pixels.alloc(spherePoints);
+    const int parts = std::min(num_threads * 4, spherePoints / 65536 + 1);
+
+    pointsLoad.then(quantizeSpherePoints);
+    for (int i = 0; i < parts; i++)
+    {
+        Job j;
+        j.type = FILL_SPHERE;
+        j.plotPixels = &pixels;
+        j.first = first;
+        j.center = Vector3f(0.f, 0.f, 0.f);
+        j.sx = 4.f;
+        j.count = spherePoints;
+        j.begin = int(int64(spherePoints) * i / parts);
+        j.end = int(int64(spherePoints) * (i+1) / parts);
+        pointsLoad.put(j);
+    }
+}
+
+//
+// Other.
+//
+
+static void raytrace(Frame& f)
+{
+    Image& dst = f.screen;
+    const Camera& cam = f.camera;
+
+    // With a tiled frame each job traces whole tiles, and the tile rows
+    // are linearized into dst after the splats.
+    TiledImage* tiled = frameTileSize ? &f.tiled : 0;
+    if (tiled && (tiled->w != dst.w || tiled->h != dst.h || tiled->tileSize() != frameTileSize))
+        tiled->resize(dst.w, dst.h, frameTileSize);
+
 #if 1
     const int slices = 8;
     for (int i = 0; i < slices; i++)
     {
-        int y0 = dst.h * i / slices;
-        int y1 = dst.h * (i+1) / slices;
-
         Job j;
         j.type = RAY_TRACE;
-        j.x = 0;
-        j.y = y0;
-        j.w = dst.w;
-        j.h = y1 - y0;
-        j.img = &dst;
+        j.tiled = tiled;
+        if (tiled)
+        {
+            j.begin = tiled->tilesY * i / slices;
+            j.end = tiled->tilesY * (i+1) / slices;
+        }
+        else
+        {
+            int y0 = dst.h * i / slices;
+            int y1 = dst.h * (i+1) / slices;
+            j.view = ImageView(dst).sub(0, y0, dst.w, y1 - y0);
+        }
+        j.cam = &cam;
+        j.rt = &f.rt;
+        putJob(j, f.jobs);
+    }
+#endif
+
+    //raytraceSub(rt, dst);
+
+    // Binning only reads the points, so it runs alongside the ray tracer.
+    // Chunks outside the view are dropped before any per-point work and
+    // distant ones are thinned to the level of detail.
+    std::vector<ChunkDraw>& chunkDraws = f.chunkDraws;
+    f.bins.resize(dst.w, dst.h, plotSlots);
+    chunkDraws.clear();
+    if (pointsLoad.ready())
+    {
+        selectChunks(chunkDraws, cam, pixels, dst.w, dst.h, plotLod);
+
+        // Headless frames in flight share the set's prefetch marks.
+        SDL_mutexP(mutex);
+        prefetchPoints(pixels, chunkDraws.empty() ? 0 : &chunkDraws[0], (int)chunkDraws.size());
+        SDL_mutexV(mutex);
+    }
+    if (useAccum)
+        f.accum.resize(dst.w, dst.h, accumFormat);
+
+    for (int i = 0; i < plotSlots; i++)
+    {
+        Job j;
+        j.type = PLOT_BIN;
+        j.slot = i;
+        j.begin = int(chunkDraws.size()) * i / plotSlots;
+        j.end = int(chunkDraws.size()) * (i+1) / plotSlots;
+        j.draws = chunkDraws.empty() ? 0 : &chunkDraws[0];
         j.cam = &cam;
-        j.rt = &rt;
-        putJob(j);
+        j.plotPixels = &pixels;
+        j.bins = &f.bins;
+        putJob(j, f.jobs);
     }
 
-    while (!allJobsDone())
+    while (!allJobsDone(f.jobs))
         SDL_Delay(1);
-#endif
 
-    //raytraceSub(rt, 0, 0, dst.w, dst.h);
+    // Each band of tile rows has a single owner, so splats never race.
+    const PlotBins& bins = f.bins;
+    const int bands = std::min(bins.tilesY, 32);
+    for (int i = 0; i < bands; i++)
+    {
+        Job j;
+        j.type = PLOT_PIXEL;
+        j.begin = bins.tilesY * i / bands;
+        j.end = bins.tilesY * (i+1) / bands;
+        j.view = dst;
+        j.bins = &f.bins;
+        j.accum = useAccum ? &f.accum : 0;
+        j.tiled = tiled;
+        putJob(j, f.jobs);
+    }
 
-    plotPixels(dst, cam, pixels);
+    while (!allJobsDone(f.jobs))
+        SDL_Delay(1);
 }
 
 static int thread_func(void* id)
@@ -122,20 +416,77 @@ static int thread_func(void* id)
         SDL_mutexV(mutex);
 
         if (j.type == RAY_TRACE)
-            raytraceSub(*j.rt, j.x, j.y, j.w, j.h);
+        {
+            if (j.tiled)
+            {
+                for (int ty = j.begin; ty < j.end; ty++)
+                    for (int tx = 0; tx < j.tiled->tilesX; tx++)
+                        kernels->raytraceSub(*j.rt, j.tiled->tile(tx, ty));
+            }
+            else
+                kernels->raytraceSub(*j.rt, j.view);
+        }
+        else if (j.type == PLOT_BIN)
+            kernels->binPixels(*j.bins, j.slot, *j.cam, *j.plotPixels, j.draws + j.begin, j.end - j.begin);
         else if (j.type == PLOT_PIXEL)
-            plotPixels(*j.img, *j.cam, *j.plotPixels);
+        {
+            const int T = PlotBins::tileSize;
+            const int y0 = j.begin * T, y1 = std::min(j.end * T, j.view.h);
+
+            if (j.accum)
+            {
+                kernels->splatTilesAccum(*j.accum, *j.bins, j.begin, j.end);
+                if (j.tiled)
+                    linearize(j.view, *j.tiled, y0, y1);
+                kernels->resolveAccum(j.view, *j.accum, y0, y1);
+            }
+            else if (j.tiled)
+            {
+                kernels->splatTilesTiled(*j.tiled, *j.bins, j.begin, j.end);
+                linearize(j.view, *j.tiled, y0, y1);
+            }
+            else
+                kernels->splatTiles(j.view, *j.bins, j.begin, j.end);
+        }
+        else if (j.type == FILL_SPHERE)
+            kernels->fillSphere(*j.plotPixels, j.first, j.center, j.sx, j.count, j.begin, j.end);
+        else if (j.type == FILL_IMAGE)
+            kernels->fillImage(*j.plotPixels, j.first, j.center, j.view, j.sx, j.sy, j.begin, j.end);
+        else if (j.type == CALL)
+            j.func();
         else
             assert(0);
 
+        // The group's then job takes the place of the last one, so the
+        // group is never seen done in between.
         SDL_mutexP(mutex);
-        jobsLeft--;
+        bool post = false;
+        if (j.group->left == 1 && j.group->then)
+        {
+            kd_assert(numJobs < int(sizeof(jobs) / sizeof(jobs[0])));
+            Job& t = jobs[numJobs++];
+            t.type = CALL;
+            t.func = j.group->then;
+            t.group = j.group;
+            j.group->then = 0;
+            post = true;
+        }
+        else
+            j.group->left--;
         SDL_mutexV(mutex);
+        if (post)
+            SDL_SemPost(sem);
     }
 }
 
-static void render()
+// Renders f at the given demo time into f.screen.
+static void render(Frame& f, float time)
 {
+    Image& screen = f.screen;
+    Image& screen2 = f.screen2;
+    Camera& camera = f.camera;
+    RayTracer& rt = f.rt;
+
 #if 0
     glClearColor(0.2f, 0.4f, 0.5f, 1.f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -144,89 +495,333 @@ static void render()
 #if 0
     for (int y = 0; y < screen.h; y++)
         for (int x = 0; x < screen.w; x++)
-            screen.data[y*screen.w+x] = x*256+y*3;
+            screen.data[y*screen.stride+x] = x*256+y*3;
 #endif
 
-    camera.position.x = cosf(demoTime*3.14159265f*2.f * 0.1f) * 10.f;
-    camera.position.y = sinf(demoTime*3.14159265f*2.f * 0.2f) * 3.f + 10.f;
-    camera.position.z = sinf(demoTime*3.14159265f*2.f * 0.1f) * 10.f;
+    camera.position.x = cosf(time*3.14159265f*2.f * 0.1f) * 10.f;
+    camera.position.y = sinf(time*3.14159265f*2.f * 0.2f) * 3.f + 10.f;
+    camera.position.z = sinf(time*3.14159265f*2.f * 0.1f) * 10.f;
     camera.fov = 3.14159265f*2.f * 90.f / 360.f;
     camera.update();
 
-    rt.camera = camera;
-
+    // The ray tables depend only on the projection. Building them with an
+    // identity view instead of this frame's keeps every frame independent
+    // of which one happened to come first.
     if (!rt.image)
     {
+        rt.camera = camera;
+        rt.camera.view = Matrix4x4f();
+        rt.camera.update();
         rt.image = &screen;
         rt.update();
     }
 
-    raytrace(screen, camera);
+    rt.camera = camera;
+
+    raytrace(f);
 
-    float strength = demoTime / demoLength * 10.f;
-    wobbler(screen2, screen, demoTime * 30.f, demoTime* 23.4f, strength);
+    float strength = time / demoLength * 10.f;
+    kernels->wobbler(screen2, screen, time * 30.f, time* 23.4f, strength);
 
-    blurh(screen, screen2);
+    kernels->blurh(screen, screen2);
 
-    if (demoTime > 10.f)
+    if (time > 10.f)
     {
         for (int i = 0; i< 4; i++)
         {
-            blurh(screen2, screen);
-            blurh(screen, screen2);
-            blurv(screen2, screen);
-            blurv(screen, screen2);
+            kernels->blurh(screen2, screen);
+            kernels->blurh(screen, screen2);
+            kernels->blurv(screen2, screen);
+            kernels->blurv(screen, screen2);
         }
     }
 
-    putImageFullScreen(screen);
 }
 
-int main(int argc, char* argv[])
+//
+// Headless rendering: no window, no audio and no wall clock. Frame n is
+// rendered at time n / fps with the camera on the startup path, so the
+// same options always give the same frames. Several frames are in flight,
+// each in its own Frame on its own thread: their ray tracing and splats
+// share the worker pool and the serial wobbler and blurs run side by
+// side. Frames are encoded where they were rendered and written in order.
+//
+
+struct HeadlessOptions
 {
-    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
-    SDL_SetVideoMode(screen_width, screen_height, 0, SDL_OPENGL | SDL_FULLSCREEN);
+    HeadlessOptions()
+    :   output(0), format(FRAME_PNG), width(1920), height(1080), fps(60),
+        first(0), count(-1), inFlight(4), threads(0)
+    {
+    }
 
-    IMG_Init(IMG_INIT_PNG);
+    const char* output;     // 0 for the window
+    FrameFormat format;
+    int width, height;
+    int fps;
+    int first, count;       // count -1 renders to the end of the demo
+    int inFlight;
+    int threads;            // workers, 0 for one per core
+};
 
-    music.init();
+static HeadlessOptions headless;
 
-    //pixels.create(256);
-    //generateSphere(pixels, Vector3f(0.f, 0.f, 0.f), 4.f, 128);
+// Recording of the live show, the frames as shown in the window. --format
+// applies to it too. Frames are placed by show time at --fps, repeating the
+// last one over gaps.
+static const char* captureOutput = 0;
+static FrameCapture capture;
 
-    pixels.create(testImg.w * testImg.h);
-    plotImage(pixels, Vector3f(-2.f, -4.f, 0.f), testImg, 4.f, 4.f);
+// Frames for a compositor, in shared memory under this name.
+static const char* shareName = 0;
+static FrameShare share;
+static FrameWriter frameWriter;
+static int nextFrame, nextWrite;    // guarded by mutex
 
-    screen.resize(256, 256);
-    screen2.resize(256, 256);
+static int headlessFrames(void* data)
+{
+    Frame& f = *(Frame*)data;
+    std::vector<uint8> bytes;
 
-    camera.targetCamera = false;
-    camera.translateLocal(Vector3f(0.f, -1.f, 0.f));
+    for (;;)
+    {
+        SDL_mutexP(mutex);
+        const int frame = nextFrame++;
+        SDL_mutexV(mutex);
+        if (frame >= headless.first + headless.count)
+            break;
+
+        const float time = frame / float(headless.fps);
+        f.camera.view = startupPath.get(time * pathSpeed);
+        render(f, time);
+        frameWriter.encode(bytes, f.screen);
+
+        for (;;)
+        {
+            SDL_mutexP(mutex);
+            const bool turn = nextWrite == frame;
+            SDL_mutexV(mutex);
+            if (turn)
+                break;
+            SDL_Delay(1);
+        }
+
+        frameWriter.write(frame, bytes);
+        fprintf(stderr, "\rframe %d / %d", frame - headless.first + 1, headless.count);
+
+        // PNG frames go to files, so stdout is free to tell a renderfarm
+        // that frames are still coming.
+        if (headless.format == FRAME_PNG)
+        {
+            printf("frame %d\n", frame);
+            fflush(stdout);
+        }
+
+        SDL_mutexP(mutex);
+        nextWrite++;
+        SDL_mutexV(mutex);
+    }
+
+    return 0;
+}
+
+static int renderHeadless()
+{
+    HeadlessOptions& o = headless;
+    if (o.count < 0)
+        o.count = std::max(0, int(demoLength * o.fps) - o.first);
+
+    if (!frameWriter.open(o.output, o.format, o.width, o.height, o.fps))
+        return 1;
+
+    // No frame rate to keep, so every point is drawn.
+    plotLod.budget = 0;
+
+    cameraLoad.wait();
+    pointsLoad.wait();
+
+    std::vector<Frame> frames(std::max(1, std::min(o.inFlight, o.count)));
+    std::vector<SDL_Thread*> threads(frames.size());
+
+    nextFrame = nextWrite = o.first;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        frames[i].resize(o.width, o.height);
+        frames[i].camera.targetCamera = false;
+        threads[i] = SDL_CreateThread(headlessFrames, &frames[i]);
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        SDL_WaitThread(threads[i], 0);
+    fprintf(stderr, "\n");
+
+    return frameWriter.close() ? 0 : 1;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [points.kdp] [--render out] [--format raw|y4m|png] [--size WxH]\n"
+        "       [--fps n] [--start frame] [--frames n] [--in-flight n] [--threads n]\n"
+        "       [--capture out] [--present auto|persistent|pbo|drawpixels]\n"
+        "       [--share /name] [--vsync on|off] [--audio-latency ms] [--sphere n]\n"
+        "--render renders without a window to out, a file, - for stdout or for\n"
+        "png a printf pattern such as frames/%%05d.png. --capture records the\n"
+        "window to out the same way at --fps, repeating frames it couldn't keep.\n"
+        "--share publishes the frames in POSIX shared memory, see sharegrab.\n"
+        "--audio-latency is the output latency past the mixer's buffer.\n"
+        "--sphere draws n generated points instead of the title.\n", name);
+}
 
-    CameraPath jeejee;
-    jeejee.load("camera.txt");
-    camera.view = jeejee.frames[0];
+// Returns false on bad arguments.
+static bool parseArgs(int argc, char* argv[], const char*& pointFile)
+{
+    HeadlessOptions& o = headless;
+    pointFile = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (a[0] != '-')
+        {
+            pointFile = a;
+            continue;
+        }
+        if (!v)
+            return false;
+        i++;
+
+        bool ok = true;
+        if (strcmp(a, "--render") == 0)
+            o.output = v;
+        else if (strcmp(a, "--format") == 0)
+            ok = parseFrameFormat(v, o.format);
+        else if (strcmp(a, "--size") == 0)
+            ok = sscanf(v, "%dx%d", &o.width, &o.height) == 2 && o.width > 0 && o.height > 0;
+        else if (strcmp(a, "--fps") == 0)
+            ok = (o.fps = atoi(v)) > 0;
+        else if (strcmp(a, "--start") == 0)
+            ok = (o.first = atoi(v)) >= 0;
+        else if (strcmp(a, "--frames") == 0)
+            ok = (o.count = atoi(v)) >= 0;
+        else if (strcmp(a, "--in-flight") == 0)
+            ok = (o.inFlight = atoi(v)) > 0 && o.inFlight <= 8;
+        else if (strcmp(a, "--threads") == 0)
+            ok = (o.threads = atoi(v)) > 0;
+        else if (strcmp(a, "--capture") == 0)
+            captureOutput = v;
+        else if (strcmp(a, "--share") == 0)
+            shareName = v;
+        else if (strcmp(a, "--vsync") == 0)
+            ok = (vsync = strcmp(v, "on") == 0) || strcmp(v, "off") == 0;
+        else if (strcmp(a, "--audio-latency") == 0)
+            ok = (music.outputLatency = atof(v) / 1000.0) >= 0.0;
+        else if (strcmp(a, "--present") == 0)
+            ok = parsePresentMode(v, presentMode);
+        else if (strcmp(a, "--sphere") == 0)
+            ok = (spherePoints = atoi(v)) > 0;
+        else
+            ok = false;
 
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* pointFile;
+    if (!parseArgs(argc, argv, pointFile))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Messages go to stderr, stdout may be the video stream.
+    kernels = selectKernels();
+    fprintf(stderr, "using %s kernels\n", kernels->name);
+
+    if (headless.output)
+        num_threads = headless.threads ? headless.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // The workers start first so that the assets load while SDL sets up
+    // the window and the audio.
     sem = SDL_CreateSemaphore(0);
     mutex = SDL_CreateMutex();
 
-    music.play();
-
     SDL_Thread* th[num_threads];
     for (int i = 0; i < num_threads; i++)
         th[i] = SDL_CreateThread(thread_func, (void*)i);
 
+    IMG_Init(IMG_INIT_PNG);
+    assets.open("assets.kda");
+
+    cameraLoad.start(loadCameraPath);
+
+    // The song is decoded to the device's format, so the device opens
+    // first.
+    if (!headless.output)
+    {
+        SDL_Init(SDL_INIT_AUDIO);
+        music.open();
+        musicLoad.start(loadMusic);
+    }
+
+    // A point file from pointconv or --sphere replaces the title image.
+    if (pointFile)
+    {
+        if (!loadPoints(pixels, pointFile))
+            return 1;
+    }
+    else if (spherePoints)
+        pointsLoad.start(loadSpherePoints);
+    else
+        pointsLoad.start(loadTitlePoints);
+
+    if (headless.output)
+        return renderHeadless();
+
+    SDL_InitSubSystem(SDL_INIT_VIDEO);
+    SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, vsync ? 1 : 0);
+    SDL_SetVideoMode(screen_width, screen_height, 0, SDL_OPENGL | SDL_FULLSCREEN);
+    int swapControl = 0;
+    SDL_GL_GetAttribute(SDL_GL_SWAP_CONTROL, &swapControl);
+    pacer.setVsync(vsync && swapControl == 1);
+    fprintf(stderr, "present: %s\n", presentModeName(presenter.init(presentMode)));
+
+    window.resize(256, 256);
+
+    Camera& camera = window.camera;
+    camera.targetCamera = false;
+    camera.translateLocal(Vector3f(0.f, -1.f, 0.f));
+
+    cameraLoad.wait();
+    camera.view = startupPath.get(0.f);
+
+    if (captureOutput && !capture.open(captureOutput, headless.format, window.screen.w, window.screen.h, headless.fps))
+        return 1;
+    if (shareName && !share.open(shareName, window.screen.w, window.screen.h))
+        return 1;
+
+    musicLoad.wait();
+    music.play();
+
     int ticks = SDL_GetTicks();
     int mouseX, mouseY;
 
     int lastRecordTime = 0;
     bool recordMode = false;
     bool playMode = true;
-    CameraPath recordPath;
-    recordPath.load("camera.txt");
+    CameraPath recordPath = startupPath;
 
     for (;;)
     {
+        // Input and time are read as late as the next vblank allows.
+        const double lead = pacer.begin();
+
         int deltaTicks = SDL_GetTicks() - ticks;
         ticks += deltaTicks;
         float dt = deltaTicks / 1000.f;
@@ -256,18 +851,13 @@ int main(int argc, char* argv[])
         if (SDL_GetKeyState(0)[SDLK_d])
             camera.translateLocal(Vector3f(-scale, 0.f, 0.f) * dt);
 
-        if (playMode)
-        {
-            camera.view = recordPath.get(SDL_GetTicks() / 1000.f * 3.f);
-        }
-
         if (recordMode)
         {
             if (SDL_GetTicks() - lastRecordTime >= 10)
             {
                 lastRecordTime = SDL_GetTicks();
                 recordPath.add(camera.view);
-                recordPath.save("camera.txt");
+                journal.add(camera.view);
             }
         }
 
@@ -279,16 +869,41 @@ int main(int argc, char* argv[])
 
             if (ev.type == SDL_KEYDOWN)
             {
-                if (ev.key.keysym.sym == SDLK_r)
+                if (ev.key.keysym.sym == SDLK_r && !recordMode)
                 {
-                    lastRecordTime = SDL_GetTicks();
-                    recordMode = true;
+                    // Recording continues the journal, or starts one with the
+                    // recorded path. The packed path has keys only, so then
+                    // the frames come from camera.txt: frames sampled from
+                    // keys are approximate, and saved as the recording they
+                    // would lose a little more with every session.
+                    if (recordPath.frames.empty() && !recordPath.load("camera.txt"))
+                    {
+                        fprintf(stderr, "no camera.txt, recording on top of the packed path's keys\n");
+                        recordPath.expand();
+                    }
+                    if (journal.open(journalName, true))
+                    {
+                        if (journal.size() == 0)
+                        {
+                            for (size_t i = 0; i < recordPath.frames.size(); i++)
+                                journal.add(recordPath.frames[i]);
+                        }
+                        lastRecordTime = SDL_GetTicks();
+                        recordMode = true;
+                    }
                 }
 
                 if (ev.key.keysym.sym == SDLK_p)
                 {
-                    recordPath.load("camera.txt");
-                    printf("%d frames\n", recordPath.frames.size());
+                    journal.sync();
+                    recordPath.frames.clear();
+                    if (loadCameraJournal(recordPath, journalName) <= 0)
+                    {
+                        recordPath.frames.clear();
+                        recordPath.load("camera.txt");
+                    }
+                    recordPath.compress();
+                    printf("%d frames, %d keys\n", (int)recordPath.frames.size(), (int)recordPath.keys.size());
                     demoTime = 0.f;
                     playMode = true;
                 }
@@ -313,15 +928,32 @@ int main(int argc, char* argv[])
             }
         }
 
+        // Rendered for when it will be on screen.
         demoTime = music.getTime();
+        if (demoTime >= 0.f)
+            demoTime += float(lead);
 
-        render();
+        // On the demo clock, as --render plays it.
+        if (playMode)
+            camera.view = recordPath.get(demoTime * pathSpeed);
+
+        render(window, demoTime);
+        if (capture.isOpen())
+            capture.add(window.screen, demoTime);
+        if (share.isOpen())
+            share.publish(window.screen, demoTime);
+        presenter.put(window.screen, screen_width, screen_height);
+        pacer.rendered();
         SDL_GL_SwapBuffers();
+        pacer.swapped();
 
         if (demoTime >= demoLength)
             break;
     }
 
+    capture.close();
+    share.close();
+    presenter.shutdown();
     IMG_Quit();
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "defs.hpp"
+#include "simd.hpp"
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
@@ -411,6 +412,74 @@ namespace kd
         T x, y, z, w;
     };
 
+    // SSE version. Same interface, but 16-byte aligned so it loads straight
+    // into a register.
+    template<>
+    class alignas(16) Vector4<float>
+    {
+    public:
+        Vector4() : x(0), y(0), z(0), w(0)
+        {
+        }
+
+        Vector4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w)
+        {
+        }
+
+        Vector4(const Vector3<float>& v, float w) : x(v.x), y(v.y), z(v.z), w(w)
+        {
+        }
+
+        Vector4(const Vector2<float>& v, float z, float w) : x(v.x), y(v.y), z(z), w(w)
+        {
+        }
+
+        Vector4(const floatx4& v)
+        {
+            _mm_store_ps(&x, v.v);
+        }
+
+        floatx4 simd() const
+        {
+            return _mm_load_ps(&x);
+        }
+
+        Vector3<float> xyz() const
+        {
+            return Vector3<float>(x, y, z);
+        }
+
+        Vector2<float> xy() const
+        {
+            return Vector2<float>(x, y);
+        }
+
+        float length() const
+        {
+            return std::sqrt(x*x + y*y + z*z + w*w);
+        }
+
+        Vector3<float> project() const
+        {
+            return Vector3<float>(x / w, y / w, z / w);
+        }
+
+        float& operator[](int i)
+        {
+            kd_assert(i >= 0 && i < 4);
+            return (&x)[i];
+        }
+
+        const float& operator[](int i) const
+        {
+            kd_assert(i >= 0 && i < 4);
+            return (&x)[i];
+        }
+
+    public:
+        float x, y, z, w;
+    };
+
     template<typename T>
     inline T length(const Vector4<T>& v)
     {
@@ -473,6 +542,28 @@ namespace kd
         return Vector3<T>(v.x/v.w, v.y/v.w, v.z/v.w);
     }
 
+    inline Vector4<float> operator+(const Vector4<float>& a, const Vector4<float>& b)
+    {
+        return a.simd() + b.simd();
+    }
+
+    inline Vector4<float> operator*(const Vector4<float>& a, float s)
+    {
+        return a.simd() * floatx4(s);
+    }
+
+    inline Vector4<float>& operator+=(Vector4<float>& a, const Vector4<float>& b)
+    {
+        a = a.simd() + b.simd();
+        return a;
+    }
+
+    inline Vector4<float>& operator/=(Vector4<float>& a, float d)
+    {
+        a = a.simd() / floatx4(d);
+        return a;
+    }
+
     typedef Vector4<int> Vector4i;
     typedef Vector4<float> Vector4f;
     typedef Vector4<double> Vector4d;
@@ -714,6 +805,213 @@ namespace kd
         T m[16];
     };
 
+    // SSE version. Same row-major layout and interface, rows are 16-byte
+    // aligned and the products and inverse work on whole rows at a time.
+    template<>
+    class Matrix4x4<float>
+    {
+    public:
+        Matrix4x4()
+        {
+            identity();
+        }
+
+        explicit Matrix4x4(const float* a)
+        {
+            for (int i = 0; i < 16; i++)
+                m[i] = a[i];
+        }
+
+        Matrix4x4(const floatx4& r0, const floatx4& r1, const floatx4& r2, const floatx4& r3)
+        {
+            setRow(0, r0);
+            setRow(1, r1);
+            setRow(2, r2);
+            setRow(3, r3);
+        }
+
+        bool is_identity()
+        {
+            return *this == Matrix4x4<float>();
+        }
+
+        void identity()
+        {
+            setRow(0, floatx4(1.f, 0.f, 0.f, 0.f));
+            setRow(1, floatx4(0.f, 1.f, 0.f, 0.f));
+            setRow(2, floatx4(0.f, 0.f, 1.f, 0.f));
+            setRow(3, floatx4(0.f, 0.f, 0.f, 1.f));
+        }
+
+        void transpose()
+        {
+            __m128 r0 = _mm_load_ps(m), r1 = _mm_load_ps(m+4), r2 = _mm_load_ps(m+8), r3 = _mm_load_ps(m+12);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_store_ps(m, r0);
+            _mm_store_ps(m+4, r1);
+            _mm_store_ps(m+8, r2);
+            _mm_store_ps(m+12, r3);
+        }
+
+        void scale(float s)
+        {
+            for (int i = 0; i < 4; i++)
+                setRow(i, rowx4(i) * floatx4(s));
+        }
+
+        float determinant()
+        {
+            floatx4 r[4];
+            return inverse(r);
+        }
+
+        bool invert()
+        {
+            floatx4 r[4];
+            if (inverse(r) == 0.f)
+                return false;
+            for (int i = 0; i < 4; i++)
+                setRow(i, r[i]);
+            return true;
+        }
+
+        inline Vector4<float> row(int i) const
+        {
+            kd_assert(i >= 0 && i < 4);
+            return rowx4(i);
+        }
+
+        inline Vector4<float> column(int i) const
+        {
+            kd_assert(i >= 0 && i < 4);
+            return Vector4<float>(m[0*4+i], m[1*4+i], m[2*4+i], m[3*4+i]);
+        }
+
+        inline floatx4 rowx4(int i) const
+        {
+            return _mm_load_ps(m + i*4);
+        }
+
+        inline void setRow(int i, const floatx4& r)
+        {
+            _mm_store_ps(m + i*4, r.v);
+        }
+
+        inline float get(int i, int j) const
+        {
+            kd_assert(i >= 0 && i < 4 && j >= 0 && j < 4);
+            return m[i*4+j];
+        }
+
+        const float* data() const
+        {
+            return m;
+        }
+
+        float* data()
+        {
+            return m;
+        }
+
+        const float& operator[](int i) const
+        {
+            kd_assert(i >= 0 && i < 16);
+            return m[i];
+        }
+
+        float& operator[](int i)
+        {
+            kd_assert(i >= 0 && i < 16);
+            return m[i];
+        }
+
+        bool operator==(const Matrix4x4<float>& b) const
+        {
+            int eq = 0xf;
+            for (int i = 0; i < 4; i++)
+                eq &= _mm_movemask_ps(_mm_cmpeq_ps(rowx4(i).v, b.rowx4(i).v));
+            return eq == 0xf;
+        }
+
+    private:
+        // Block-wise inverse: the matrix is split into 2x2 sub-matrices
+        // A B / C D, which are inverted through their adjugates. Writes the
+        // inverse to r and returns the determinant; r is garbage if it is 0.
+        float inverse(floatx4* r) const
+        {
+#define KD_SHUF(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+#define KD_SWZ(a, x, y, z, w) KD_SHUF(a, a, x, y, z, w)
+            const __m128 r0 = _mm_load_ps(m), r1 = _mm_load_ps(m+4), r2 = _mm_load_ps(m+8), r3 = _mm_load_ps(m+12);
+
+            const __m128 A = _mm_movelh_ps(r0, r1);
+            const __m128 B = _mm_movehl_ps(r1, r0);
+            const __m128 C = _mm_movelh_ps(r2, r3);
+            const __m128 D = _mm_movehl_ps(r3, r2);
+
+            // |A| |B| |C| |D|
+            const __m128 detSub = _mm_sub_ps(
+                _mm_mul_ps(KD_SHUF(r0, r2, 0, 2, 0, 2), KD_SHUF(r1, r3, 1, 3, 1, 3)),
+                _mm_mul_ps(KD_SHUF(r0, r2, 1, 3, 1, 3), KD_SHUF(r1, r3, 0, 2, 0, 2)));
+            const __m128 detA = KD_SWZ(detSub, 0, 0, 0, 0);
+            const __m128 detB = KD_SWZ(detSub, 1, 1, 1, 1);
+            const __m128 detC = KD_SWZ(detSub, 2, 2, 2, 2);
+            const __m128 detD = KD_SWZ(detSub, 3, 3, 3, 3);
+
+            const __m128 D_C = mat2AdjMul(D, C);
+            const __m128 A_B = mat2AdjMul(A, B);
+
+            __m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), mat2Mul(B, D_C));
+            __m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), mat2Mul(C, A_B));
+            __m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), mat2MulAdj(D, A_B));
+            __m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), mat2MulAdj(A, D_C));
+
+            // |M| = |A||D| + |B||C| - tr((A#B)(D#C))
+            __m128 tr = _mm_mul_ps(A_B, KD_SWZ(D_C, 0, 2, 1, 3));
+            tr = _mm_add_ps(tr, KD_SWZ(tr, 2, 3, 0, 1));
+            tr = _mm_add_ps(tr, KD_SWZ(tr, 1, 0, 3, 2));
+            const __m128 detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+
+            const float det = _mm_cvtss_f32(detM);
+            if (det == 0.f)
+                return 0.f;
+
+            const __m128 rcpDet = _mm_div_ps(_mm_setr_ps(1.f, -1.f, -1.f, 1.f), detM);
+            X = _mm_mul_ps(X, rcpDet);
+            Y = _mm_mul_ps(Y, rcpDet);
+            Z = _mm_mul_ps(Z, rcpDet);
+            W = _mm_mul_ps(W, rcpDet);
+
+            r[0] = KD_SHUF(X, Y, 3, 1, 3, 1);
+            r[1] = KD_SHUF(X, Y, 2, 0, 2, 0);
+            r[2] = KD_SHUF(Z, W, 3, 1, 3, 1);
+            r[3] = KD_SHUF(Z, W, 2, 0, 2, 0);
+            return det;
+        }
+
+        // 2x2 matrices packed as a0 a1 / a2 a3 in one register: A*B, A#*B, A*B#
+        static __m128 mat2Mul(__m128 a, __m128 b)
+        {
+            return _mm_add_ps(_mm_mul_ps(a, KD_SWZ(b, 0, 3, 0, 3)),
+                              _mm_mul_ps(KD_SWZ(a, 1, 0, 3, 2), KD_SWZ(b, 2, 1, 2, 1)));
+        }
+
+        static __m128 mat2AdjMul(__m128 a, __m128 b)
+        {
+            return _mm_sub_ps(_mm_mul_ps(KD_SWZ(a, 3, 3, 0, 0), b),
+                              _mm_mul_ps(KD_SWZ(a, 1, 1, 2, 2), KD_SWZ(b, 2, 3, 0, 1)));
+        }
+
+        static __m128 mat2MulAdj(__m128 a, __m128 b)
+        {
+            return _mm_sub_ps(_mm_mul_ps(a, KD_SWZ(b, 3, 0, 3, 0)),
+                              _mm_mul_ps(KD_SWZ(a, 1, 0, 3, 2), KD_SWZ(b, 2, 1, 2, 1)));
+#undef KD_SWZ
+#undef KD_SHUF
+        }
+
+        alignas(16) float m[16];
+    };
+
     template<typename T>
     Vector4<T> operator*(const Matrix4x4<T>& m, const Vector4<T>& v)
     {
@@ -749,6 +1047,30 @@ namespace kd
         return r;
     }
 
+    inline Vector4<float> operator*(const Matrix4x4<float>& m, const Vector4<float>& v)
+    {
+        __m128 r0 = _mm_mul_ps(m.rowx4(0).v, v.simd().v);
+        __m128 r1 = _mm_mul_ps(m.rowx4(1).v, v.simd().v);
+        __m128 r2 = _mm_mul_ps(m.rowx4(2).v, v.simd().v);
+        __m128 r3 = _mm_mul_ps(m.rowx4(3).v, v.simd().v);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        return floatx4(_mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+    }
+
+    inline Matrix4x4<float> operator*(const Matrix4x4<float>& a, const Matrix4x4<float>& b)
+    {
+        floatx4 r[4];
+        for (int i = 0; i < 4; i++)
+        {
+            floatx4 ai = a.rowx4(i);
+            r[i] = _mm_mul_ps(_mm_shuffle_ps(ai.v, ai.v, 0x00), b.rowx4(0).v);
+            r[i] = madd(_mm_shuffle_ps(ai.v, ai.v, 0x55), b.rowx4(1), r[i]);
+            r[i] = madd(_mm_shuffle_ps(ai.v, ai.v, 0xaa), b.rowx4(2), r[i]);
+            r[i] = madd(_mm_shuffle_ps(ai.v, ai.v, 0xff), b.rowx4(3), r[i]);
+        }
+        return Matrix4x4<float>(r[0], r[1], r[2], r[3]);
+    }
+
     template<typename T>
     Matrix4x4<T> transpose(const Matrix4x4<T>& m)
     {
@@ -768,6 +1090,51 @@ namespace kd
         return m2;
     }
 
+    // Inverse of a matrix whose last row is 0 0 0 1 (any combination of
+    // translate, rotate and scale, e.g. a camera view matrix).
+    template<typename T>
+    Matrix4x4<T> invert_affine(const Matrix4x4<T>& m)
+    {
+        Vector3<T> r0(m[0], m[1], m[2]);
+        Vector3<T> r1(m[4], m[5], m[6]);
+        Vector3<T> r2(m[8], m[9], m[10]);
+        Vector3<T> t(m[3], m[7], m[11]);
+
+        Vector3<T> c0 = cross(r1, r2);
+        Vector3<T> c1 = cross(r2, r0);
+        Vector3<T> c2 = cross(r0, r1);
+
+        T det = dot(r0, c0);
+        if (det == T(0))
+            throw std::runtime_error("matrix is not invertible");
+        T s = T(1) / det;
+        c0 *= s;
+        c1 *= s;
+        c2 *= s;
+
+        Matrix4x4<T> r;
+        r[0] = c0.x; r[1] = c1.x; r[2]  = c2.x; r[3]  = -(c0.x * t.x + c1.x * t.y + c2.x * t.z);
+        r[4] = c0.y; r[5] = c1.y; r[6]  = c2.y; r[7]  = -(c0.y * t.x + c1.y * t.y + c2.y * t.z);
+        r[8] = c0.z; r[9] = c1.z; r[10] = c2.z; r[11] = -(c0.z * t.x + c1.z * t.y + c2.z * t.z);
+        return r;
+    }
+
+    // Inverse of a matrix built by perspective().
+    template<typename T>
+    Matrix4x4<T> invert_perspective(const Matrix4x4<T>& m)
+    {
+        kd_assert(m[14] == T(-1) && m[15] == T(0));
+
+        Matrix4x4<T> r;
+        r[0*4+0] = T(1) / m[0*4+0];
+        r[1*4+1] = T(1) / m[1*4+1];
+        r[2*4+2] = T(0);
+        r[2*4+3] = T(-1);
+        r[3*4+2] = T(1) / m[2*4+3];
+        r[3*4+3] = m[2*4+2] / m[2*4+3];
+        return r;
+    }
+
     template<typename T>
     Matrix4x4<T> rotate(const Vector3<T>& vec, T rad)
     {
@@ -909,6 +1276,281 @@ namespace kd
     typedef Matrix4x4<float> Matrix4f;
     typedef Matrix4x4<double> Matrix4d;
 
+    //
+    // Vector3x, Vector4x
+    //
+    // Structure-of-arrays packets: each component is a floatx4 or floatx8,
+    // so one Vector3x8 holds eight points. Same operators as Vector3 and
+    // Vector4, with masks instead of branches.
+    //
+
+    template<typename F>
+    class Vector3x
+    {
+    public:
+        Vector3x()
+        {
+        }
+
+        Vector3x(const F& x, const F& y, const F& z) : x(x), y(y), z(z)
+        {
+        }
+
+        // same vector in every lane
+        explicit Vector3x(const Vector3<float>& v) : x(v.x), y(v.y), z(v.z)
+        {
+        }
+
+        F length() const
+        {
+            return sqrt(length_squared());
+        }
+
+        F length_squared() const
+        {
+            return x*x + y*y + z*z;
+        }
+
+        Vector3<float> lane(int i) const
+        {
+            return Vector3<float>(x[i], y[i], z[i]);
+        }
+
+    public:
+        F x, y, z;
+    };
+
+    template<typename F>
+    inline Vector3x<F> operator+(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(a.x + b.x, a.y + b.y, a.z + b.z);
+    }
+
+    template<typename F>
+    inline Vector3x<F> operator-(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    template<typename F>
+    inline Vector3x<F> operator-(const Vector3x<F>& a)
+    {
+        return Vector3x<F>(-a.x, -a.y, -a.z);
+    }
+
+    template<typename F>
+    inline Vector3x<F> operator*(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(a.x * b.x, a.y * b.y, a.z * b.z);
+    }
+
+    template<typename F>
+    inline Vector3x<F> operator*(const Vector3x<F>& a, const F& s)
+    {
+        return Vector3x<F>(a.x * s, a.y * s, a.z * s);
+    }
+
+    template<typename F>
+    inline Vector3x<F> operator/(const Vector3x<F>& a, const F& s)
+    {
+        return a * (F(1.f) / s);
+    }
+
+    template<typename F>
+    inline Vector3x<F>& operator+=(Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        a = a + b;
+        return a;
+    }
+
+    template<typename F>
+    inline Vector3x<F>& operator-=(Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        a = a - b;
+        return a;
+    }
+
+    template<typename F>
+    inline Vector3x<F>& operator*=(Vector3x<F>& a, const F& s)
+    {
+        a = a * s;
+        return a;
+    }
+
+    template<typename F>
+    inline F dot(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return madd(a.x, b.x, madd(a.y, b.y, a.z * b.z));
+    }
+
+    template<typename F>
+    inline Vector3x<F> cross(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(
+                a.y * b.z - a.z * b.y,
+                a.z * b.x - a.x * b.z,
+                a.x * b.y - a.y * b.x);
+    }
+
+    // Zero-length lanes come out as NaN, no exceptions in packet code.
+    template<typename F>
+    inline Vector3x<F> normalize(const Vector3x<F>& a)
+    {
+        return a / a.length();
+    }
+
+    template<typename F>
+    inline F length(const Vector3x<F>& v)
+    {
+        return v.length();
+    }
+
+    template<typename F>
+    inline F length2(const Vector3x<F>& v)
+    {
+        return v.length_squared();
+    }
+
+    template<typename F>
+    inline Vector3x<F> min_values(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
+    }
+
+    template<typename F>
+    inline Vector3x<F> max_values(const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
+    }
+
+    // mask ? a : b per lane
+    template<typename F>
+    inline Vector3x<F> select(const F& mask, const Vector3x<F>& a, const Vector3x<F>& b)
+    {
+        return Vector3x<F>(select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z));
+    }
+
+    // From separate x, y and z arrays, F::width elements starting at p[0].
+    template<typename F>
+    inline Vector3x<F> load3(const float* x, const float* y, const float* z)
+    {
+        return Vector3x<F>(load(x, F()), load(y, F()), load(z, F()));
+    }
+
+    template<typename F>
+    inline void store3(float* x, float* y, float* z, const Vector3x<F>& v)
+    {
+        store(x, v.x);
+        store(y, v.y);
+        store(z, v.z);
+    }
+
+    typedef Vector3x<floatx4> Vector3x4;
+    typedef Vector3x<floatx8> Vector3x8;
+
+    template<typename F>
+    class Vector4x
+    {
+    public:
+        Vector4x()
+        {
+        }
+
+        Vector4x(const F& x, const F& y, const F& z, const F& w) : x(x), y(y), z(z), w(w)
+        {
+        }
+
+        Vector4x(const Vector3x<F>& v, const F& w) : x(v.x), y(v.y), z(v.z), w(w)
+        {
+        }
+
+        explicit Vector4x(const Vector4<float>& v) : x(v.x), y(v.y), z(v.z), w(v.w)
+        {
+        }
+
+        Vector3x<F> xyz() const
+        {
+            return Vector3x<F>(x, y, z);
+        }
+
+        Vector3x<F> project() const
+        {
+            return xyz() / w;
+        }
+
+        Vector4<float> lane(int i) const
+        {
+            return Vector4<float>(x[i], y[i], z[i], w[i]);
+        }
+
+    public:
+        F x, y, z, w;
+    };
+
+    template<typename F>
+    inline Vector4x<F> operator+(const Vector4x<F>& a, const Vector4x<F>& b)
+    {
+        return Vector4x<F>(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w);
+    }
+
+    template<typename F>
+    inline Vector4x<F> operator*(const Vector4x<F>& a, const F& s)
+    {
+        return Vector4x<F>(a.x * s, a.y * s, a.z * s, a.w * s);
+    }
+
+    template<typename F>
+    inline F dot(const Vector4x<F>& a, const Vector4x<F>& b)
+    {
+        return madd(a.x, b.x, madd(a.y, b.y, madd(a.z, b.z, a.w * b.w)));
+    }
+
+    template<typename F>
+    inline Vector4x<F> select(const F& mask, const Vector4x<F>& a, const Vector4x<F>& b)
+    {
+        return Vector4x<F>(select(mask, a.x, b.x), select(mask, a.y, b.y),
+                           select(mask, a.z, b.z), select(mask, a.w, b.w));
+    }
+
+    template<typename F>
+    inline Vector4x<F> load4(const float* x, const float* y, const float* z, const float* w)
+    {
+        return Vector4x<F>(load(x, F()), load(y, F()), load(z, F()), load(w, F()));
+    }
+
+    template<typename F>
+    inline void store4(float* x, float* y, float* z, float* w, const Vector4x<F>& v)
+    {
+        store(x, v.x);
+        store(y, v.y);
+        store(z, v.z);
+        store(w, v.w);
+    }
+
+    // Points, w = 1.
+    template<typename F>
+    inline Vector4x<F> operator*(const Matrix4x4<float>& m, const Vector3x<F>& v)
+    {
+        return Vector4x<F>(
+            madd(F(m[0]), v.x, madd(F(m[1]), v.y, madd(F(m[2]), v.z, F(m[3])))),
+            madd(F(m[4]), v.x, madd(F(m[5]), v.y, madd(F(m[6]), v.z, F(m[7])))),
+            madd(F(m[8]), v.x, madd(F(m[9]), v.y, madd(F(m[10]), v.z, F(m[11])))),
+            madd(F(m[12]), v.x, madd(F(m[13]), v.y, madd(F(m[14]), v.z, F(m[15])))));
+    }
+
+    template<typename F>
+    inline Vector4x<F> operator*(const Matrix4x4<float>& m, const Vector4x<F>& v)
+    {
+        return Vector4x<F>(
+            madd(F(m[0]), v.x, madd(F(m[1]), v.y, madd(F(m[2]), v.z, F(m[3]) * v.w))),
+            madd(F(m[4]), v.x, madd(F(m[5]), v.y, madd(F(m[6]), v.z, F(m[7]) * v.w))),
+            madd(F(m[8]), v.x, madd(F(m[9]), v.y, madd(F(m[10]), v.z, F(m[11]) * v.w))),
+            madd(F(m[12]), v.x, madd(F(m[13]), v.y, madd(F(m[14]), v.z, F(m[15]) * v.w))));
+    }
+
+    typedef Vector4x<floatx4> Vector4x4;
+    typedef Vector4x<floatx8> Vector4x8;
+
     //
     // Quaternion
     //
@@ -959,6 +1601,122 @@ namespace kd
         return Quaternion<T>(x, y, z, w);
     }
 
+    template<typename T>
+    Quaternion<T> operator*(const Quaternion<T>& q, T s)
+    {
+        return Quaternion<T>(q.v * s);
+    }
+
+    template<typename T>
+    inline T dot(const Quaternion<T>& a, const Quaternion<T>& b)
+    {
+        return dot(a.v, b.v);
+    }
+
+    template<typename T>
+    inline Quaternion<T> conjugate(const Quaternion<T>& q)
+    {
+        return Quaternion<T>(q.v.x, -q.v.y, -q.v.z, -q.v.w);
+    }
+
+    template<typename T>
+    inline Quaternion<T> normalize(const Quaternion<T>& q)
+    {
+        return q * (T(1) / q.length());
+    }
+
+    // The rest assume unit quaternions. As in operator* above, x is the
+    // real part and y z w the imaginary ones.
+
+    // Pure quaternion (0, angle * axis) for q = (cos angle, sin angle * axis).
+    template<typename T>
+    Quaternion<T> quat_log(const Quaternion<T>& q)
+    {
+        const Vector3<T> u(q.v.y, q.v.z, q.v.w);
+        const T s = u.length();
+        if (s < T(1e-6))
+            return Quaternion<T>(T(0), u.x, u.y, u.z);
+        const T k = std::atan2(s, q.v.x) / s;
+        return Quaternion<T>(T(0), u.x * k, u.y * k, u.z * k);
+    }
+
+    template<typename T>
+    Quaternion<T> quat_exp(const Quaternion<T>& q)
+    {
+        const Vector3<T> u(q.v.y, q.v.z, q.v.w);
+        const T a = u.length();
+        if (a < T(1e-6))
+            return normalize(Quaternion<T>(T(1), u.x, u.y, u.z));
+        const T k = std::sin(a) / a;
+        return Quaternion<T>(std::cos(a), u.x * k, u.y * k, u.z * k);
+    }
+
+    // Does not take the shorter way round: flip b first if dot(a, b) < 0.
+    template<typename T>
+    Quaternion<T> slerp(const Quaternion<T>& a, const Quaternion<T>& b, T t)
+    {
+        const T c = dot(a, b);
+        if (std::abs(c) > T(0.9995))
+            return normalize(a * (T(1) - t) + b * t);
+
+        const T angle = std::acos(c);
+        const T s = T(1) / std::sin(angle);
+        return a * (std::sin((T(1) - t) * angle) * s) + b * (std::sin(t * angle) * s);
+    }
+
+    // Spherical cubic between q1 and q2 with inner control points s1 and
+    // s2 (Shoemake's squad).
+    template<typename T>
+    Quaternion<T> squad(const Quaternion<T>& q1, const Quaternion<T>& s1, const Quaternion<T>& s2, const Quaternion<T>& q2, T t)
+    {
+        return slerp(slerp(q1, q2, t), slerp(s1, s2, t), T(2) * t * (T(1) - t));
+    }
+
+    // Rotation part of m, which must be orthonormal.
+    template<typename T>
+    Quaternion<T> to_quaternion(const Matrix4x4<T>& m)
+    {
+        const T r00 = m[0], r01 = m[1], r02 = m[2];
+        const T r10 = m[4], r11 = m[5], r12 = m[6];
+        const T r20 = m[8], r21 = m[9], r22 = m[10];
+
+        const T trace = r00 + r11 + r22;
+        Quaternion<T> q;
+        if (trace > T(0))
+        {
+            const T s = std::sqrt(trace + T(1)) * T(2);
+            q = Quaternion<T>(T(0.25) * s, (r21 - r12) / s, (r02 - r20) / s, (r10 - r01) / s);
+        }
+        else if (r00 > r11 && r00 > r22)
+        {
+            const T s = std::sqrt(T(1) + r00 - r11 - r22) * T(2);
+            q = Quaternion<T>((r21 - r12) / s, T(0.25) * s, (r01 + r10) / s, (r02 + r20) / s);
+        }
+        else if (r11 > r22)
+        {
+            const T s = std::sqrt(T(1) + r11 - r00 - r22) * T(2);
+            q = Quaternion<T>((r02 - r20) / s, (r01 + r10) / s, T(0.25) * s, (r12 + r21) / s);
+        }
+        else
+        {
+            const T s = std::sqrt(T(1) + r22 - r00 - r11) * T(2);
+            q = Quaternion<T>((r10 - r01) / s, (r02 + r20) / s, (r12 + r21) / s, T(0.25) * s);
+        }
+        return normalize(q);
+    }
+
+    template<typename T>
+    Matrix4x4<T> to_matrix(const Quaternion<T>& q)
+    {
+        const T w = q.v.x, x = q.v.y, y = q.v.z, z = q.v.w;
+
+        Matrix4x4<T> m;
+        m[0] = T(1) - T(2) * (y*y + z*z); m[1] = T(2) * (x*y - z*w);         m[2]  = T(2) * (x*z + y*w);
+        m[4] = T(2) * (x*y + z*w);         m[5] = T(1) - T(2) * (x*x + z*z); m[6]  = T(2) * (y*z - x*w);
+        m[8] = T(2) * (x*z - y*w);         m[9] = T(2) * (y*z + x*w);         m[10] = T(1) - T(2) * (x*x + y*y);
+        return m;
+    }
+
     typedef Quaternion<float>  Quaternionf;
     typedef Quaternion<double> Quaterniond;
 
@@ -1168,6 +1926,49 @@ namespace kd
         return m;
     }
 
+    // True when the box is certainly outside the clip volume of m (clip
+    // space x and y in [-w, w], w > 0). The eight corners go through the
+    // transform as one packet; a box is rejected only if all of them fall
+    // outside the same plane, so some boxes near frustum corners pass.
+    static inline bool outside_frustum(const Matrix4x4f& m, const AABBf& b)
+    {
+        float x[8], y[8], z[8];
+        for (int i = 0; i < 8; i++)
+        {
+            Vector3f c = b.getCorner(i);
+            x[i] = c.x;
+            y[i] = c.y;
+            z[i] = c.z;
+        }
+
+        Vector4x8 p = m * load3<floatx8>(x, y, z);
+
+        return all(p.x < -p.w) || all(p.x > p.w) ||
+               all(p.y < -p.w) || all(p.y > p.w) ||
+               all(p.w <= floatx8(0.f));
+    }
+
+    //
+    // Morton order.
+    //
+
+    // Spreads the low 10 bits of v to every third bit.
+    static inline uint32 morton_spread3(uint32 v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // Interleaves three 10-bit coordinates into a 30-bit code.
+    static inline uint32 morton3(uint32 x, uint32 y, uint32 z)
+    {
+        return morton_spread3(x) | (morton_spread3(y) << 1) | (morton_spread3(z) << 2);
+    }
+
     //
     // Sampling and pseudo-random.
     //
@@ -1219,6 +2020,170 @@ namespace kd
         return Vector3<T>(std::cos(u)*a, std::sin(u)*a, v);
     }
 
+inline namespace KD_SIMD_NAMESPACE
+{
+    //
+    // Fast approximations.
+    //
+    // Packet versions of sin, cos and exp for floatx4/floatx8. Range
+    // reduction and minimax polynomials are the ones from Cephes sinf/expf.
+    // Max error against a double precision reference, as measured by bench:
+    //
+    //   sin_approx, cos_approx   |x| <= 8192         2.1 ulp (1.6 with FMA),
+    //                                                  abs. error < 1e-7 near 0
+    //   exp_approx               -87.3 <= x <= 88.3   1.3 ulp
+    //
+    // Larger sin/cos arguments lose precision in range reduction, exp input
+    // is clamped to the range above. NaN and inf are not handled.
+    //
+
+    template<typename F>
+    inline void sincos_approx(const F& x, F& s, F& c)
+    {
+        typedef typename simd_traits<F>::int_type I;
+
+        F ax = abs(x);
+
+        // Octant, rounded up to even so the remainder is in [-pi/4, pi/4].
+        I j = to_int(ax * F(1.27323954473516f));
+        j = (j + I(1)) & I(~1);
+        F y = to_float(j);
+
+        // Subtract y*pi/4 in three parts to keep the low bits.
+        F r = opaque(madd(y, F(-0.78515625f), ax));
+        r = opaque(madd(y, F(-2.4187564849853515625e-4f), r));
+        r = madd(y, F(-3.77489497744594108e-8f), r);
+        F z = r * r;
+
+        F ps = madd(z, F(-1.9515295891e-4f), F(8.3321608736e-3f));
+        ps = madd(ps, z, F(-1.6666654611e-1f));
+        ps = madd(ps * z, r, r);
+
+        F pc = madd(z, F(2.443315711809948e-5f), F(-1.388731625493765e-3f));
+        pc = madd(pc, z, F(4.166664568298827e-2f));
+        pc = madd(pc * z, z, madd(z, F(-.5f), F(1.f)));
+
+        F swap = as_float((j & I(2)) == I(2));
+        F signS = as_float((j & I(4)) << 29) ^ (x & F(-0.f));
+        F signC = as_float(((j + I(2)) & I(4)) << 29);
+
+        s = select(swap, pc, ps) ^ signS;
+        c = select(swap, ps, pc) ^ signC;
+    }
+
+    template<typename F>
+    inline F sin_approx(const F& x)
+    {
+        F s, c;
+        sincos_approx(x, s, c);
+        return s;
+    }
+
+    template<typename F>
+    inline F cos_approx(const F& x)
+    {
+        F s, c;
+        sincos_approx(x, s, c);
+        return c;
+    }
+
+    template<typename F>
+    inline F exp_approx(const F& xx)
+    {
+        typedef typename simd_traits<F>::int_type I;
+
+        F x = min(max(xx, F(-87.3f)), F(88.3f));
+
+        // exp(x) = 2^n * exp(r), |r| <= ln(2)/2
+        F n = floor(madd(x, F(1.44269504088896341f), F(.5f)));
+        x = opaque(madd(n, F(-0.693359375f), x));
+        x = madd(n, F(2.12194440e-4f), x);
+        F z = x * x;
+
+        F p = madd(x, F(1.9875691500e-4f), F(1.3981999507e-3f));
+        p = madd(p, x, F(8.3334519073e-3f));
+        p = madd(p, x, F(4.1665795894e-2f));
+        p = madd(p, x, F(1.6666665459e-1f));
+        p = madd(p, x, F(5.0000001201e-1f));
+        p = madd(p, z, x + F(1.f));
+
+        return p * as_float((to_int(n) + I(127)) << 23);
+    }
+
+    //
+    // Math policies. Effects take one of these as a template parameter to
+    // pick between the C library and the approximations above. Both work on
+    // plain floats and on packets.
+    //
+
+    struct LibmMath
+    {
+        static float sin(float x) { return std::sin(x); }
+        static float cos(float x) { return std::cos(x); }
+        static float exp(float x) { return std::exp(x); }
+
+        template<typename F> static F sin(const F& x) { return lanes(x, &LibmMath::sin); }
+        template<typename F> static F cos(const F& x) { return lanes(x, &LibmMath::cos); }
+        template<typename F> static F exp(const F& x) { return lanes(x, &LibmMath::exp); }
+
+        template<typename F>
+        static F lanes(const F& x, float (*f)(float))
+        {
+            float t[F::width];
+            store(t, x);
+            for (int i = 0; i < F::width; i++)
+                t[i] = f(t[i]);
+            return load(t, F());
+        }
+    };
+
+    struct FastMath
+    {
+        static float sin(float x) { return _mm_cvtss_f32(sin_approx(floatx4(x)).v); }
+        static float cos(float x) { return _mm_cvtss_f32(cos_approx(floatx4(x)).v); }
+        static float exp(float x) { return _mm_cvtss_f32(exp_approx(floatx4(x)).v); }
+
+        template<typename F> static F sin(const F& x) { return sin_approx(x); }
+        template<typename F> static F cos(const F& x) { return cos_approx(x); }
+        template<typename F> static F exp(const F& x) { return exp_approx(x); }
+    };
+
+    //
+    // Packet sampling.
+    //
+
+    // Base 2 radical inverse of each lane (k < 2^24), by reversing the
+    // bits: equals haltonf<2>(k-1) exactly, without the digit loop.
+    template<typename I>
+    inline typename simd_traits<I>::float_type radical_inverse2(I k)
+    {
+        typedef typename simd_traits<I>::float_type F;
+
+        k = ((k >> 1) & I(0x55555555)) | ((k & I(0x55555555)) << 1);
+        k = ((k >> 2) & I(0x33333333)) | ((k & I(0x33333333)) << 2);
+        k = ((k >> 4) & I(0x0f0f0f0f)) | ((k & I(0x0f0f0f0f)) << 4);
+        k = ((k >> 8) & I(0x00ff00ff)) | ((k & I(0x00ff00ff)) << 8);
+        k = ((k >> 16) & I(0xffff)) | (k << 16);
+
+        // Top 24 bits convert exactly.
+        return to_float((k >> 8) & I(0xffffff)) * F(1.f / 16777216.f);
+    }
+
+    // point_on_sphere for packets, with sincos_approx for the trig.
+    template<typename F>
+    inline Vector3x<F> point_on_sphere_approx(F u, F v)
+    {
+        u = u * F(2.f * PIf);
+        v = madd(v, F(2.f), F(-1.f));
+
+        F a = sqrt(max(F(1.f) - v*v, F(0.f)));
+        F s, c;
+        sincos_approx(u, s, c);
+
+        return Vector3x<F>(c * a, s * a, v);
+    }
+}
+
     //
     // Misc.
     //
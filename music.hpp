@@ -3,27 +3,67 @@
 #include "SDL_mixer.h"
 #include "math.hpp"
 
+#include <chrono>
+#include <mutex>
 #include <string>
 
 namespace kd
 {
+	// Seconds on a steady clock, with sub-microsecond resolution.
+	static double clockSeconds()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//
+	// Time comes from the audio, not from when Mix_PlayChannel returned. A
+	// post-mix hook counts the samples mixed since the music started and
+	// notes when each buffer was mixed; a buffer is heard one buffer later
+	// plus outputLatency, the rest of the way to the speakers. That gives
+	// the offset from the steady clock to the music. Callbacks run late
+	// but never early, so the offset is taken from the most punctual ones
+	// and allowed to sink slowly, as far as the two clocks could drift
+	// apart. Between callbacks the steady clock interpolates, so time has
+	// microsecond steps instead of milliseconds.
+	//
+
 	class Music
 	{
 	public:
 		std::string filename;
-		Mix_Music *music;
-		uint32 start_time;
+		Mix_Chunk *chunk;		// the whole song, decoded
+		int channel;
+		double start_time;		// clockSeconds() at play()
 		bool playing;
 		float bpm;
+		double outputLatency;	// seconds past the mixing buffer
 
 		Music(std::string filename, float bpm)
-			: filename(filename), bpm(bpm), music(0), playing(false), start_time(0)
+			: filename(filename), bpm(bpm), chunk(0), channel(-1), playing(false), start_time(0),
+			  outputLatency(0.0), rate(44100), frameBytes(4),
+			  mixed(0), startSample(-1), startPending(false), offset(0.0), lastTime(0.0)
 		{
 		}
 
-		~Music() { if(music) Mix_FreeMusic(music); }
+		~Music()
+		{
+			if(chunk) Mix_FreeChunk(chunk);
+		}
 
 		void init()
+		{
+			init(0, 0);
+		}
+
+		void init(const void* data, size_t size)
+		{
+			open();
+			decode(data, size);
+		}
+
+		// Opens the audio device; SDL audio must be initialized. Before
+		// decode(), which converts to the device's format.
+		void open()
 		{
 			Mix_Init(MIX_INIT_OGG);
 
@@ -33,9 +73,26 @@ namespace kd
 	            exit(1);
 	        }
 
-			music = Mix_LoadMUS(filename.c_str());
+			// The device may not have taken what was asked for.
+			Uint16 format;
+			int channels;
+			Mix_QuerySpec(&rate, &format, &channels);
+			frameBytes = channels * ((format & 0xff) / 8);
+			Mix_SetPostMix(postMix, this);
+		}
 
-			if (!music)
+		// Decodes the whole song up front, so that playing it costs no
+		// decoding on the audio thread. With data, decodes the file from
+		// memory (e.g. a mapped asset archive) instead of opening
+		// filename. Needs no SDL lock and may run on a worker.
+		void decode(const void* data, size_t size)
+		{
+			if (data)
+				chunk = Mix_LoadWAV_RW(SDL_RWFromConstMem(data, int(size)), 1);
+			else
+				chunk = Mix_LoadWAV_RW(SDL_RWFromFile(filename.c_str(), "rb"), 1);
+
+			if (!chunk)
 		    {
 		        printf("Ei saatu musaa :( %s\n", Mix_GetError());
 		        exit(1);
@@ -44,27 +101,37 @@ namespace kd
 
 		void play()
 		{
-			if (Mix_PlayMusic(music, 1) == 0)
+			// With the audio locked the music starts in the very buffer
+			// that the next post-mix call sees.
+			SDL_LockAudio();
+			channel = Mix_PlayChannel(-1, chunk, 0);
+			if (channel >= 0)
 			{
-				start_time = SDL_GetTicks();
+				std::lock_guard<std::mutex> lock(clockMutex);
+				start_time = clockSeconds();
+				startSample = -1;
+				startPending = true;
+				lastTime = 0.0;
 				playing = true;
 			}
 			else
 			{
 				printf("Musa ei soi :/ %s\n", Mix_GetError());
 			}
+			SDL_UnlockAudio();
 		}
 
 		void setEndHook(void (*music_finished)())
 		{
-			Mix_HookMusicFinished(music_finished);
+			endHook() = music_finished;
+			Mix_ChannelFinished(channelFinished);
 		}
 
 		uint32 getTicks()
 		{
 			if (playing)
 			{
-				return SDL_GetTicks() - start_time;
+				return uint32(getExactTime() * 1000.0);
 			}
 
 			return 0;
@@ -74,28 +141,102 @@ namespace kd
 		{
 			if (playing)
 			{
-				return float(getTicks()) / 1000.0;
+				return float(getExactTime());
 			}
 
 			return -1.f;
 		}
 
-		int getBeats()
+		// Seconds of music heard so far; never goes back.
+		double getExactTime()
 		{
-			const uint32 beat = 60000 / bpm;
+			if (!playing)
+				return -1.0;
+
+			double t;
+			{
+				std::lock_guard<std::mutex> lock(clockMutex);
+				if (startSample < 0)
+					t = clockSeconds() - start_time;	// no audio mixed yet
+				else
+					t = clockSeconds() + offset - double(startSample) / rate;
+			}
+
+			lastTime = std::max(lastTime, std::max(t, 0.0));
+			return lastTime;
+		}
 
-			return getTicks() / beat;
+		int getBeats()
+		{
+			return int(getExactTime() * bpm / 60.0);
 		}
 
+		// 1 at each beat down to 0 just before the next, or with closest
+		// 1 at beats and 0 halfway between them.
 		float getBeat(bool closest=false)
 		{
-			const uint32 beat = 60000 / bpm;
-			const uint32 halfbeat = beat / 2;
+			const double beats = getExactTime() * bpm / 60.0;
+			const double phase = beats - std::floor(beats);
 
 			if (closest)
-				return float(absi((getTicks() % beat) - halfbeat)) / float(halfbeat);
+				return float(std::fabs(phase * 2.0 - 1.0));
+			else
+				return float(1.0 - phase);
+		}
+
+	private:
+		// Lateness beyond this is not jitter but e.g. an audio dropout,
+		// and the offset is taken as it is.
+		static constexpr double resyncSeconds = 0.02;
+		static constexpr double maxDrift = 0.001;		// seconds per second
+
+		static void (*&endHook())()
+		{
+			static void (*hook)() = 0;
+			return hook;
+		}
+
+		// Only the music plays, on whatever channel it got.
+		static void channelFinished(int)
+		{
+			if (endHook())
+				endHook()();
+		}
+
+		// On the audio thread, after every buffer is mixed.
+		static void postMix(void* udata, Uint8* stream, int len)
+		{
+			Music& m = *(Music*)udata;
+			const double now = clockSeconds();
+			std::lock_guard<std::mutex> lock(m.clockMutex);
+
+			if (m.startPending)
+			{
+				m.startSample = m.mixed;
+				m.startPending = false;
+			}
+
+			// Sample number mixed is heard at heardAt. The buffer is what
+			// the device asked for, not necessarily what was requested.
+			const int64 frames = len / m.frameBytes;
+			const double bufferSeconds = double(frames) / m.rate;
+			const double heardAt = now + bufferSeconds + m.outputLatency;
+			const double measured = double(m.mixed) / m.rate - heardAt;
+			if (measured < m.offset - resyncSeconds)
+				m.offset = measured;
 			else
-				return float(beat - (getTicks() % beat)) / float(beat);
+				m.offset = std::max(measured, m.offset - bufferSeconds * maxDrift);
+
+			m.mixed += frames;
 		}
+
+		int rate, frameBytes;
+
+		std::mutex clockMutex;		// between postMix and the rest
+		int64 mixed;				// samples since the audio opened
+		int64 startSample;			// where the music began, -1 until mixed
+		bool startPending;
+		double offset;				// audio clock minus steady clock
+		double lastTime;
 	};
 }
\ No newline at end of file
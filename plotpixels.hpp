@@ -2,43 +2,449 @@
 
 #include "image.hpp"
 #include "math.hpp"
+#include "camera.hpp"
+#include <sys/mman.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 namespace kd
 {
+    //
+    // Point set for splatting. Storage is structure-of-arrays in chunks of
+    // at most chunkSize points so transform kernels can stream packets
+    // through it. Colours are RGBA8 like Image pixels.
+    //
+    // build() sorts the points along a Morton curve and cuts the curve into
+    // an octree whose leaves own runs of chunks, so every node covers a
+    // contiguous range of chunks and points. Inside a chunk the points are
+    // stored in bit-reversed Morton order: any prefix of a chunk is an
+    // evenly spread subsample of it, which is what the level of detail in
+    // selectChunks() draws.
+    //
+    // After quantize() positions are int16 offsets inside each chunk's
+    // bounding box instead of floats: 10 bytes per point instead of the 28
+    // of Vector3f + Vector4f. A quantized set can also point straight into
+    // a mapped point file, see pointfile.hpp.
+    //
+
     struct PlotPixels
     {
-        PlotPixels() : numPixels(0), maxPixels(0), pixelPos(0), pixelColor(0) {}
-        ~PlotPixels() { delete[] pixelPos; delete[] pixelColor; }
+        static const int chunkSize = 4096;
+        static const int maxDepth = 10;     // Morton bits per axis
+
+        struct Chunk
+        {
+            int begin, end;
+            AABBf bounds;
+
+            // position = origin + quantized * scale
+            Vector3f origin;
+            Vector3f scale;
+
+            int prefetched;     // points already paged in, mapped sets only
+        };
+
+        // Octree nodes in depth-first order: children follow their parent
+        // and next is the index after the node's subtree.
+        struct Node
+        {
+            AABBf bounds;
+            int firstChunk, endChunk;
+            int next;
+            bool leaf;
+        };
+
+        PlotPixels()
+        :   numPixels(0), maxPixels(0),
+            posX(0), posY(0), posZ(0),
+            quantX(0), quantY(0), quantZ(0),
+            color(0), mapped(0), mappedSize(0)
+        {
+        }
+
+        ~PlotPixels() { destroy(); }
 
         void create(int m)
         {
+            destroy();
+
             numPixels = 0;
             maxPixels = m;
-            pixelPos = new Vector3f [m];
-            pixelColor = new Vector4f [m];
+
+            // Padded so that packet loads at the end stay in bounds.
+            const int n = m + floatx8::width;
+            posX = new float [n];
+            posY = new float [n];
+            posZ = new float [n];
+            color = new uint32 [n];
+        }
+
+        void destroy()
+        {
+            if (mapped)
+            {
+                munmap(mapped, mappedSize);
+                mapped = 0;
+                mappedSize = 0;
+            }
+            else
+            {
+                delete[] posX;
+                delete[] posY;
+                delete[] posZ;
+                delete[] quantX;
+                delete[] quantY;
+                delete[] quantZ;
+                delete[] color;
+            }
+            posX = posY = posZ = 0;
+            quantX = quantY = quantZ = 0;
+            color = 0;
+            chunks.clear();
+            nodes.clear();
+            numPixels = maxPixels = 0;
+        }
+
+        void add(const Vector3f& p, uint32 c)
+        {
+            const int i = alloc(1);
+
+            posX[i] = p.x;
+            posY[i] = p.y;
+            posZ[i] = p.z;
+            color[i] = c;
+        }
+
+        // Appends n uninitialized points and returns the first index, so
+        // that several workers can fill disjoint ranges.
+        int alloc(int n)
+        {
+            kd_assert(numPixels + n <= maxPixels && !isQuantized());
+
+            nodes.clear();
+            chunks.clear();
+            const int first = numPixels;
+            numPixels += n;
+            return first;
+        }
+
+        bool isBuilt() const
+        {
+            return numPixels == 0 || !nodes.empty();
+        }
+
+        // Reorders the points and builds the chunks and the octree. Needed
+        // once after the last add() before binning.
+        void build()
+        {
+            if (isBuilt())
+                return;
+
+            kd_assert(!isQuantized());
+
+            AABBf all;
+            for (int i = 0; i < numPixels; i++)
+                all.grow(Vector3f(posX[i], posY[i], posZ[i]));
+
+            const float cells = float((1 << maxDepth) - 1);
+            Vector3f diag = all.getDiagonal();
+            Vector3f s(
+                cells / std::max(diag.x, 1e-20f),
+                cells / std::max(diag.y, 1e-20f),
+                cells / std::max(diag.z, 1e-20f));
+
+            std::vector<std::pair<uint32, int> > order(numPixels);
+            for (int i = 0; i < numPixels; i++)
+            {
+                order[i].first = morton3(
+                    uint32((posX[i] - all.min.x) * s.x),
+                    uint32((posY[i] - all.min.y) * s.y),
+                    uint32((posZ[i] - all.min.z) * s.z));
+                order[i].second = i;
+            }
+
+            // Stable so that points in the same cell keep their order.
+            radixSort(order);
+
+            chunks.clear();
+            nodes.clear();
+            buildNode(order, 0, numPixels, 0);
+
+            // Progressive order inside each chunk.
+            std::vector<int> perm(numPixels);
+            for (int c = 0; c < (int)chunks.size(); c++)
+            {
+                const int begin = chunks[c].begin;
+                const int n = chunks[c].end - begin;
+
+                int bits = 0;
+                while ((1 << bits) < n)
+                    bits++;
+
+                int j = begin;
+                for (int k = 0; k < (1 << bits); k++)
+                {
+                    int r = reverseBits(k, bits);
+                    if (r < n)
+                        perm[j++] = order[begin + r].second;
+                }
+            }
+
+            permute(perm);
+
+            // Bounds once the points are in place, so they are read in order.
+            for (int c = 0; c < (int)chunks.size(); c++)
+            {
+                AABBf bounds;
+                for (int i = chunks[c].begin; i < chunks[c].end; i++)
+                    bounds.grow(Vector3f(posX[i], posY[i], posZ[i]));
+                chunks[c].bounds = bounds;
+            }
+
+            for (int i = 0; i < (int)nodes.size(); i++)
+                for (int c = nodes[i].firstChunk; c < nodes[i].endChunk; c++)
+                    nodes[i].bounds.grow(chunks[c].bounds);
+        }
+
+        void quantize()
+        {
+            if (isQuantized())
+                return;
+
+            build();
+
+            const int n = maxPixels + floatx8::width;
+            quantX = new int16 [n];
+            quantY = new int16 [n];
+            quantZ = new int16 [n];
+
+            for (int c = 0; c < (int)chunks.size(); c++)
+            {
+                const AABBf& bounds = chunks[c].bounds;
+
+                Vector3f diag = bounds.getDiagonal();
+                Vector3f scale(
+                    std::max(diag.x, 1e-20f) / 65535.f,
+                    std::max(diag.y, 1e-20f) / 65535.f,
+                    std::max(diag.z, 1e-20f) / 65535.f);
+
+                for (int i = chunks[c].begin; i < chunks[c].end; i++)
+                {
+                    quantX[i] = int16(int((posX[i] - bounds.min.x) / scale.x + .5f) - 32768);
+                    quantY[i] = int16(int((posY[i] - bounds.min.y) / scale.y + .5f) - 32768);
+                    quantZ[i] = int16(int((posZ[i] - bounds.min.z) / scale.z + .5f) - 32768);
+                }
+
+                chunks[c].origin = bounds.min + scale * Vector3f(32768.f, 32768.f, 32768.f);
+                chunks[c].scale = scale;
+            }
+
+            delete[] posX;
+            delete[] posY;
+            delete[] posZ;
+            posX = posY = posZ = 0;
+        }
+
+        bool isQuantized() const
+        {
+            return quantX != 0;
+        }
+
+        // Chunk that holds point i, after build().
+        int findChunk(int i) const
+        {
+            int lo = 0, hi = (int)chunks.size();
+            while (hi - lo > 1)
+            {
+                int mid = (lo + hi) / 2;
+                if (chunks[mid].begin <= i)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            return lo;
+        }
+
+        // Maps getLocal() positions of a chunk to world space.
+        Matrix4x4f chunkTransform(int chunk) const
+        {
+            if (!isQuantized())
+                return Matrix4x4f();
+            return translate(chunks[chunk].origin) * kd::scale(chunks[chunk].scale);
+        }
+
+        Vector3f getLocal(int i) const
+        {
+            if (isQuantized())
+                return Vector3f(float(quantX[i]), float(quantY[i]), float(quantZ[i]));
+            return Vector3f(posX[i], posY[i], posZ[i]);
+        }
+
+        Vector3f getPosition(int i) const
+        {
+            if (!isQuantized())
+                return getLocal(i);
+            const Chunk& c = chunks[findChunk(i)];
+            return c.origin + getLocal(i) * c.scale;
+        }
+
+        // Packet of local positions starting at i.
+        template<typename F>
+        Vector3x<F> getLocal(int i, F) const
+        {
+            if (isQuantized())
+                return Vector3x<F>(load_int16(quantX + i, F()), load_int16(quantY + i, F()), load_int16(quantZ + i, F()));
+            return load3<F>(posX + i, posY + i, posZ + i);
         }
 
         int numPixels;
         int maxPixels;
-        Vector3f* pixelPos;
-        Vector4f* pixelColor;
+        float* posX;
+        float* posY;
+        float* posZ;
+        int16* quantX;
+        int16* quantY;
+        int16* quantZ;
+        uint32* color;
+        std::vector<Chunk> chunks;
+        std::vector<Node> nodes;
+
+        // Point file the arrays live in, if any.
+        void* mapped;
+        size_t mappedSize;
+
+    private:
+        // Stable LSD radix sort on the 30-bit Morton codes.
+        static void radixSort(std::vector<std::pair<uint32, int> >& v)
+        {
+            // Two passes; the counts still fit in L2.
+            const int bits = 15;
+            const int buckets = 1 << bits;
+
+            std::vector<std::pair<uint32, int> > tmp(v.size());
+            std::vector<int> count(buckets);
+
+            for (int shift = 0; shift < 3 * maxDepth; shift += bits)
+            {
+                std::fill(count.begin(), count.end(), 0);
+                for (size_t i = 0; i < v.size(); i++)
+                    count[(v[i].first >> shift) & (buckets - 1)]++;
+
+                int sum = 0;
+                for (int b = 0; b < buckets; b++)
+                {
+                    int c = count[b];
+                    count[b] = sum;
+                    sum += c;
+                }
+
+                for (size_t i = 0; i < v.size(); i++)
+                    tmp[count[(v[i].first >> shift) & (buckets - 1)]++] = v[i];
+
+                v.swap(tmp);
+            }
+        }
+
+        static int reverseBits(int v, int bits)
+        {
+            int r = 0;
+            for (int i = 0; i < bits; i++)
+                r |= ((v >> i) & 1) << (bits - 1 - i);
+            return r;
+        }
+
+        // Node for sorted points [begin, end) sharing the Morton prefix of
+        // the given depth. Leaves cut their range into equal chunks.
+        void buildNode(const std::vector<std::pair<uint32, int> >& order, int begin, int end, int depth)
+        {
+            const int index = (int)nodes.size();
+            nodes.push_back(Node());
+            nodes[index].firstChunk = (int)chunks.size();
+            nodes[index].leaf = end - begin <= chunkSize || depth == maxDepth;
+
+            if (nodes[index].leaf)
+            {
+                const int n = (end - begin + chunkSize - 1) / chunkSize;
+                for (int c = 0; c < n; c++)
+                {
+                    Chunk chunk;
+                    chunk.begin = begin + (end - begin) * c / n;
+                    chunk.end = begin + (end - begin) * (c+1) / n;
+                    chunk.origin = Vector3f(0.f, 0.f, 0.f);
+                    chunk.scale = Vector3f(1.f, 1.f, 1.f);
+                    chunk.prefetched = 0;
+                    chunks.push_back(chunk);
+                }
+            }
+            else
+            {
+                const int shift = 3 * (maxDepth - 1 - depth);
+                int i = begin;
+                while (i < end)
+                {
+                    const uint32 cell = (order[i].first >> shift) & 7;
+                    int j = i;
+                    while (j < end && ((order[j].first >> shift) & 7) == cell)
+                        j++;
+                    buildNode(order, i, j, depth + 1);
+                    i = j;
+                }
+            }
+
+            nodes[index].endChunk = (int)chunks.size();
+            nodes[index].next = (int)nodes.size();
+        }
+
+        // Moves point perm[i] to i in all arrays.
+        void permute(const std::vector<int>& perm)
+        {
+            float* x = new float [maxPixels + floatx8::width];
+            float* y = new float [maxPixels + floatx8::width];
+            float* z = new float [maxPixels + floatx8::width];
+            uint32* c = new uint32 [maxPixels + floatx8::width];
+
+            for (int i = 0; i < numPixels; i++)
+            {
+                const int j = perm[i];
+                x[i] = posX[j];
+                y[i] = posY[j];
+                z[i] = posZ[j];
+                c[i] = color[j];
+            }
+
+            std::swap(x, posX);
+            std::swap(y, posY);
+            std::swap(z, posZ);
+            std::swap(c, color);
+            delete[] x;
+            delete[] y;
+            delete[] z;
+            delete[] c;
+        }
     };
 
-    static Vector4f blendPixel(const Vector4f& src, const Vector4f& dst)
+    // src premultiplied by its alpha, with zero alpha so that adding it
+    // keeps the destination's.
+    static inline Vector4f premultiply(const Vector4f& src)
     {
-        const float r = src.x * src.w + dst.x;
-        const float g = src.y * src.w + dst.y;
-        const float b = src.z * src.w + dst.z;
-        const float a = dst.w;
+        return Vector4f(src.x * src.w, src.y * src.w, src.z * src.w, 0.f);
+    }
 
-        return Vector4f(r, g, b, a);
+    static Vector4f blendPixel(const Vector4f& src, const Vector4f& dst)
+    {
+        return premultiply(src) + dst;
     }
 
-    static void plotPixels(Image& dst, const Camera& cam, const PlotPixels& pp)
+    static void plotPixels(const ImageView& dst, const Camera& cam, const PlotPixels& pp)
     {
         for (int i = 0; i < pp.numPixels; i++)
         {
-            Vector4f p = cam.viewToClip * Vector4f(pp.pixelPos[i], 1.f);
+            Vector4f p = cam.viewToClip * Vector4f(pp.getPosition(i), 1.f);
+
+            // Behind the eye; the divide would mirror it onto the screen.
+            if (p.w <= 0.f)
+                continue;
 
             p /= p.w;
 
@@ -51,37 +457,447 @@ namespace kd
             if (x < 1 || y < 1 || x >= dst.w || y >= dst.h)
                 continue;
 
-            dst.put(x-1, y-1,   blendPixel(pp.pixelColor[i], dst.get(x-1, y-1)));
-            dst.put(x, y-1,     blendPixel(pp.pixelColor[i], dst.get(x, y-1)));
-            dst.put(x-1, y,     blendPixel(pp.pixelColor[i], dst.get(x-1, y)));
-            dst.put(x, y,       blendPixel(pp.pixelColor[i], dst.get(x, y)));
+            const Vector4f c = unpackColor(pp.color[i]);
+
+            dst.put(x-1, y-1,   blendPixel(c, dst.get(x-1, y-1)));
+            dst.put(x, y-1,     blendPixel(c, dst.get(x, y-1)));
+            dst.put(x-1, y,     blendPixel(c, dst.get(x-1, y)));
+            dst.put(x, y,       blendPixel(c, dst.get(x, y)));
         }
     }
 
-    static void generateSphere(PlotPixels& pp, const Vector3f& p, float r, int n)
+    //
+    // Binned splatting. Points are projected in parallel into per-job lists
+    // of screen tiles (binPixels), then each tile is composited by exactly
+    // one worker (splatTiles). Jobs cover consecutive runs of chunk draws
+    // and tiles replay them in job order, so with the level of detail off
+    // every pixel sees its splats in the same order as plotPixels.
+    //
+
+    struct Splat
+    {
+        int16 x, y;     // lower right pixel of the 2x2 footprint
+        uint32 color;
+    };
+
+    // A tile's splats. Not a std::vector: the bins are filled in the
+    // kernels, and std::vector<Splat>'s growth would be one function under
+    // one name in every kernel file (see KernelAllocator). The type is
+    // shared with main, so growth is in addSplat instead, which is static
+    // and compiled for each ISA.
+    struct SplatList
+    {
+        Splat* data;
+        int size, capacity;
+    };
+
+    struct PlotBins
     {
-        for (int i = 0; i < n; i++)
+        static const int tileSize = 32;
+
+        PlotBins() : w(0), h(0), tilesX(0), tilesY(0), slots(0) {}
+        ~PlotBins() { release(); }
+
+        PlotBins(const PlotBins&) = delete;
+        PlotBins& operator=(const PlotBins&) = delete;
+
+        // Keeps the lists (and their capacity) when nothing changes.
+        void resize(int nw, int nh, int nslots)
         {
-            float u = (i+.5f) / n;
-            float v = haltonf<2>(i+1);
+            if (nw == w && nh == h && nslots == slots)
+                return;
+
+            w = nw;
+            h = nh;
+            tilesX = (w + tileSize - 1) / tileSize;
+            tilesY = (h + tileSize - 1) / tileSize;
+            slots = nslots;
+            release();
+            const SplatList empty = { 0, 0, 0 };
+            bins.assign(slots * tilesX * tilesY, empty);
+        }
 
-            pp.pixelPos[pp.numPixels] = p + point_on_sphere(u, v) * r;
-            pp.pixelColor[pp.numPixels] = Vector4f(1.f, 1.f, 1.f, 1.f);
-            pp.numPixels++;
+        SplatList& bin(int slot, int tx, int ty)
+        {
+            return bins[(slot * tilesY + ty) * tilesX + tx];
         }
+
+        const SplatList& bin(int slot, int tx, int ty) const
+        {
+            return bins[(slot * tilesY + ty) * tilesX + tx];
+        }
+
+        int w, h;
+        int tilesX, tilesY;
+        int slots;
+        std::vector<SplatList> bins;
+
+    private:
+        void release()
+        {
+            for (size_t i = 0; i < bins.size(); i++)
+                free(bins[i].data);
+            bins.clear();
+        }
+    };
+
+    static inline void pushSplat(SplatList& b, const Splat& s)
+    {
+        if (b.size == b.capacity)
+        {
+            const int n = std::max(64, b.capacity * 2);
+            Splat* p = (Splat*)realloc(b.data, size_t(n) * sizeof(Splat));
+            if (!p)
+                throw std::bad_alloc();
+            b.data = p;
+            b.capacity = n;
+        }
+        b.data[b.size++] = s;
+    }
+
+    static inline void addSplat(PlotBins& bins, int slot, int x, int y, uint32 color)
+    {
+        const int T = PlotBins::tileSize;
+
+        if (x < 1 || y < 1 || x >= bins.w || y >= bins.h)
+            return;
+
+        Splat s;
+        s.x = int16(x);
+        s.y = int16(y);
+        s.color = color;
+
+        // The footprint straddles a tile edge when x or y is a multiple
+        // of the tile size.
+        for (int ty = (y-1) / T; ty <= y / T; ty++)
+            for (int tx = (x-1) / T; tx <= x / T; tx++)
+                pushSplat(bins.bin(slot, tx, ty), s);
+    }
+
+    //
+    // Level of detail. A chunk is drawn as a prefix of its points, sized so
+    // that the splats cover its projected bounds at about `density` points
+    // per pixel. If the whole frame would still exceed `budget` splats,
+    // every chunk is thinned by the same factor.
+    //
+
+    struct ChunkDraw
+    {
+        int chunk;
+        int count;      // points from the start of the chunk
+    };
+
+    struct PlotLod
+    {
+        PlotLod() : density(1.f), budget(1 << 21) {}
+
+        float density;  // points per pixel, 0 draws every point
+        int budget;     // splats per frame, 0 for no limit
+    };
+
+    // Screen area in pixels of the projected bounds, or -1 when the box
+    // reaches behind the eye and its projection is unbounded.
+    static float projectedArea(const Matrix4x4f& m, const AABBf& b, int w, int h)
+    {
+        float x0 = 1e30f, y0 = 1e30f, x1 = -1e30f, y1 = -1e30f;
+
+        for (int i = 0; i < 8; i++)
+        {
+            Vector4f p = m * Vector4f(b.getCorner(i), 1.f);
+            if (p.w <= 0.f)
+                return -1.f;
+
+            x0 = std::min(x0, p.x / p.w);
+            x1 = std::max(x1, p.x / p.w);
+            y0 = std::min(y0, p.y / p.w);
+            y1 = std::max(y1, p.y / p.w);
+        }
+
+        return (x1 - x0) * w * .5f * (y1 - y0) * h * .5f;
+    }
+
+    // Walks the octree, culls subtrees outside the view and sizes the
+    // visible chunks. Draws come out in chunk order. Returns the number of
+    // splats.
+    static int selectChunks(std::vector<ChunkDraw>& draws, const Camera& cam, const PlotPixels& pp, int w, int h, const PlotLod& lod)
+    {
+        kd_assert(pp.isBuilt());
+
+        draws.clear();
+        long long total = 0;
+
+        int i = 0;
+        while (i < (int)pp.nodes.size())
+        {
+            const PlotPixels::Node& node = pp.nodes[i];
+
+            if (!cam.isVisible(node.bounds))
+            {
+                i = node.next;
+                continue;
+            }
+
+            if (!node.leaf)
+            {
+                i++;
+                continue;
+            }
+
+            for (int c = node.firstChunk; c < node.endChunk; c++)
+            {
+                const PlotPixels::Chunk& chunk = pp.chunks[c];
+
+                ChunkDraw d;
+                d.chunk = c;
+                d.count = chunk.end - chunk.begin;
+
+                if (lod.density > 0.f)
+                {
+                    float area = projectedArea(cam.viewToClip, chunk.bounds, w, h);
+                    if (area >= 0.f)
+                        d.count = std::max(1, int(std::min(float(d.count), std::ceil(area * lod.density))));
+                }
+
+                total += d.count;
+                draws.push_back(d);
+            }
+
+            i = node.next;
+        }
+
+        if (lod.budget > 0 && total > lod.budget)
+        {
+            const double f = double(lod.budget) / double(total);
+
+            total = 0;
+            for (size_t k = 0; k < draws.size(); k++)
+            {
+                draws[k].count = std::max(1, int(draws[k].count * f));
+                total += draws[k].count;
+            }
+        }
+
+        return int(total);
+    }
+
+    // Screen pixels of F::width points starting at i, m maps the chunk's
+    // local positions to clip space. Points behind the eye get x = -1.
+    template<typename F>
+    static void projectPacket(const PlotPixels& pp, const Matrix4x4f& m, int i, int w, int h, int32* sx, int32* sy)
+    {
+        Vector4x<F> p = m * pp.getLocal(i, F());
+
+        F iw = F(1.f) / p.w;
+        F x = select(p.w > F(0.f), (p.x * iw + F(1.f)) * F(w * .5f), F(-1.f));
+        store(sx, to_int(x));
+        store(sy, to_int((p.y * iw + F(1.f)) * F(h * .5f)));
     }
 
-    static void plotImage(PlotPixels& pp, const Vector3f& p, Image& img, float sx, float sy)
+    // Projects the chunk prefixes of draws into the bins of one slot.
+    static void binPixels(PlotBins& bins, int slot, const Camera& cam, const PlotPixels& pp, const ChunkDraw* draws, int numDraws)
     {
-        for (int y = 0; y < img.h; y++)
-            for (int x = 0; x < img.w; x++)
+        const int n = floatx8::width;
+
+        for (int ty = 0; ty < bins.tilesY; ty++)
+            for (int tx = 0; tx < bins.tilesX; tx++)
+                bins.bin(slot, tx, ty).size = 0;
+
+        for (int d = 0; d < numDraws; d++)
+        {
+            // Fold the chunk's dequantization into the projection.
+            const int chunk = draws[d].chunk;
+            const int begin = pp.chunks[chunk].begin;
+            const int end = begin + draws[d].count;
+            const Matrix4x4f m = cam.viewToClip * pp.chunkTransform(chunk);
+
+            int32 sx[n], sy[n];
+
+            int i = begin;
+            for (; i + n <= end; i += n)
+            {
+                projectPacket<floatx8>(pp, m, i, bins.w, bins.h, sx, sy);
+                for (int k = 0; k < n; k++)
+                    addSplat(bins, slot, sx[k], sy[k], pp.color[i+k]);
+            }
+
+            for (; i < end; i++)
+            {
+                Vector4f p = m * Vector4f(pp.getLocal(i), 1.f);
+
+                if (p.w <= 0.f)
+                    continue;
+
+                p /= p.w;
+
+                int x = int((p.x + 1.f) * bins.w * .5f);
+                int y = int((p.y + 1.f) * bins.h * .5f);
+
+                addSplat(bins, slot, x, y, pp.color[i]);
+            }
+        }
+    }
+
+    // Composites tile rows [ty0, ty1) into an ImageView or a TiledImage.
+    template<typename Dst>
+    static void splatTiles(const Dst& dst, const PlotBins& bins, int ty0, int ty1)
+    {
+        kd_assert(dst.w == bins.w && dst.h == bins.h);
+
+        const int T = PlotBins::tileSize;
+
+        for (int ty = ty0; ty < ty1; ty++)
+            for (int tx = 0; tx < bins.tilesX; tx++)
             {
-                const float fx = sx * float(x) / float(img.w);
-                const float fy = sy * float(y) / float(img.h);
+                const int x0 = tx * T, x1 = std::min(x0 + T, dst.w);
+                const int y0 = ty * T, y1 = std::min(y0 + T, dst.h);
+
+                for (int slot = 0; slot < bins.slots; slot++)
+                {
+                    const SplatList& b = bins.bin(slot, tx, ty);
+
+                    for (int i = 0; i < b.size; i++)
+                    {
+                        const Splat& s = b.data[i];
+                        const Vector4f c = premultiply(unpackColor(s.color));
 
-                pp.pixelPos[pp.numPixels] = p + Vector3f(fx, fy, 0.f);
-                pp.pixelColor[pp.numPixels] = img.get(x, y);
-                pp.numPixels++;
+                        for (int y = std::max(s.y - 1, y0); y <= s.y && y < y1; y++)
+                            for (int x = std::max(s.x - 1, x0); x <= s.x && x < x1; x++)
+                            {
+                                uint32* d = pixelAt(dst, x, y);
+                                *d = packColor(c + unpackColor(*d));
+                            }
+                    }
+                }
             }
     }
+
+    // Like splatTiles but adds into an AccumImage; the tile rows are then
+    // composited onto the frame by resolveAccum. Addition commutes, so the
+    // slot order no longer matters and the framebuffer is touched once.
+    static void splatTilesAccum(AccumImage& acc, const PlotBins& bins, int ty0, int ty1)
+    {
+        const int T = PlotBins::tileSize;
+        const bool f32 = acc.format == AccumImage::FLOAT32;
+
+        for (int ty = ty0; ty < ty1; ty++)
+            for (int tx = 0; tx < bins.tilesX; tx++)
+            {
+                const int x0 = tx * T, x1 = std::min(x0 + T, acc.w);
+                const int y0 = ty * T, y1 = std::min(y0 + T, acc.h);
+
+                for (int slot = 0; slot < bins.slots; slot++)
+                {
+                    const SplatList& b = bins.bin(slot, tx, ty);
+
+                    for (int i = 0; i < b.size; i++)
+                    {
+                        const Splat& s = b.data[i];
+                        const __m128 pf = premultiply(unpackColor(s.color)).simd().v;
+                        const __m128i pi = _mm_packs_epi32(_mm_cvttps_epi32(
+                            _mm_add_ps(_mm_mul_ps(pf, _mm_set1_ps(256.f)), _mm_set1_ps(.5f))), _mm_setzero_si128());
+
+                        for (int y = std::max(s.y - 1, y0); y <= s.y && y < y1; y++)
+                            for (int x = std::max(s.x - 1, x0); x <= s.x && x < x1; x++)
+                            {
+                                if (f32)
+                                {
+                                    float* a = acc.row32(y) + x*4;
+                                    _mm_store_ps(a, _mm_add_ps(_mm_load_ps(a), pf));
+                                }
+                                else
+                                {
+                                    __m128i* a = (__m128i*)(acc.row16(y) + x*4);
+                                    _mm_storel_epi64(a, _mm_adds_epu16(_mm_loadl_epi64(a), pi));
+                                }
+                            }
+                    }
+                }
+            }
+    }
+
+    //
+    // Point generators. The fill functions write points [begin, end) of a
+    // range reserved with PlotPixels::alloc and may run concurrently on
+    // disjoint parts of it.
+    //
+
+    // n points on a sphere, stratified in u and Halton base 2 in v.
+    static void fillSphere(PlotPixels& pp, int first, const Vector3f& p, float r, int n, int begin, int end)
+    {
+        typedef floatx8 F;
+        typedef intx8 I;
+        const int w = F::width;
+
+        for (int i = begin; i < end; i += w)
+        {
+            // Indices stay integers; as floats they would stop being exact
+            // past 2^24 points.
+            I k = ramp(i, I());
+            F u = (to_float(k) + F(.5f)) / F(float(n));
+            F v = radical_inverse2(k + I(2));
+
+            Vector3x<F> q = point_on_sphere_approx(u, v) * F(r) + Vector3x<F>(p);
+
+            const int o = first + i;
+            if (i + w <= end)
+            {
+                store3(pp.posX + o, pp.posY + o, pp.posZ + o, q);
+                store((int32*)pp.color + o, I(-1));
+                continue;
+            }
+
+            // The last packet must not spill into a neighbouring range.
+            float x[w], y[w], z[w];
+            store3(x, y, z, q);
+
+            for (int j = 0; j < end - i; j++)
+            {
+                pp.posX[o + j] = x[j];
+                pp.posY[o + j] = y[j];
+                pp.posZ[o + j] = z[j];
+                pp.color[o + j] = 0xffffffff;
+            }
+        }
+    }
+
+    // Rows [y0, y1) of img as a sx by sy rectangle at p, one point per
+    // texel in row-major order.
+    static void fillImage(PlotPixels& pp, int first, const Vector3f& p, const ImageView& img, float sx, float sy, int y0, int y1)
+    {
+        typedef floatx8 F;
+        const int w = F::width;
+
+        for (int y = y0; y < y1; y++)
+        {
+            const int row = first + y*img.w;
+            const float fy = p.y + sy * float(y) / float(img.h);
+
+            int x = 0;
+            for (; x + w <= img.w; x += w)
+            {
+                store(pp.posX + row + x, F(p.x) + F(sx) * ramp(float(x), F()) / F(float(img.w)));
+                store(pp.posY + row + x, F(fy));
+                store(pp.posZ + row + x, F(p.z));
+            }
+
+            for (; x < img.w; x++)
+            {
+                pp.posX[row + x] = p.x + sx * float(x) / float(img.w);
+                pp.posY[row + x] = fy;
+                pp.posZ[row + x] = p.z;
+            }
+
+            memcpy(pp.color + row, img.row(y), img.w * sizeof(uint32));
+        }
+    }
+
+    static void generateSphere(PlotPixels& pp, const Vector3f& p, float r, int n)
+    {
+        fillSphere(pp, pp.alloc(n), p, r, n, 0, n);
+    }
+
+    static void plotImage(PlotPixels& pp, const Vector3f& p, const ImageView& img, float sx, float sy)
+    {
+        fillImage(pp, pp.alloc(img.w * img.h), p, img, sx, sy, 0, img.h);
+    }
 }
@@ -0,0 +1,331 @@
+#include "pointfile.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace kd;
+
+//
+// Converts PLY (ascii or binary little-endian) and XYZ text point clouds
+// to point files:
+//
+//   pointconv input.ply|input.xyz output.kdp
+//
+// XYZ lines are "x y z [r g b [a]]" with colours in 0..255. PLY vertices
+// use the x, y, z, red, green, blue and alpha properties; other
+// properties and elements are skipped.
+//
+
+struct Points
+{
+    std::vector<Vector3f> pos;
+    std::vector<uint32> color;
+};
+
+static uint32 packRGBA(int r, int g, int b, int a)
+{
+    r = std::max(0, std::min(255, r));
+    g = std::max(0, std::min(255, g));
+    b = std::max(0, std::min(255, b));
+    a = std::max(0, std::min(255, a));
+    return r | (g<<8) | (b<<16) | (a<<24);
+}
+
+static bool readXYZ(Points& pts, FILE* fp)
+{
+    char line[1024];
+    while (fgets(line, sizeof(line), fp))
+    {
+        float x, y, z;
+        int r = 255, g = 255, b = 255, a = 255;
+
+        int n = sscanf(line, "%f %f %f %d %d %d %d", &x, &y, &z, &r, &g, &b, &a);
+        if (n <= 0 || line[0] == '#')
+            continue;
+        if (n < 3)
+        {
+            fprintf(stderr, "bad xyz line: %s", line);
+            return false;
+        }
+
+        pts.pos.push_back(Vector3f(x, y, z));
+        pts.color.push_back(packRGBA(r, g, b, a));
+    }
+    return true;
+}
+
+//
+// PLY.
+//
+
+struct PlyProperty
+{
+    std::string name;
+    int type;       // index into plyTypes
+    bool list;
+};
+
+struct PlyElement
+{
+    std::string name;
+    long count;
+    std::vector<PlyProperty> props;
+};
+
+static const struct { const char* name; const char* alias; int size; } plyTypes[] =
+{
+    { "char",   "int8",    1 },
+    { "uchar",  "uint8",   1 },
+    { "short",  "int16",   2 },
+    { "ushort", "uint16",  2 },
+    { "int",    "int32",   4 },
+    { "uint",   "uint32",  4 },
+    { "float",  "float32", 4 },
+    { "double", "float64", 8 },
+};
+
+static int plyType(const char* s)
+{
+    for (int i = 0; i < int(sizeof(plyTypes) / sizeof(plyTypes[0])); i++)
+        if (strcmp(s, plyTypes[i].name) == 0 || strcmp(s, plyTypes[i].alias) == 0)
+            return i;
+    return -1;
+}
+
+static double plyDecode(const uint8* p, int type)
+{
+    switch (type)
+    {
+    case 0: { int8 v; memcpy(&v, p, 1); return v; }
+    case 1: { uint8 v; memcpy(&v, p, 1); return v; }
+    case 2: { int16 v; memcpy(&v, p, 2); return v; }
+    case 3: { uint16 v; memcpy(&v, p, 2); return v; }
+    case 4: { int32 v; memcpy(&v, p, 4); return v; }
+    case 5: { uint32 v; memcpy(&v, p, 4); return v; }
+    case 6: { float v; memcpy(&v, p, 4); return v; }
+    default: { double v; memcpy(&v, p, 8); return v; }
+    }
+}
+
+// Colour channel to 0..255; float channels are taken as 0..1.
+static int plyColor(double v, int type)
+{
+    if (type >= 6)
+        return int(v * 255.0 + .5);
+    if (type == 3)
+        return int(v) >> 8;
+    return int(v);
+}
+
+static bool readPLY(Points& pts, FILE* fp)
+{
+    char line[1024];
+    bool binary = false;
+    std::vector<PlyElement> elements;
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "ply", 3) != 0)
+    {
+        fprintf(stderr, "not a ply file\n");
+        return false;
+    }
+
+    for (;;)
+    {
+        if (!fgets(line, sizeof(line), fp))
+        {
+            fprintf(stderr, "truncated ply header\n");
+            return false;
+        }
+
+        char a[256], b[256], c[256];
+        int n = sscanf(line, "%255s %255s %255s", a, b, c);
+        if (n <= 0)
+            continue;
+
+        if (strcmp(a, "end_header") == 0)
+            break;
+
+        if (strcmp(a, "format") == 0 && n >= 2)
+        {
+            if (strcmp(b, "ascii") == 0)
+                binary = false;
+            else if (strcmp(b, "binary_little_endian") == 0)
+                binary = true;
+            else
+            {
+                fprintf(stderr, "unsupported ply format %s\n", b);
+                return false;
+            }
+        }
+        else if (strcmp(a, "element") == 0 && n >= 3)
+        {
+            PlyElement e;
+            e.name = b;
+            e.count = atol(c);
+            elements.push_back(e);
+        }
+        else if (strcmp(a, "property") == 0 && n >= 3 && !elements.empty())
+        {
+            PlyProperty p;
+            p.list = strcmp(b, "list") == 0;
+            p.type = plyType(p.list ? c : b);
+            if (p.list)
+            {
+                // property list <count type> <item type> <name>
+                char t[256], nm[256];
+                if (sscanf(line, "%*s %*s %*s %255s %255s", t, nm) != 2)
+                {
+                    fprintf(stderr, "bad ply property: %s", line);
+                    return false;
+                }
+                p.name = nm;
+            }
+            else
+                p.name = c;
+
+            if (p.type < 0)
+            {
+                fprintf(stderr, "unknown ply type: %s", line);
+                return false;
+            }
+            elements.back().props.push_back(p);
+        }
+    }
+
+    for (size_t ei = 0; ei < elements.size(); ei++)
+    {
+        const PlyElement& e = elements[ei];
+        const bool vertex = e.name == "vertex";
+
+        int idx[7] = { -1, -1, -1, -1, -1, -1, -1 };
+        static const char* names[7] = { "x", "y", "z", "red", "green", "blue", "alpha" };
+        bool hasList = false;
+        int stride = 0;
+        for (size_t i = 0; i < e.props.size(); i++)
+        {
+            for (int k = 0; k < 7; k++)
+                if (e.props[i].name == names[k])
+                    idx[k] = int(i);
+            hasList |= e.props[i].list;
+            stride += plyTypes[e.props[i].type].size;
+        }
+
+        if (!vertex)
+        {
+            // Everything after the vertices can be ignored, anything
+            // before them has to be skipped.
+            if (!binary)
+            {
+                for (long i = 0; i < e.count; i++)
+                    if (!fgets(line, sizeof(line), fp))
+                        return false;
+                continue;
+            }
+            if (hasList)
+            {
+                fprintf(stderr, "can't skip binary ply element %s with lists\n", e.name.c_str());
+                return false;
+            }
+            fseek(fp, long(stride) * e.count, SEEK_CUR);
+            continue;
+        }
+
+        if (idx[0] < 0 || idx[1] < 0 || idx[2] < 0 || hasList)
+        {
+            fprintf(stderr, "ply vertices need x, y, z and no lists\n");
+            return false;
+        }
+
+        pts.pos.reserve(e.count);
+        pts.color.reserve(e.count);
+
+        std::vector<uint8> rec(stride);
+        std::vector<double> v(e.props.size());
+
+        for (long i = 0; i < e.count; i++)
+        {
+            if (binary)
+            {
+                if (fread(&rec[0], 1, stride, fp) != size_t(stride))
+                {
+                    fprintf(stderr, "truncated ply data\n");
+                    return false;
+                }
+                const uint8* p = &rec[0];
+                for (size_t k = 0; k < e.props.size(); k++)
+                {
+                    v[k] = plyDecode(p, e.props[k].type);
+                    p += plyTypes[e.props[k].type].size;
+                }
+            }
+            else
+            {
+                for (size_t k = 0; k < e.props.size(); k++)
+                    if (fscanf(fp, "%lf", &v[k]) != 1)
+                    {
+                        fprintf(stderr, "truncated ply data\n");
+                        return false;
+                    }
+            }
+
+            int c[4] = { 255, 255, 255, 255 };
+            for (int k = 0; k < 4; k++)
+                if (idx[3+k] >= 0)
+                    c[k] = plyColor(v[idx[3+k]], e.props[idx[3+k]].type);
+
+            pts.pos.push_back(Vector3f(float(v[idx[0]]), float(v[idx[1]]), float(v[idx[2]])));
+            pts.color.push_back(packRGBA(c[0], c[1], c[2], c[3]));
+        }
+
+        return true;
+    }
+
+    fprintf(stderr, "ply file has no vertices\n");
+    return false;
+}
+
+static bool endsWith(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s input.ply|input.xyz output.kdp\n", argv[0]);
+        return 1;
+    }
+
+    const std::string in = argv[1];
+    FILE* fp = fopen(in.c_str(), "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "can't open %s\n", in.c_str());
+        return 1;
+    }
+
+    Points pts;
+    bool ok = endsWith(in, ".ply") || endsWith(in, ".PLY") ? readPLY(pts, fp) : readXYZ(pts, fp);
+    fclose(fp);
+
+    if (!ok)
+        return 1;
+
+    PlotPixels pp;
+    pp.create(int(pts.pos.size()));
+    for (size_t i = 0; i < pts.pos.size(); i++)
+        pp.add(pts.pos[i], pts.color[i]);
+
+    pp.quantize();
+
+    if (!savePoints(argv[2], pp))
+        return 1;
+
+    printf("%s: %d points, %d chunks, %d nodes\n", argv[2], pp.numPixels, (int)pp.chunks.size(), (int)pp.nodes.size());
+    return 0;
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "plotpixels.hpp"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace kd
+{
+    //
+    // Point files hold a built and quantized PlotPixels exactly as it sits
+    // in memory, so loading maps the file and points the arrays into it.
+    // Only the header and the chunk and node tables are read at startup;
+    // point data is paged in by the kernel as chunks are first drawn (or
+    // ahead of that by prefetchPoints). Little-endian only.
+    //
+    //   header | chunks | nodes | quantX | quantY | quantZ | color
+    //
+    // Each array starts on a 64 byte boundary and is followed by
+    // floatx8::width elements of padding for packet loads.
+    //
+
+    struct PointFileHeader
+    {
+        char magic[4];          // "KDPC"
+        uint32 version;
+        uint32 numPixels;
+        uint32 numChunks;
+        uint32 numNodes;
+        uint32 reserved;
+        uint64 chunks;          // offsets from the start of the file
+        uint64 nodes;
+        uint64 quantX;
+        uint64 quantY;
+        uint64 quantZ;
+        uint64 color;
+        uint64 size;
+    };
+
+    struct PointFileChunk
+    {
+        int32 begin, end;
+        float bounds[6];
+        float origin[3];
+        float scale[3];
+    };
+
+    struct PointFileNode
+    {
+        float bounds[6];
+        int32 firstChunk, endChunk;
+        int32 next;
+        int32 leaf;
+    };
+
+    static const uint32 pointFileVersion = 1;
+
+    static inline uint64 pointFileAlign(uint64 offset)
+    {
+        return (offset + 63) & ~uint64(63);
+    }
+
+    static void pointFileLayout(PointFileHeader& h, uint32 numPixels, uint32 numChunks, uint32 numNodes)
+    {
+        const uint64 padded = uint64(numPixels) + floatx8::width;
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "KDPC", 4);
+        h.version = pointFileVersion;
+        h.numPixels = numPixels;
+        h.numChunks = numChunks;
+        h.numNodes = numNodes;
+        h.chunks = pointFileAlign(sizeof(PointFileHeader));
+        h.nodes = pointFileAlign(h.chunks + numChunks * sizeof(PointFileChunk));
+        h.quantX = pointFileAlign(h.nodes + numNodes * sizeof(PointFileNode));
+        h.quantY = pointFileAlign(h.quantX + padded * sizeof(int16));
+        h.quantZ = pointFileAlign(h.quantY + padded * sizeof(int16));
+        h.color = pointFileAlign(h.quantZ + padded * sizeof(int16));
+        h.size = h.color + padded * sizeof(uint32);
+    }
+
+    static void writeAt(FILE* fp, uint64 offset, const void* data, size_t size)
+    {
+        static const char zeros[64] = { 0 };
+
+        // Zero fill up to the aligned offset.
+        long pos = ftell(fp);
+        while (uint64(pos) < offset)
+        {
+            size_t n = std::min(size_t(offset - pos), sizeof(zeros));
+            fwrite(zeros, 1, n, fp);
+            pos += long(n);
+        }
+
+        fwrite(data, 1, size, fp);
+    }
+
+    // Builds and quantizes pp if needed and writes it to fn.
+    static bool savePoints(const char* fn, PlotPixels& pp)
+    {
+        pp.quantize();
+
+        PointFileHeader h;
+        pointFileLayout(h, pp.numPixels, (uint32)pp.chunks.size(), (uint32)pp.nodes.size());
+
+        FILE* fp = fopen(fn, "wb");
+        if (!fp)
+        {
+            fprintf(stderr, "can't write %s\n", fn);
+            return false;
+        }
+
+        std::vector<PointFileChunk> chunks(pp.chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            const PlotPixels::Chunk& c = pp.chunks[i];
+            chunks[i].begin = c.begin;
+            chunks[i].end = c.end;
+            memcpy(chunks[i].bounds, &c.bounds.min.x, 3 * sizeof(float));
+            memcpy(chunks[i].bounds + 3, &c.bounds.max.x, 3 * sizeof(float));
+            memcpy(chunks[i].origin, &c.origin.x, 3 * sizeof(float));
+            memcpy(chunks[i].scale, &c.scale.x, 3 * sizeof(float));
+        }
+
+        std::vector<PointFileNode> nodes(pp.nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            const PlotPixels::Node& n = pp.nodes[i];
+            memcpy(nodes[i].bounds, &n.bounds.min.x, 3 * sizeof(float));
+            memcpy(nodes[i].bounds + 3, &n.bounds.max.x, 3 * sizeof(float));
+            nodes[i].firstChunk = n.firstChunk;
+            nodes[i].endChunk = n.endChunk;
+            nodes[i].next = n.next;
+            nodes[i].leaf = n.leaf;
+        }
+
+        // The in-memory arrays already carry the packet padding.
+        const size_t padded = size_t(pp.numPixels) + floatx8::width;
+
+        writeAt(fp, 0, &h, sizeof(h));
+        writeAt(fp, h.chunks, chunks.empty() ? 0 : &chunks[0], chunks.size() * sizeof(PointFileChunk));
+        writeAt(fp, h.nodes, nodes.empty() ? 0 : &nodes[0], nodes.size() * sizeof(PointFileNode));
+        writeAt(fp, h.quantX, pp.quantX, padded * sizeof(int16));
+        writeAt(fp, h.quantY, pp.quantY, padded * sizeof(int16));
+        writeAt(fp, h.quantZ, pp.quantZ, padded * sizeof(int16));
+        writeAt(fp, h.color, pp.color, padded * sizeof(uint32));
+
+        bool ok = !ferror(fp);
+        if (fclose(fp) != 0)
+            ok = false;
+        if (!ok)
+            fprintf(stderr, "error writing %s\n", fn);
+        return ok;
+    }
+
+    // Maps fn and makes pp refer to it. pp stays valid until destroy().
+    static bool loadPoints(PlotPixels& pp, const char* fn)
+    {
+        pp.destroy();
+
+        int fd = open(fn, O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "can't open %s\n", fn);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(PointFileHeader))
+        {
+            fprintf(stderr, "%s: not a point file\n", fn);
+            close(fd);
+            return false;
+        }
+
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            fprintf(stderr, "can't map %s\n", fn);
+            return false;
+        }
+
+        const PointFileHeader& h = *(const PointFileHeader*)p;
+        PointFileHeader expect;
+        pointFileLayout(expect, h.numPixels, h.numChunks, h.numNodes);
+
+        if (memcmp(h.magic, "KDPC", 4) != 0 || h.version != pointFileVersion ||
+            memcmp(&h, &expect, sizeof(h)) != 0 || h.size > uint64(st.st_size))
+        {
+            fprintf(stderr, "%s: not a point file or wrong version\n", fn);
+            munmap(p, st.st_size);
+            return false;
+        }
+
+        const char* base = (const char*)p;
+
+        // The tree is walked without checks: chunks must lie within the
+        // pixels, nodes within the chunks, and skips must go forward or
+        // traversal would loop.
+        const PointFileChunk* chunks = (const PointFileChunk*)(base + h.chunks);
+        const PointFileNode* nodes = (const PointFileNode*)(base + h.nodes);
+        bool valid = h.numPixels <= uint32(INT_MAX) && h.numNodes <= uint32(INT_MAX);
+        for (uint32 i = 0; valid && i < h.numChunks; i++)
+            valid = chunks[i].begin >= 0 && chunks[i].begin <= chunks[i].end && uint32(chunks[i].end) <= h.numPixels;
+        for (uint32 i = 0; valid && i < h.numNodes; i++)
+        {
+            const PointFileNode& n = nodes[i];
+            valid = n.firstChunk >= 0 && n.firstChunk <= n.endChunk && uint32(n.endChunk) <= h.numChunks &&
+                    n.next > int32(i) && uint32(n.next) <= h.numNodes;
+        }
+        if (!valid)
+        {
+            fprintf(stderr, "%s: corrupt point file\n", fn);
+            munmap(p, st.st_size);
+            return false;
+        }
+
+        pp.chunks.resize(h.numChunks);
+        for (uint32 i = 0; i < h.numChunks; i++)
+        {
+            const PointFileChunk& c = chunks[i];
+            PlotPixels::Chunk& d = pp.chunks[i];
+            d.begin = c.begin;
+            d.end = c.end;
+            d.bounds = AABBf(Vector3f(c.bounds[0], c.bounds[1], c.bounds[2]), Vector3f(c.bounds[3], c.bounds[4], c.bounds[5]));
+            d.origin = Vector3f(c.origin[0], c.origin[1], c.origin[2]);
+            d.scale = Vector3f(c.scale[0], c.scale[1], c.scale[2]);
+            d.prefetched = 0;
+        }
+
+        pp.nodes.resize(h.numNodes);
+        for (uint32 i = 0; i < h.numNodes; i++)
+        {
+            const PointFileNode& n = nodes[i];
+            PlotPixels::Node& d = pp.nodes[i];
+            d.bounds = AABBf(Vector3f(n.bounds[0], n.bounds[1], n.bounds[2]), Vector3f(n.bounds[3], n.bounds[4], n.bounds[5]));
+            d.firstChunk = n.firstChunk;
+            d.endChunk = n.endChunk;
+            d.next = n.next;
+            d.leaf = n.leaf != 0;
+        }
+
+        // Read-only mapping: the arrays must not be written through pp.
+        pp.quantX = (int16*)(base + h.quantX);
+        pp.quantY = (int16*)(base + h.quantY);
+        pp.quantZ = (int16*)(base + h.quantZ);
+        pp.color = (uint32*)(base + h.color);
+        pp.numPixels = h.numPixels;
+        pp.maxPixels = h.numPixels;
+        pp.mapped = p;
+        pp.mappedSize = st.st_size;
+
+        // Point data is read in draw order, not sequentially.
+        madvise(p, st.st_size, MADV_RANDOM);
+
+        return true;
+    }
+
+    // Asks the kernel to start reading the drawn prefixes of a mapped set,
+    // so page faults overlap with the frame instead of stalling binning.
+    // Each part of a chunk is requested once. Not thread safe: it updates
+    // the chunks' prefetched marks, so callers on several threads need a
+    // lock around it.
+    static void prefetchPoints(PlotPixels& pp, const ChunkDraw* draws, int numDraws)
+    {
+        if (!pp.mapped)
+            return;
+
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+        for (int d = 0; d < numDraws; d++)
+        {
+            PlotPixels::Chunk& c = pp.chunks[draws[d].chunk];
+            if (draws[d].count <= c.prefetched)
+                continue;
+
+            const int begin = c.begin + c.prefetched;
+            const int end = c.begin + draws[d].count;
+            c.prefetched = draws[d].count;
+
+            const void* arrays[4] = { pp.quantX + begin, pp.quantY + begin, pp.quantZ + begin, pp.color + begin };
+            const size_t sizes[4] = { (end - begin) * sizeof(int16), (end - begin) * sizeof(int16),
+                                      (end - begin) * sizeof(int16), (end - begin) * sizeof(uint32) };
+
+            for (int a = 0; a < 4; a++)
+            {
+                uintptr_t p0 = uintptr_t(arrays[a]) & ~(page - 1);
+                uintptr_t p1 = uintptr_t(arrays[a]) + sizes[a];
+                madvise((void*)p0, p1 - p0, MADV_WILLNEED);
+            }
+        }
+    }
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+#include "SDL.h"
+#include "SDL_opengl.h"
+#include "image.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace kd
+{
+    //
+    // Puts the finished frame on the screen. glDrawPixels copies the frame
+    // synchronously and is a slow path on many drivers, so where the GL
+    // allows the frame goes to a texture through pixel buffers instead
+    // and is drawn as a quad covering the window:
+    //
+    //   persistent  one buffer mapped for good, a ring of slots in it,
+    //               each slot reused only after its fence has passed
+    //               (GL 4.4 or ARB_buffer_storage, with ARB_sync)
+    //   pbo         a ring of buffers, each orphaned and mapped per frame
+    //               (GL 2.1 or ARB_pixel_buffer_object)
+    //   drawpixels  glDrawPixels, always there
+    //
+    // Each slot uploads into its own texture, so a frame never waits for
+    // the draw of the one before. init() takes the best of these up to the
+    // one asked for, after the GL context exists. Matrices are assumed to
+    // be identity, as they are everywhere in the demo.
+    //
+    // Auto is persistent on hardware. Software GLs have no transfer to
+    // overlap, so the quad is just another pass and what counts is the
+    // copy. llvmpipe on one core, frames back to back (bench present):
+    //
+    //                256x256   1280x720   1920x1080
+    //   drawpixels    1.8 ms     6.7 ms     15.2 ms
+    //   pbo           3.8 ms     6.2 ms      8.2 ms
+    //   persistent    7.2 ms    10.7 ms     14.6 ms
+    //
+    // 1280x720 is about even from run to run. There auto is drawpixels
+    // for frames smaller than 1920x1080 and pbo from that size up, picked
+    // by put() as the frame size changes.
+    //
+
+    enum PresentMode
+    {
+        PRESENT_DRAW_PIXELS,
+        PRESENT_PBO,
+        PRESENT_PERSISTENT,
+        PRESENT_AUTO,
+    };
+
+    static const char* presentModeName(PresentMode m)
+    {
+        static const char* names[] = { "drawpixels", "pbo", "persistent", "auto" };
+        return names[m];
+    }
+
+    static bool parsePresentMode(const char* s, PresentMode& m)
+    {
+        if (strcmp(s, "auto") == 0)
+            m = PRESENT_AUTO;
+        else if (strcmp(s, "drawpixels") == 0)
+            m = PRESENT_DRAW_PIXELS;
+        else if (strcmp(s, "pbo") == 0)
+            m = PRESENT_PBO;
+        else if (strcmp(s, "persistent") == 0)
+            m = PRESENT_PERSISTENT;
+        else
+            return false;
+        return true;
+    }
+
+    //
+    // Entry points past GL 1.1, from SDL_GL_GetProcAddress. SDL's glext.h
+    // predates some of them, so the types and enums are our own; GLsync
+    // is passed as void*.
+    //
+
+    static const GLenum kdGL_PIXEL_UNPACK_BUFFER = 0x88ec;
+    static const GLenum kdGL_STREAM_DRAW = 0x88e0;
+    static const GLenum kdGL_WRITE_ONLY = 0x88b9;
+    static const GLenum kdGL_CLAMP_TO_EDGE = 0x812f;
+    static const GLbitfield kdGL_MAP_WRITE_BIT = 0x0002;
+    static const GLbitfield kdGL_MAP_PERSISTENT_BIT = 0x0040;
+    static const GLbitfield kdGL_MAP_COHERENT_BIT = 0x0080;
+    static const GLenum kdGL_SYNC_GPU_COMMANDS_COMPLETE = 0x9117;
+    static const GLbitfield kdGL_SYNC_FLUSH_COMMANDS_BIT = 0x0001;
+    static const GLenum kdGL_TIMEOUT_EXPIRED = 0x911b;
+    static const GLenum kdGL_WAIT_FAILED = 0x911d;
+
+    struct GLBufferFunctions
+    {
+        void (APIENTRY* genBuffers)(GLsizei n, GLuint* buffers);
+        void (APIENTRY* deleteBuffers)(GLsizei n, const GLuint* buffers);
+        void (APIENTRY* bindBuffer)(GLenum target, GLuint buffer);
+        void (APIENTRY* bufferData)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+        void* (APIENTRY* mapBuffer)(GLenum target, GLenum access);
+        GLboolean (APIENTRY* unmapBuffer)(GLenum target);
+
+        // Persistent mapping.
+        void (APIENTRY* bufferStorage)(GLenum target, ptrdiff_t size, const void* data, GLbitfield flags);
+        void* (APIENTRY* mapBufferRange)(GLenum target, ptrdiff_t offset, ptrdiff_t length, GLbitfield access);
+        void* (APIENTRY* fenceSync)(GLenum condition, GLbitfield flags);
+        GLenum (APIENTRY* clientWaitSync)(void* sync, GLbitfield flags, uint64_t timeout);
+        void (APIENTRY* deleteSync)(void* sync);
+    };
+
+    // True if the space separated list has the name as a whole word.
+    static bool hasGLExtension(const char* list, const char* name)
+    {
+        const size_t n = strlen(name);
+        for (const char* p = list; p && (p = strstr(p, name)); p += n)
+        {
+            if ((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0))
+                return true;
+        }
+        return false;
+    }
+
+    template<typename T>
+    static bool getGLProc(T& f, const char* name)
+    {
+        f = (T)SDL_GL_GetProcAddress(name);
+        return f != 0;
+    }
+
+    class Presenter
+    {
+    public:
+        static const int ringSize = 3;      // frames
+        static const int autoPboPixels = 1920 * 1080;
+
+        Presenter() : mode(PRESENT_DRAW_PIXELS), bySize(false), texW(0), texH(0), slotBytes(0), mapped(0), next(0)
+        {
+            memset(&gl, 0, sizeof(gl));
+            memset(textures, 0, sizeof(textures));
+            memset(buffers, 0, sizeof(buffers));
+            memset(fences, 0, sizeof(fences));
+        }
+
+        // Returns the mode that was taken.
+        PresentMode init(PresentMode wanted)
+        {
+            shutdown();
+
+            int major = 0, minor = 0;
+            const char* version = (const char*)glGetString(GL_VERSION);
+            if (version)
+                sscanf(version, "%d.%d", &major, &minor);
+            const int v = major * 10 + minor;
+            const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+
+            // Textures of any size and buffers to unpack from.
+            const bool pbo = (v >= 21 || (hasGLExtension(ext, "GL_ARB_pixel_buffer_object") &&
+                                          hasGLExtension(ext, "GL_ARB_texture_non_power_of_two"))) &&
+                getGLProc(gl.genBuffers, "glGenBuffers") &&
+                getGLProc(gl.deleteBuffers, "glDeleteBuffers") &&
+                getGLProc(gl.bindBuffer, "glBindBuffer") &&
+                getGLProc(gl.bufferData, "glBufferData") &&
+                getGLProc(gl.mapBuffer, "glMapBuffer") &&
+                getGLProc(gl.unmapBuffer, "glUnmapBuffer");
+
+            const bool persistent = pbo &&
+                (v >= 44 || hasGLExtension(ext, "GL_ARB_buffer_storage")) &&
+                (v >= 32 || hasGLExtension(ext, "GL_ARB_sync")) &&
+                (v >= 30 || hasGLExtension(ext, "GL_ARB_map_buffer_range")) &&
+                getGLProc(gl.bufferStorage, "glBufferStorage") &&
+                getGLProc(gl.mapBufferRange, "glMapBufferRange") &&
+                getGLProc(gl.fenceSync, "glFenceSync") &&
+                getGLProc(gl.clientWaitSync, "glClientWaitSync") &&
+                getGLProc(gl.deleteSync, "glDeleteSync");
+
+            mode = wanted;
+            bySize = false;
+            if (mode == PRESENT_AUTO)
+            {
+                const char* renderer = (const char*)glGetString(GL_RENDERER);
+                const bool software = renderer && (strstr(renderer, "llvmpipe") || strstr(renderer, "softpipe") ||
+                                                   strstr(renderer, "Software Rasterizer"));
+                mode = software ? PRESENT_DRAW_PIXELS : PRESENT_PERSISTENT;
+                bySize = software && pbo;
+            }
+            if (mode == PRESENT_PERSISTENT && !persistent)
+                mode = PRESENT_PBO;
+            if (mode == PRESENT_PBO && !pbo)
+                mode = PRESENT_DRAW_PIXELS;
+            return mode;
+        }
+
+        PresentMode getMode() const { return mode; }
+
+        void put(const Image& img, int screenW, int screenH)
+        {
+            if (bySize)
+            {
+                const PresentMode m = img.w * img.h >= autoPboPixels ? PRESENT_PBO : PRESENT_DRAW_PIXELS;
+                if (m != mode)
+                {
+                    shutdown();
+                    mode = m;
+                }
+            }
+
+            if (mode != PRESENT_DRAW_PIXELS && !upload(img))
+            {
+                // A map failed: out of memory or a broken driver, either
+                // way the plain path still works.
+                fprintf(stderr, "present: %s failed, using drawpixels\n", presentModeName(mode));
+                shutdown();
+                mode = PRESENT_DRAW_PIXELS;
+                bySize = false;
+            }
+
+            if (mode == PRESENT_DRAW_PIXELS)
+            {
+                glPixelZoom(screenW / float(img.w), screenH / float(img.h));
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, img.stride);
+                glDrawPixels(img.w, img.h, GL_RGBA, GL_UNSIGNED_BYTE, img.data);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                return;
+            }
+
+            // Images are bottom row first, as is the texture.
+            glBindTexture(GL_TEXTURE_2D, textures[(next + ringSize - 1) % ringSize]);
+            glEnable(GL_TEXTURE_2D);
+            glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+            glBegin(GL_QUADS);
+            glTexCoord2f(0.f, 0.f); glVertex2f(-1.f, -1.f);
+            glTexCoord2f(1.f, 0.f); glVertex2f( 1.f, -1.f);
+            glTexCoord2f(1.f, 1.f); glVertex2f( 1.f,  1.f);
+            glTexCoord2f(0.f, 1.f); glVertex2f(-1.f,  1.f);
+            glEnd();
+            glDisable(GL_TEXTURE_2D);
+            glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        // Releases the GL objects; the mode stays.
+        void shutdown()
+        {
+            for (int i = 0; i < ringSize; i++)
+            {
+                if (fences[i])
+                    gl.deleteSync(fences[i]);
+                fences[i] = 0;
+            }
+            if (mapped)
+            {
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, buffers[0]);
+                gl.unmapBuffer(kdGL_PIXEL_UNPACK_BUFFER);
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, 0);
+                mapped = 0;
+            }
+            if (buffers[0])
+                gl.deleteBuffers(ringSize, buffers);
+            memset(buffers, 0, sizeof(buffers));
+            if (textures[0])
+                glDeleteTextures(ringSize, textures);
+            memset(textures, 0, sizeof(textures));
+            texW = texH = 0;
+            slotBytes = 0;
+        }
+
+    private:
+        // (Re)creates the texture and buffers when the frame size changes.
+        bool allocate(const Image& img)
+        {
+            const size_t bytes = size_t(img.stride) * img.h * 4;
+            if (textures[0] && img.w == texW && img.h == texH && bytes <= slotBytes)
+                return true;
+
+            shutdown();
+            texW = img.w;
+            texH = img.h;
+            slotBytes = (bytes + 255) & ~size_t(255);
+
+            // Nearest filtering, as glPixelZoom did.
+            glGenTextures(ringSize, textures);
+            for (int i = 0; i < ringSize; i++)
+            {
+                glBindTexture(GL_TEXTURE_2D, textures[i]);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, kdGL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, kdGL_CLAMP_TO_EDGE);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, texW, texH, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            }
+            glBindTexture(GL_TEXTURE_2D, 0);
+
+            if (mode == PRESENT_PERSISTENT)
+            {
+                const GLbitfield flags = kdGL_MAP_WRITE_BIT | kdGL_MAP_PERSISTENT_BIT | kdGL_MAP_COHERENT_BIT;
+                gl.genBuffers(1, buffers);
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, buffers[0]);
+                gl.bufferStorage(kdGL_PIXEL_UNPACK_BUFFER, slotBytes * ringSize, 0, flags);
+                mapped = (uint8*)gl.mapBufferRange(kdGL_PIXEL_UNPACK_BUFFER, 0, slotBytes * ringSize, flags);
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, 0);
+                return mapped != 0;
+            }
+
+            gl.genBuffers(ringSize, buffers);
+            return true;
+        }
+
+        bool upload(const Image& img)
+        {
+            if (!allocate(img))
+                return false;
+
+            const int slot = next;
+            next = (next + 1) % ringSize;
+            const size_t bytes = size_t(img.stride) * img.h * 4;
+            size_t offset = 0;
+
+            if (mode == PRESENT_PERSISTENT)
+            {
+                // The GPU has long been done with a slot three frames old,
+                // so this hardly ever waits.
+                if (fences[slot])
+                {
+                    GLenum r;
+                    do
+                        r = gl.clientWaitSync(fences[slot], kdGL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+                    while (r == kdGL_TIMEOUT_EXPIRED);
+                    gl.deleteSync(fences[slot]);
+                    fences[slot] = 0;
+                    if (r == kdGL_WAIT_FAILED)
+                        return false;
+                }
+
+                offset = slotBytes * slot;
+                memcpy(mapped + offset, img.data, bytes);
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, buffers[0]);
+            }
+            else
+            {
+                // Orphaning gives the driver a fresh block when the old
+                // one is still being read, instead of waiting for it.
+                gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, buffers[slot]);
+                gl.bufferData(kdGL_PIXEL_UNPACK_BUFFER, slotBytes, 0, kdGL_STREAM_DRAW);
+                void* p = gl.mapBuffer(kdGL_PIXEL_UNPACK_BUFFER, kdGL_WRITE_ONLY);
+                if (!p)
+                {
+                    gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, 0);
+                    return false;
+                }
+                memcpy(p, img.data, bytes);
+                gl.unmapBuffer(kdGL_PIXEL_UNPACK_BUFFER);
+            }
+
+            glBindTexture(GL_TEXTURE_2D, textures[slot]);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, img.stride);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img.w, img.h, GL_RGBA, GL_UNSIGNED_BYTE, (const void*)offset);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            gl.bindBuffer(kdGL_PIXEL_UNPACK_BUFFER, 0);
+
+            if (mode == PRESENT_PERSISTENT)
+                fences[slot] = gl.fenceSync(kdGL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            return true;
+        }
+
+        PresentMode mode;
+        bool bySize;                    // auto on a software GL
+        GLBufferFunctions gl;
+        GLuint textures[ringSize];
+        int texW, texH;
+        size_t slotBytes;
+        GLuint buffers[ringSize];       // persistent uses only the first
+        void* fences[ringSize];
+        uint8* mapped;
+        int next;                       // slot
+
+        Presenter(const Presenter&);
+        Presenter& operator=(const Presenter&);
+    };
+}
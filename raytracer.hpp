@@ -1,6 +1,8 @@
 #pragma once
 
 #include "math.hpp"
+#include "image.hpp"
+#include "camera.hpp"
 
 namespace kd
 {
@@ -89,67 +91,142 @@ namespace kd
         return o.y / -d.y;
     }
 
-    static void raytraceSub(RayTracer& rt, int sx, int sy, int sw, int sh)
+    // Pixel (x, y) of dst, which is a view of rt.image.
+    static void raytracePixel(const RayTracer& rt, const ImageView& dst, int x, int y)
     {
-        for (int y = sy; y < sy+sh; y++)
-            for (int x = sx; x < sx+sw; x++)
-            {
-                Vector3f o, d;
-                getRayForPixel(rt, x, y, o, d);
+        Vector3f o, d;
+        getRayForPixel(rt, dst.x + x, dst.y + y, o, d);
 
-                float tp = intersectPlane(o, d);
+        float tp = intersectPlane(o, d);
 
-                float tc1, tc2;
+        float tc1, tc2;
 
-                if (intersectCylinder(o, d, tc1, tc2) && tc2 > 0.f)
-                {
-                    if (tp > 0.f && tp < tc1)
-                        goto plop;
+        if (intersectCylinder(o, d, tc1, tc2) && tc2 > 0.f)
+        {
+            if (tp > 0.f && tp < tc1)
+                goto plop;
 
-                    float t = tc2;
+            float t = tc2;
 
-                    Vector3f p = o + d * t;
+            Vector3f p = o + d * t;
 
-                    if (p.y > 0.f)
-                        goto plop;
+            if (p.y > 0.f)
+                goto plop;
 
-                    int xx = int(p.x * 5.f);
-                    int yy = int(p.y * 5.f);
+            int xx = int(p.x * 5.f);
+            int yy = int(p.y * 5.f);
 
-                    Vector4f c;
+            Vector4f c;
 
-                    c.x = ((xx ^ yy) & 255) * (1.f / 255.f);
-                    c.y = ((xx ^ yy) & 127) * (1.f / 127.f);
-                    c.z = ((xx ^ yy) & 63) * (1.f / 63.f);
-                    c.w = 1.f;
+            c.x = ((xx ^ yy) & 255) * (1.f / 255.f);
+            c.y = ((xx ^ yy) & 127) * (1.f / 127.f);
+            c.z = ((xx ^ yy) & 63) * (1.f / 63.f);
+            c.w = 1.f;
 
-                    rt.image->put(x, y, c);
+            dst.put(x, y, c);
 
-                    continue;
-                }
+            return;
+        }
 
 plop:;
-                if (tp > 0.f)
-                {
-                    Vector3f p = o + d * tp;
+        if (tp > 0.f)
+        {
+            Vector3f p = o + d * tp;
 
-                    int xx = int(p.x * 5.f);
-                    int yy = int(p.z * 5.f);
+            int xx = int(p.x * 5.f);
+            int yy = int(p.z * 5.f);
 
-                    Vector4f c;
+            Vector4f c;
 
-                    c.x = ((xx ^ yy) & 255) * (1.f / 255.f);
-                    c.y = ((xx ^ yy) & 127) * (1.f / 127.f);
-                    c.z = ((xx ^ yy) & 63) * (1.f / 63.f);
-                    c.w = 1.f;
+            c.x = ((xx ^ yy) & 255) * (1.f / 255.f);
+            c.y = ((xx ^ yy) & 127) * (1.f / 127.f);
+            c.z = ((xx ^ yy) & 63) * (1.f / 63.f);
+            c.w = 1.f;
 
-                    rt.image->put(x, y, c);
-                }
-                else
-                {
-                    rt.image->put(x, y, Vector4f(0.1f, 0.2f, 0.8f, 1.f));
-                    rt.image->put(x, y, Vector4f((d+Vector3f(1.f, 1.f, 1.f))*.5f, 1.f));
-                }
-            }
+            dst.put(x, y, c);
+        }
+        else
+        {
+            dst.put(x, y, Vector4f(0.1f, 0.2f, 0.8f, 1.f));
+            dst.put(x, y, Vector4f((d+Vector3f(1.f, 1.f, 1.f))*.5f, 1.f));
+        }
+    }
+
+    // Same as raytracePixel for F::width pixels starting at x.
+    template<typename F>
+    static void raytracePacket(const RayTracer& rt, const ImageView& dst, int x, int y)
+    {
+        typedef typename simd_traits<F>::int_type I;
+
+        const F zero(0.f);
+        const F ones = as_float(I(-1));
+
+        const int w = rt.image->w;
+        const int h = rt.image->h;
+        const int ax = dst.x + x;
+        const int ay = dst.y + y;
+        const int p = ay * w + ax;
+
+        F fx = (ramp(float(ax), F()) + F(.5f)) / F(float(w)) * F(2.f) - F(1.f);
+        F fy((ay + .5f) / float(h) * 2.f - 1.f);
+
+        Vector4x<F> e2 = rt.camera.clipToView * Vector4x<F>(fx, fy, F(1.f), F(1.f));
+
+        Vector3x<F> o(rt.camera.position);
+        Vector3x<F> d = (e2.xyz() * load(rt.invW + p, F()) - o) * load(rt.invRayLen + p, F());
+
+        F tp = o.y / -d.y;
+
+        // intersectCylinder
+        F l = d.x * d.x + d.z * d.z;
+        F a = d.z * o.x - d.x * o.z;
+        F det = -(a * a) + l * F(64.f);
+        F hitC = (det < zero) ^ ones;
+        det = sqrt(max(det, zero));
+        l = F(1.f) / l;
+        F b = -d.x * o.x - d.z * o.z;
+        F tc1 = (b - det) * l;
+        F tc2 = (b + det) * l;
+
+        Vector3x<F> pc = o + d * tc2;
+        Vector3x<F> pp = o + d * tp;
+
+        F planeInFront = (tp > zero) & (tp < tc1);
+        F cyl = hitC & (tc2 > zero) & ((planeInFront | (pc.y > zero)) ^ ones);
+
+        F u = select(cyl, pc.x, pp.x);
+        F v = select(cyl, pc.y, pp.z);
+        I k = to_int(u * F(5.f)) ^ to_int(v * F(5.f));
+
+        Vector4x<F> checker(
+            to_float(k & I(255)) * F(1.f / 255.f),
+            to_float(k & I(127)) * F(1.f / 127.f),
+            to_float(k & I(63)) * F(1.f / 63.f),
+            F(1.f));
+
+        Vector4x<F> sky(
+            (d.x + F(1.f)) * F(.5f),
+            (d.y + F(1.f)) * F(.5f),
+            (d.z + F(1.f)) * F(.5f),
+            F(1.f));
+
+        Vector4x<F> c = select(cyl | (tp > zero), checker, sky);
+
+        store((int32*)dst.row(y) + x, packColor(c));
+    }
+
+    // Traces the pixels of dst, a view of rt.image.
+    static void raytraceSub(RayTracer& rt, const ImageView& dst)
+    {
+        const int n = floatx8::width;
+
+        for (int y = 0; y < dst.h; y++)
+        {
+            int x = 0;
+            for (; x + n <= dst.w; x += n)
+                raytracePacket<floatx8>(rt, dst, x, y);
+            for (; x < dst.w; x++)
+                raytracePixel(rt, dst, x, y);
+        }
     }
 }
@@ -0,0 +1,546 @@
+#include "defs.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace kd;
+
+//
+// Renders a frame range with several headless kakkidemo processes on one
+// machine:
+//
+//   renderfarm --workers 4 --render out.y4m --format y4m --size 7680x4320 --frames 8100
+//
+// The range is cut into pieces of --piece frames. Each worker process
+// renders one piece to its end of a Unix socket pair and the farm spools
+// what arrives to <spool>/<first>.part. A piece whose worker crashes,
+// exits with an error, sends the wrong amount or stays silent for
+// --timeout seconds is rendered again, up to --retries times, so a crash
+// costs one piece instead of the whole render. Pieces are appended to the
+// output in frame order as soon as all earlier ones are in, so the output
+// can be a pipe ("-"). Worker messages go to <spool>/<first>.log, which is
+// kept when the piece fails.
+//
+// PNG frames are written by the workers themselves. Their stdout then
+// carries a line per frame, which is what the timeout watches, and a
+// piece is done once every one of its frame files exists.
+//
+
+struct FarmOptions
+{
+    FarmOptions()
+    :   demo("./kakkidemo"), points(0), output(0), format("png"), spool("renderfarm.parts"),
+        width(1920), height(1080), fps(60), first(0), count(-1),
+        workers(4), threads(0), inFlight(2), pieceFrames(60), retries(3), timeout(600)
+    {
+    }
+
+    const char* demo;
+    const char* points;
+    const char* output;
+    const char* format;     // raw, y4m or png
+    const char* spool;
+    int width, height, fps;
+    int first, count;
+    int workers, threads, inFlight;
+    int pieceFrames, retries, timeout;
+};
+
+enum PieceState
+{
+    PIECE_WAITING,
+    PIECE_RUNNING,
+    PIECE_DONE,
+    PIECE_APPENDED,
+};
+
+struct Piece
+{
+    int first, count;
+    int tries;
+    PieceState state;
+};
+
+struct Worker
+{
+    pid_t pid;
+    int fd;                 // our end of the socket pair
+    int piece;
+    FILE* spool;
+    uint64 received;
+    time_t lastData;
+};
+
+static FarmOptions opt;
+static std::vector<Piece> pieces;
+static std::vector<Worker> workers;
+
+static bool isPng() { return strcmp(opt.format, "png") == 0; }
+static bool isY4m() { return strcmp(opt.format, "y4m") == 0; }
+
+static std::string spoolName(const Piece& p, const char* ext)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/%08d.%s", p.first, ext);
+    return std::string(opt.spool) + buf;
+}
+
+//
+// Workers.
+//
+
+static bool startWorker(int index)
+{
+    Piece& p = pieces[index];
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        perror("socketpair");
+        return false;
+    }
+
+    FILE* spool = 0;
+    if (!isPng())
+    {
+        spool = fopen(spoolName(p, "part").c_str(), "wb");
+        if (!spool)
+        {
+            fprintf(stderr, "can't write %s\n", spoolName(p, "part").c_str());
+            close(sv[0]);
+            close(sv[1]);
+            return false;
+        }
+    }
+
+    char size[32], fps[16], first[16], count[16], inFlight[16], threads[16];
+    snprintf(size, sizeof(size), "%dx%d", opt.width, opt.height);
+    snprintf(fps, sizeof(fps), "%d", opt.fps);
+    snprintf(first, sizeof(first), "%d", p.first);
+    snprintf(count, sizeof(count), "%d", p.count);
+    snprintf(inFlight, sizeof(inFlight), "%d", opt.inFlight);
+    snprintf(threads, sizeof(threads), "%d", opt.threads);
+
+    std::vector<const char*> args;
+    args.push_back(opt.demo);
+    if (opt.points)
+        args.push_back(opt.points);
+    const char* tail[] = {
+        "--render", isPng() ? opt.output : "-", "--format", opt.format, "--size", size,
+        "--fps", fps, "--start", first, "--frames", count, "--in-flight", inFlight,
+        "--threads", threads };
+    args.insert(args.end(), tail, tail + sizeof(tail) / sizeof(tail[0]));
+    args.push_back(0);
+
+    const std::string log = spoolName(p, "log");
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        if (spool)
+            fclose(spool);
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        const int logFd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(sv[1], 1);
+        if (logFd >= 0)
+            dup2(logFd, 2);
+        close(sv[0]);
+        close(sv[1]);
+        execv(opt.demo, (char* const*)&args[0]);
+        fprintf(stderr, "can't run %s: %s\n", opt.demo, strerror(errno));
+        _exit(127);
+    }
+
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+    Worker w;
+    w.pid = pid;
+    w.fd = sv[0];
+    w.piece = index;
+    w.spool = spool;
+    w.received = 0;
+    w.lastData = time(0);
+    workers.push_back(w);
+
+    p.state = PIECE_RUNNING;
+    p.tries++;
+    return true;
+}
+
+// What a worker must send for a piece: the Y4M header comes first in
+// every piece, so only what follows it is counted.
+static bool spoolComplete(const Piece& p)
+{
+    const std::string fn = spoolName(p, "part");
+    FILE* fp = fopen(fn.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    uint64 header = 0;
+    uint64 frameBytes = uint64(opt.width) * opt.height * 4;
+    if (isY4m())
+    {
+        int c;
+        while ((c = fgetc(fp)) != EOF && c != '\n')
+            header++;
+        header++;
+        frameBytes = 6 + 3 * uint64(opt.width) * opt.height;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    const uint64 size = (uint64)ftello(fp);
+    fclose(fp);
+    return size == header + frameBytes * p.count;
+}
+
+// The PNG files of a piece, named by the --render pattern.
+static bool framesWritten(const Piece& p)
+{
+    for (int f = p.first; f < p.first + p.count; f++)
+    {
+        char fn[1024];
+        snprintf(fn, sizeof(fn), opt.output, f);
+        struct stat st;
+        if (stat(fn, &st) != 0 || st.st_size == 0)
+            return false;
+    }
+    return true;
+}
+
+// Returns false when the piece has failed too often to go on.
+static bool finishWorker(size_t wi)
+{
+    Worker w = workers[wi];
+    workers.erase(workers.begin() + wi);
+    Piece& p = pieces[w.piece];
+
+    close(w.fd);
+    bool ok = true;
+    if (w.spool && fclose(w.spool) != 0)
+        ok = false;
+
+    int status = 0;
+    waitpid(w.pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    ok = ok && (isPng() ? framesWritten(p) : spoolComplete(p));
+
+    if (ok)
+    {
+        unlink(spoolName(p, "log").c_str());
+        p.state = PIECE_DONE;
+        return true;
+    }
+
+    if (!isPng())
+        unlink(spoolName(p, "part").c_str());
+
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "\nframes %d-%d: worker killed by signal %d, see %s\n",
+            p.first, p.first + p.count - 1, WTERMSIG(status), spoolName(p, "log").c_str());
+    else
+        fprintf(stderr, "\nframes %d-%d: worker failed or wrote too little, see %s\n",
+            p.first, p.first + p.count - 1, spoolName(p, "log").c_str());
+
+    if (p.tries > opt.retries)
+    {
+        fprintf(stderr, "frames %d-%d: giving up after %d tries\n", p.first, p.first + p.count - 1, p.tries);
+        return false;
+    }
+
+    p.state = PIECE_WAITING;
+    return true;
+}
+
+static void killWorkers()
+{
+    for (size_t i = 0; i < workers.size(); i++)
+        kill(workers[i].pid, SIGKILL);
+    while (!workers.empty())
+    {
+        const Piece& p = pieces[workers.back().piece];
+        close(workers.back().fd);
+        if (workers.back().spool)
+            fclose(workers.back().spool);
+        waitpid(workers.back().pid, 0, 0);
+        if (!isPng())
+            unlink(spoolName(p, "part").c_str());
+        workers.pop_back();
+    }
+}
+
+//
+// Output.
+//
+
+// Appends the piece's spool to out and deletes it; only the first piece
+// keeps its Y4M header.
+static bool appendPiece(FILE* out, const Piece& p, bool first)
+{
+    const std::string fn = spoolName(p, "part");
+    FILE* fp = fopen(fn.c_str(), "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "can't open %s\n", fn.c_str());
+        return false;
+    }
+
+    if (isY4m() && !first)
+    {
+        int c;
+        while ((c = fgetc(fp)) != EOF && c != '\n')
+            ;
+    }
+
+    static char buf[1 << 20];
+    size_t n;
+    bool ok = true;
+    while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        ok = fwrite(buf, 1, n, out) == n;
+    fclose(fp);
+
+    if (!ok)
+    {
+        fprintf(stderr, "error writing %s\n", opt.output);
+        return false;
+    }
+    unlink(fn.c_str());
+    return true;
+}
+
+//
+// Main.
+//
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s --render out --frames n [--format raw|y4m|png] [--size WxH] [--fps n]\n"
+        "       [--start frame] [--workers n] [--threads n] [--in-flight n] [--piece frames]\n"
+        "       [--retries n] [--timeout seconds] [--spool dir] [--demo path] [points.kdp]\n"
+        "out is as for kakkidemo --render; --threads and --in-flight are per worker.\n", name);
+}
+
+static bool parseArgs(int argc, char* argv[])
+{
+    FarmOptions& o = opt;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (a[0] != '-')
+        {
+            o.points = a;
+            continue;
+        }
+        if (!v)
+            return false;
+        i++;
+
+        bool ok = true;
+        if (strcmp(a, "--render") == 0)
+            o.output = v;
+        else if (strcmp(a, "--format") == 0)
+        {
+            o.format = v;
+            ok = strcmp(v, "raw") == 0 || strcmp(v, "y4m") == 0 || strcmp(v, "png") == 0;
+        }
+        else if (strcmp(a, "--size") == 0)
+            ok = sscanf(v, "%dx%d", &o.width, &o.height) == 2 && o.width > 0 && o.height > 0;
+        else if (strcmp(a, "--fps") == 0)
+            ok = (o.fps = atoi(v)) > 0;
+        else if (strcmp(a, "--start") == 0)
+            ok = (o.first = atoi(v)) >= 0;
+        else if (strcmp(a, "--frames") == 0)
+            ok = (o.count = atoi(v)) > 0;
+        else if (strcmp(a, "--workers") == 0)
+            ok = (o.workers = atoi(v)) > 0;
+        else if (strcmp(a, "--threads") == 0)
+            ok = (o.threads = atoi(v)) > 0;
+        else if (strcmp(a, "--in-flight") == 0)
+            ok = (o.inFlight = atoi(v)) > 0;
+        else if (strcmp(a, "--piece") == 0)
+            ok = (o.pieceFrames = atoi(v)) > 0;
+        else if (strcmp(a, "--retries") == 0)
+            ok = (o.retries = atoi(v)) >= 0;
+        else if (strcmp(a, "--timeout") == 0)
+            ok = (o.timeout = atoi(v)) > 0;
+        else if (strcmp(a, "--spool") == 0)
+            o.spool = v;
+        else if (strcmp(a, "--demo") == 0)
+            o.demo = v;
+        else
+            ok = false;
+
+        if (!ok)
+            return false;
+    }
+
+    return o.output && o.count > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (!parseArgs(argc, argv))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The workers share the cores between them.
+    if (!opt.threads)
+        opt.threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN) / opt.workers);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdir(opt.spool, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "can't create %s\n", opt.spool);
+        return 1;
+    }
+
+    FILE* out = 0;
+    if (!isPng())
+    {
+        out = strcmp(opt.output, "-") == 0 ? stdout : fopen(opt.output, "wb");
+        if (!out)
+        {
+            fprintf(stderr, "can't write %s\n", opt.output);
+            return 1;
+        }
+    }
+
+    for (int f = opt.first; f < opt.first + opt.count; f += opt.pieceFrames)
+    {
+        Piece p;
+        p.first = f;
+        p.count = std::min(opt.pieceFrames, opt.first + opt.count - f);
+        p.tries = 0;
+        p.state = PIECE_WAITING;
+        pieces.push_back(p);
+    }
+
+    size_t nextAppend = 0;
+    int framesDone = 0;
+    bool ok = true;
+    static char buf[1 << 20];
+
+    while (ok && nextAppend < pieces.size())
+    {
+        // Lowest pieces first, so the output never waits long.
+        for (size_t i = 0; i < pieces.size() && (int)workers.size() < opt.workers; i++)
+            if (pieces[i].state == PIECE_WAITING && !startWorker((int)i))
+            {
+                ok = false;
+                break;
+            }
+        if (!ok)
+            break;
+
+        std::vector<pollfd> fds(workers.size());
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            fds[i].fd = workers[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (!fds.empty() && poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            ok = false;
+            break;
+        }
+
+        // Backwards, as finished workers are removed.
+        const time_t now = time(0);
+        for (size_t i = workers.size(); ok && i-- > 0;)
+        {
+            Worker& w = workers[i];
+            bool eof = false;
+
+            if (fds[i].revents)
+            {
+                for (;;)
+                {
+                    const ssize_t n = read(w.fd, buf, sizeof(buf));
+                    if (n > 0)
+                    {
+                        if (w.spool && fwrite(buf, 1, n, w.spool) != size_t(n))
+                        {
+                            fprintf(stderr, "error writing %s\n", spoolName(pieces[w.piece], "part").c_str());
+                            ok = false;
+                            break;
+                        }
+                        w.received += n;
+                        w.lastData = now;
+                        continue;
+                    }
+                    eof = n == 0 || (errno != EAGAIN && errno != EINTR);
+                    break;
+                }
+            }
+
+            if (eof)
+            {
+                const int piece = w.piece;
+                if (!finishWorker(i))
+                    ok = false;
+                else if (pieces[piece].state == PIECE_DONE)
+                    framesDone += pieces[piece].count;
+            }
+            else if (now - w.lastData > opt.timeout)
+            {
+                fprintf(stderr, "\nframes %d-%d: no output for %d s\n",
+                    pieces[w.piece].first, pieces[w.piece].first + pieces[w.piece].count - 1, opt.timeout);
+                kill(w.pid, SIGKILL);
+                w.lastData = now;
+            }
+        }
+
+        while (ok && nextAppend < pieces.size() && pieces[nextAppend].state == PIECE_DONE)
+        {
+            if (out && !appendPiece(out, pieces[nextAppend], nextAppend == 0))
+                ok = false;
+            pieces[nextAppend++].state = PIECE_APPENDED;
+        }
+
+        fprintf(stderr, "\r%d / %d frames, %d workers", framesDone, opt.count, (int)workers.size());
+    }
+    fprintf(stderr, "\n");
+
+    killWorkers();
+
+    if (out && out != stdout && fclose(out) != 0)
+        ok = false;
+    else if (out == stdout && fflush(out) != 0)
+        ok = false;
+    if (!ok)
+    {
+        fprintf(stderr, "render failed\n");
+        return 1;
+    }
+
+    rmdir(opt.spool);
+    return 0;
+}
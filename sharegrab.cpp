@@ -0,0 +1,118 @@
+#include "frameshare.hpp"
+#include "framewriter.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace kd;
+
+//
+// Reads the frames kakkidemo --share publishes and writes them out, as an
+// example of a shared memory reader and to check what a compositor would
+// get:
+//
+//   kakkidemo --share /kakkidemo &
+//   sharegrab /kakkidemo out.y4m --format y4m
+//
+// Runs until the demo exits or --frames are written. Behind the writer it
+// takes the newest frame and skips the rest, the way a compositor would;
+// frames overwritten while being encoded are dropped. Both are counted.
+//
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s shm-name out [--format raw|y4m|png] [--fps n] [--frames n]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* shmName = argv[1];
+    const char* output = argv[2];
+    FrameFormat format = FRAME_RAW;
+    int fps = 60;
+    int count = -1;
+
+    for (int i = 3; i < argc; i++)
+    {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[++i] : 0;
+
+        bool ok = v != 0;
+        if (ok && strcmp(a, "--format") == 0)
+            ok = parseFrameFormat(v, format);
+        else if (ok && strcmp(a, "--fps") == 0)
+            ok = (fps = atoi(v)) > 0;
+        else if (ok && strcmp(a, "--frames") == 0)
+            ok = (count = atoi(v)) >= 0;
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The demo may not be up yet.
+    FrameShareReader share;
+    while (!share.open(shmName))
+        usleep(100000);
+
+    FrameWriter writer;
+    if (!writer.open(output, format, share.width(), share.height(), fps))
+        return 1;
+
+    ImageView view;
+    view.w = share.width();
+    view.h = share.height();
+    view.stride = share.stride();
+
+    std::vector<uint8> bytes;
+    uint32 seen = share.published();
+    int written = 0, skipped = 0, torn = 0;
+
+    while (count < 0 || written < count)
+    {
+        const uint32 n = share.wait(seen, 1000);
+        if (n == seen)
+        {
+            if (share.closed())
+                break;
+            continue;
+        }
+
+        const uint32 frame = n - 1;
+        skipped += frame - seen;
+        seen = n;
+
+        const uint32* pixels = share.pixels(frame);
+        if (!pixels)
+        {
+            torn++;
+            continue;
+        }
+
+        // Encoded straight from the shared memory, then checked.
+        view.data = const_cast<uint32*>(pixels);
+        writer.encode(bytes, view);
+        if (!share.valid(frame))
+        {
+            torn++;
+            continue;
+        }
+
+        writer.write(written++, bytes);
+    }
+
+    fprintf(stderr, "%d frames written, %d skipped, %d overwritten while read\n", written, skipped, torn);
+    return writer.close() ? 0 : 1;
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "defs.hpp"
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#include <memory>
+#include <vector>
+
+// The packet types change layout with the target ISA, and kernels are built
+// for several ISAs into one binary (see kernels.hpp). Everything that
+// depends on the instruction set lives in an inline namespace named after
+// it so the per-ISA copies never get merged by the linker.
+#if defined(__AVX512F__)
+#define KD_SIMD_NAMESPACE simd_avx512
+#elif defined(__AVX2__)
+#define KD_SIMD_NAMESPACE simd_avx2
+#elif defined(__AVX__)
+#define KD_SIMD_NAMESPACE simd_avx
+#elif defined(__SSE4_1__)
+#define KD_SIMD_NAMESPACE simd_sse41
+#else
+#define KD_SIMD_NAMESPACE simd_sse2
+#endif
+
+namespace kd
+{
+inline namespace KD_SIMD_NAMESPACE
+{
+    //
+    // Thin wrappers around SSE/AVX registers. Every packet type has the
+    // same free function interface so kernels can be written once as
+    // templates and instantiated for 4 or 8 lanes.
+    //
+
+    //
+    // intx4 / floatx4
+    //
+
+    struct intx4
+    {
+        intx4() {}
+        intx4(__m128i v) : v(v) {}
+        explicit intx4(int32 s) : v(_mm_set1_epi32(s)) {}
+
+        static const int width = 4;
+
+        __m128i v;
+    };
+
+    struct floatx4
+    {
+        floatx4() {}
+        floatx4(__m128 v) : v(v) {}
+        explicit floatx4(float s) : v(_mm_set1_ps(s)) {}
+        floatx4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+        static const int width = 4;
+
+        float operator[](int i) const
+        {
+            kd_assert(i >= 0 && i < 4);
+            // Goes through memory: for setup and debugging code.
+            float t[4];
+            _mm_storeu_ps(t, v);
+            return t[i];
+        }
+
+        __m128 v;
+    };
+
+    inline floatx4 operator+(const floatx4& a, const floatx4& b) { return _mm_add_ps(a.v, b.v); }
+    inline floatx4 operator-(const floatx4& a, const floatx4& b) { return _mm_sub_ps(a.v, b.v); }
+    inline floatx4 operator*(const floatx4& a, const floatx4& b) { return _mm_mul_ps(a.v, b.v); }
+    inline floatx4 operator/(const floatx4& a, const floatx4& b) { return _mm_div_ps(a.v, b.v); }
+    inline floatx4 operator-(const floatx4& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+    inline floatx4 operator&(const floatx4& a, const floatx4& b) { return _mm_and_ps(a.v, b.v); }
+    inline floatx4 operator|(const floatx4& a, const floatx4& b) { return _mm_or_ps(a.v, b.v); }
+    inline floatx4 operator^(const floatx4& a, const floatx4& b) { return _mm_xor_ps(a.v, b.v); }
+    inline floatx4 operator<(const floatx4& a, const floatx4& b) { return _mm_cmplt_ps(a.v, b.v); }
+    inline floatx4 operator<=(const floatx4& a, const floatx4& b) { return _mm_cmple_ps(a.v, b.v); }
+    inline floatx4 operator>(const floatx4& a, const floatx4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+    inline floatx4 operator>=(const floatx4& a, const floatx4& b) { return _mm_cmpge_ps(a.v, b.v); }
+    inline floatx4& operator+=(floatx4& a, const floatx4& b) { a = a + b; return a; }
+    inline floatx4& operator-=(floatx4& a, const floatx4& b) { a = a - b; return a; }
+    inline floatx4& operator*=(floatx4& a, const floatx4& b) { a = a * b; return a; }
+
+    inline intx4 operator+(const intx4& a, const intx4& b) { return _mm_add_epi32(a.v, b.v); }
+    inline intx4 operator-(const intx4& a, const intx4& b) { return _mm_sub_epi32(a.v, b.v); }
+    inline intx4 operator&(const intx4& a, const intx4& b) { return _mm_and_si128(a.v, b.v); }
+    inline intx4 operator|(const intx4& a, const intx4& b) { return _mm_or_si128(a.v, b.v); }
+    inline intx4 operator^(const intx4& a, const intx4& b) { return _mm_xor_si128(a.v, b.v); }
+    inline intx4 operator==(const intx4& a, const intx4& b) { return _mm_cmpeq_epi32(a.v, b.v); }
+    inline intx4 operator<<(const intx4& a, int s) { return _mm_slli_epi32(a.v, s); }
+    inline intx4 operator>>(const intx4& a, int s) { return _mm_srai_epi32(a.v, s); }
+
+    inline floatx4 madd(const floatx4& a, const floatx4& b, const floatx4& c)
+    {
+#ifdef __FMA__
+        return _mm_fmadd_ps(a.v, b.v, c.v);
+#else
+        return _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v);
+#endif
+    }
+
+    inline floatx4 min(const floatx4& a, const floatx4& b) { return _mm_min_ps(a.v, b.v); }
+    inline floatx4 max(const floatx4& a, const floatx4& b) { return _mm_max_ps(a.v, b.v); }
+    inline floatx4 sqrt(const floatx4& a) { return _mm_sqrt_ps(a.v); }
+    inline floatx4 rsqrt(const floatx4& a) { return _mm_rsqrt_ps(a.v); }
+    inline floatx4 rcp(const floatx4& a) { return _mm_rcp_ps(a.v); }
+    inline floatx4 abs(const floatx4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+
+    // mask ? a : b, mask lanes are all ones or all zeros
+    inline floatx4 select(const floatx4& mask, const floatx4& a, const floatx4& b)
+    {
+#ifdef __SSE4_1__
+        return _mm_blendv_ps(b.v, a.v, mask.v);
+#else
+        return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+#endif
+    }
+
+    inline intx4 select(const intx4& mask, const intx4& a, const intx4& b)
+    {
+        return _mm_or_si128(_mm_and_si128(mask.v, a.v), _mm_andnot_si128(mask.v, b.v));
+    }
+
+    inline int movemask(const floatx4& a) { return _mm_movemask_ps(a.v); }
+    inline bool any(const floatx4& a) { return movemask(a) != 0; }
+    inline bool all(const floatx4& a) { return movemask(a) == 0xf; }
+
+    inline intx4 to_int(const floatx4& a) { return _mm_cvttps_epi32(a.v); }      // truncate
+    inline intx4 to_int_round(const floatx4& a) { return _mm_cvtps_epi32(a.v); } // nearest
+    inline floatx4 to_float(const intx4& a) { return _mm_cvtepi32_ps(a.v); }
+    inline intx4 as_int(const floatx4& a) { return _mm_castps_si128(a.v); }
+    inline floatx4 as_float(const intx4& a) { return _mm_castsi128_ps(a.v); }
+
+    inline floatx4 floor(const floatx4& a)
+    {
+#ifdef __SSE4_1__
+        return _mm_floor_ps(a.v);
+#else
+        floatx4 t = to_float(to_int(a));
+        return t - (floatx4(1.f) & (a < t));
+#endif
+    }
+
+    inline floatx4 load(const float* p, floatx4) { return _mm_loadu_ps(p); }
+    inline intx4 load(const int32* p, intx4) { return _mm_loadu_si128((const __m128i*)p); }
+    inline floatx4 load_int16(const int16* p, floatx4)
+    {
+        __m128i v = _mm_loadl_epi64((const __m128i*)p);
+#ifdef __SSE4_1__
+        v = _mm_cvtepi16_epi32(v);
+#else
+        v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+#endif
+        return _mm_cvtepi32_ps(v);
+    }
+
+    inline void store(float* p, const floatx4& a) { _mm_storeu_ps(p, a.v); }
+    inline void store(int32* p, const intx4& a) { _mm_storeu_si128((__m128i*)p, a.v); }
+
+    // RGBA8 pixels from channel packets, one pixel per lane. Channels are
+    // saturated to [0, 255] by the packs.
+    inline intx4 pack_rgba8(const intx4& r, const intx4& g, const intx4& b, const intx4& a)
+    {
+        __m128i rg = _mm_packs_epi32(r.v, g.v);     // r0 r1 r2 r3 g0 g1 g2 g3
+        __m128i ba = _mm_packs_epi32(b.v, a.v);     // b0 b1 b2 b3 a0 a1 a2 a3
+        __m128i t0 = _mm_unpacklo_epi16(rg, ba);    // r0 b0 r1 b1 r2 b2 r3 b3
+        __m128i t1 = _mm_unpackhi_epi16(rg, ba);    // g0 a0 g1 a1 g2 a2 g3 a3
+        return _mm_packus_epi16(_mm_unpacklo_epi16(t0, t1), _mm_unpackhi_epi16(t0, t1));
+    }
+
+    // Hides a value from the optimizer. -ffast-math would otherwise fold
+    // multi-step extended precision arithmetic back into a single step.
+    inline floatx4 opaque(floatx4 a) { __asm__("" : "+x"(a.v)); return a; }
+
+    // lane i = base + i
+    inline floatx4 ramp(float base, floatx4) { return _mm_setr_ps(base, base+1.f, base+2.f, base+3.f); }
+    inline intx4 ramp(int32 base, intx4) { return _mm_add_epi32(_mm_set1_epi32(base), _mm_setr_epi32(0, 1, 2, 3)); }
+
+    //
+    // intx8 / floatx8
+    //
+    // Native with AVX2, otherwise two SSE halves so that 8-wide code still
+    // compiles and runs everywhere.
+    //
+
+#ifdef __AVX2__
+    struct intx8
+    {
+        intx8() {}
+        intx8(__m256i v) : v(v) {}
+        explicit intx8(int32 s) : v(_mm256_set1_epi32(s)) {}
+
+        static const int width = 8;
+
+        __m256i v;
+    };
+
+    struct floatx8
+    {
+        floatx8() {}
+        floatx8(__m256 v) : v(v) {}
+        explicit floatx8(float s) : v(_mm256_set1_ps(s)) {}
+
+        static const int width = 8;
+
+        float operator[](int i) const
+        {
+            kd_assert(i >= 0 && i < 8);
+            float t[8];
+            _mm256_storeu_ps(t, v);
+            return t[i];
+        }
+
+        __m256 v;
+    };
+
+    inline floatx8 operator+(const floatx8& a, const floatx8& b) { return _mm256_add_ps(a.v, b.v); }
+    inline floatx8 operator-(const floatx8& a, const floatx8& b) { return _mm256_sub_ps(a.v, b.v); }
+    inline floatx8 operator*(const floatx8& a, const floatx8& b) { return _mm256_mul_ps(a.v, b.v); }
+    inline floatx8 operator/(const floatx8& a, const floatx8& b) { return _mm256_div_ps(a.v, b.v); }
+    inline floatx8 operator-(const floatx8& a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f)); }
+    inline floatx8 operator&(const floatx8& a, const floatx8& b) { return _mm256_and_ps(a.v, b.v); }
+    inline floatx8 operator|(const floatx8& a, const floatx8& b) { return _mm256_or_ps(a.v, b.v); }
+    inline floatx8 operator^(const floatx8& a, const floatx8& b) { return _mm256_xor_ps(a.v, b.v); }
+    inline floatx8 operator<(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    inline floatx8 operator<=(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    inline floatx8 operator>(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    inline floatx8 operator>=(const floatx8& a, const floatx8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+    inline floatx8& operator+=(floatx8& a, const floatx8& b) { a = a + b; return a; }
+    inline floatx8& operator-=(floatx8& a, const floatx8& b) { a = a - b; return a; }
+    inline floatx8& operator*=(floatx8& a, const floatx8& b) { a = a * b; return a; }
+
+    inline intx8 operator+(const intx8& a, const intx8& b) { return _mm256_add_epi32(a.v, b.v); }
+    inline intx8 operator-(const intx8& a, const intx8& b) { return _mm256_sub_epi32(a.v, b.v); }
+    inline intx8 operator&(const intx8& a, const intx8& b) { return _mm256_and_si256(a.v, b.v); }
+    inline intx8 operator|(const intx8& a, const intx8& b) { return _mm256_or_si256(a.v, b.v); }
+    inline intx8 operator^(const intx8& a, const intx8& b) { return _mm256_xor_si256(a.v, b.v); }
+    inline intx8 operator==(const intx8& a, const intx8& b) { return _mm256_cmpeq_epi32(a.v, b.v); }
+    inline intx8 operator<<(const intx8& a, int s) { return _mm256_slli_epi32(a.v, s); }
+    inline intx8 operator>>(const intx8& a, int s) { return _mm256_srai_epi32(a.v, s); }
+
+    inline floatx8 madd(const floatx8& a, const floatx8& b, const floatx8& c)
+    {
+#ifdef __FMA__
+        return _mm256_fmadd_ps(a.v, b.v, c.v);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v);
+#endif
+    }
+
+    inline floatx8 min(const floatx8& a, const floatx8& b) { return _mm256_min_ps(a.v, b.v); }
+    inline floatx8 max(const floatx8& a, const floatx8& b) { return _mm256_max_ps(a.v, b.v); }
+    inline floatx8 sqrt(const floatx8& a) { return _mm256_sqrt_ps(a.v); }
+    inline floatx8 rsqrt(const floatx8& a) { return _mm256_rsqrt_ps(a.v); }
+    inline floatx8 rcp(const floatx8& a) { return _mm256_rcp_ps(a.v); }
+    inline floatx8 abs(const floatx8& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+    inline floatx8 select(const floatx8& mask, const floatx8& a, const floatx8& b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+    inline intx8 select(const intx8& mask, const intx8& a, const intx8& b) { return _mm256_blendv_epi8(b.v, a.v, mask.v); }
+    inline int movemask(const floatx8& a) { return _mm256_movemask_ps(a.v); }
+    inline bool any(const floatx8& a) { return movemask(a) != 0; }
+    inline bool all(const floatx8& a) { return movemask(a) == 0xff; }
+
+    inline intx8 to_int(const floatx8& a) { return _mm256_cvttps_epi32(a.v); }
+    inline intx8 to_int_round(const floatx8& a) { return _mm256_cvtps_epi32(a.v); }
+    inline floatx8 to_float(const intx8& a) { return _mm256_cvtepi32_ps(a.v); }
+    inline intx8 as_int(const floatx8& a) { return _mm256_castps_si256(a.v); }
+    inline floatx8 as_float(const intx8& a) { return _mm256_castsi256_ps(a.v); }
+    inline floatx8 floor(const floatx8& a) { return _mm256_floor_ps(a.v); }
+
+    inline floatx8 load(const float* p, floatx8) { return _mm256_loadu_ps(p); }
+    inline intx8 load(const int32* p, intx8) { return _mm256_loadu_si256((const __m256i*)p); }
+    inline floatx8 load_int16(const int16* p, floatx8)
+    {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p)));
+    }
+
+    inline void store(float* p, const floatx8& a) { _mm256_storeu_ps(p, a.v); }
+    inline void store(int32* p, const intx8& a) { _mm256_storeu_si256((__m256i*)p, a.v); }
+
+    // Same shuffle as the intx4 version; every step stays within 128-bit
+    // halves, so each half packs its own four pixels.
+    inline intx8 pack_rgba8(const intx8& r, const intx8& g, const intx8& b, const intx8& a)
+    {
+        __m256i rg = _mm256_packs_epi32(r.v, g.v);
+        __m256i ba = _mm256_packs_epi32(b.v, a.v);
+        __m256i t0 = _mm256_unpacklo_epi16(rg, ba);
+        __m256i t1 = _mm256_unpackhi_epi16(rg, ba);
+        return _mm256_packus_epi16(_mm256_unpacklo_epi16(t0, t1), _mm256_unpackhi_epi16(t0, t1));
+    }
+
+    inline floatx8 opaque(floatx8 a) { __asm__("" : "+x"(a.v)); return a; }
+
+    inline floatx8 ramp(float base, floatx8)
+    {
+        return _mm256_add_ps(_mm256_set1_ps(base), _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f));
+    }
+
+    inline intx8 ramp(int32 base, intx8)
+    {
+        return _mm256_add_epi32(_mm256_set1_epi32(base), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+#else
+    struct intx8
+    {
+        intx8() {}
+        intx8(const intx4& lo, const intx4& hi) : lo(lo), hi(hi) {}
+        explicit intx8(int32 s) : lo(s), hi(s) {}
+
+        static const int width = 8;
+
+        intx4 lo, hi;
+    };
+
+    struct floatx8
+    {
+        floatx8() {}
+        floatx8(const floatx4& lo, const floatx4& hi) : lo(lo), hi(hi) {}
+        explicit floatx8(float s) : lo(s), hi(s) {}
+
+        static const int width = 8;
+
+        float operator[](int i) const
+        {
+            kd_assert(i >= 0 && i < 8);
+            return i < 4 ? lo[i] : hi[i-4];
+        }
+
+        floatx4 lo, hi;
+    };
+
+#define KD_SIMD_SPLIT2(R, OP, A) \
+    inline R operator OP(const A& a, const A& b) { return R(a.lo OP b.lo, a.hi OP b.hi); }
+    KD_SIMD_SPLIT2(floatx8, +, floatx8)
+    KD_SIMD_SPLIT2(floatx8, -, floatx8)
+    KD_SIMD_SPLIT2(floatx8, *, floatx8)
+    KD_SIMD_SPLIT2(floatx8, /, floatx8)
+    KD_SIMD_SPLIT2(floatx8, &, floatx8)
+    KD_SIMD_SPLIT2(floatx8, |, floatx8)
+    KD_SIMD_SPLIT2(floatx8, ^, floatx8)
+    KD_SIMD_SPLIT2(floatx8, <, floatx8)
+    KD_SIMD_SPLIT2(floatx8, <=, floatx8)
+    KD_SIMD_SPLIT2(floatx8, >, floatx8)
+    KD_SIMD_SPLIT2(floatx8, >=, floatx8)
+    KD_SIMD_SPLIT2(intx8, +, intx8)
+    KD_SIMD_SPLIT2(intx8, -, intx8)
+    KD_SIMD_SPLIT2(intx8, &, intx8)
+    KD_SIMD_SPLIT2(intx8, |, intx8)
+    KD_SIMD_SPLIT2(intx8, ^, intx8)
+    KD_SIMD_SPLIT2(intx8, ==, intx8)
+#undef KD_SIMD_SPLIT2
+
+    inline floatx8 operator-(const floatx8& a) { return floatx8(-a.lo, -a.hi); }
+    inline floatx8& operator+=(floatx8& a, const floatx8& b) { a = a + b; return a; }
+    inline floatx8& operator-=(floatx8& a, const floatx8& b) { a = a - b; return a; }
+    inline floatx8& operator*=(floatx8& a, const floatx8& b) { a = a * b; return a; }
+    inline intx8 operator<<(const intx8& a, int s) { return intx8(a.lo << s, a.hi << s); }
+    inline intx8 operator>>(const intx8& a, int s) { return intx8(a.lo >> s, a.hi >> s); }
+
+    inline floatx8 madd(const floatx8& a, const floatx8& b, const floatx8& c) { return floatx8(madd(a.lo, b.lo, c.lo), madd(a.hi, b.hi, c.hi)); }
+    inline floatx8 min(const floatx8& a, const floatx8& b) { return floatx8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+    inline floatx8 max(const floatx8& a, const floatx8& b) { return floatx8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+    inline floatx8 sqrt(const floatx8& a) { return floatx8(sqrt(a.lo), sqrt(a.hi)); }
+    inline floatx8 rsqrt(const floatx8& a) { return floatx8(rsqrt(a.lo), rsqrt(a.hi)); }
+    inline floatx8 rcp(const floatx8& a) { return floatx8(rcp(a.lo), rcp(a.hi)); }
+    inline floatx8 abs(const floatx8& a) { return floatx8(abs(a.lo), abs(a.hi)); }
+    inline floatx8 select(const floatx8& m, const floatx8& a, const floatx8& b) { return floatx8(select(m.lo, a.lo, b.lo), select(m.hi, a.hi, b.hi)); }
+    inline intx8 select(const intx8& m, const intx8& a, const intx8& b) { return intx8(select(m.lo, a.lo, b.lo), select(m.hi, a.hi, b.hi)); }
+    inline int movemask(const floatx8& a) { return movemask(a.lo) | (movemask(a.hi) << 4); }
+    inline bool any(const floatx8& a) { return movemask(a) != 0; }
+    inline bool all(const floatx8& a) { return movemask(a) == 0xff; }
+
+    inline intx8 to_int(const floatx8& a) { return intx8(to_int(a.lo), to_int(a.hi)); }
+    inline intx8 to_int_round(const floatx8& a) { return intx8(to_int_round(a.lo), to_int_round(a.hi)); }
+    inline floatx8 to_float(const intx8& a) { return floatx8(to_float(a.lo), to_float(a.hi)); }
+    inline intx8 as_int(const floatx8& a) { return intx8(as_int(a.lo), as_int(a.hi)); }
+    inline floatx8 as_float(const intx8& a) { return floatx8(as_float(a.lo), as_float(a.hi)); }
+    inline floatx8 floor(const floatx8& a) { return floatx8(floor(a.lo), floor(a.hi)); }
+
+    inline floatx8 load(const float* p, floatx8) { return floatx8(load(p, floatx4()), load(p+4, floatx4())); }
+    inline intx8 load(const int32* p, intx8) { return intx8(load(p, intx4()), load(p+4, intx4())); }
+    inline floatx8 load_int16(const int16* p, floatx8) { return floatx8(load_int16(p, floatx4()), load_int16(p+4, floatx4())); }
+    inline void store(float* p, const floatx8& a) { store(p, a.lo); store(p+4, a.hi); }
+    inline void store(int32* p, const intx8& a) { store(p, a.lo); store(p+4, a.hi); }
+    inline intx8 pack_rgba8(const intx8& r, const intx8& g, const intx8& b, const intx8& a) { return intx8(pack_rgba8(r.lo, g.lo, b.lo, a.lo), pack_rgba8(r.hi, g.hi, b.hi, a.hi)); }
+    inline floatx8 opaque(const floatx8& a) { return floatx8(opaque(a.lo), opaque(a.hi)); }
+    inline floatx8 ramp(float base, floatx8) { return floatx8(ramp(base, floatx4()), ramp(base+4.f, floatx4())); }
+    inline intx8 ramp(int32 base, intx8) { return intx8(ramp(base, intx4()), ramp(base+4, intx4())); }
+#endif
+
+    //
+    // Maps packet types to their integer and float counterparts.
+    //
+
+    template<typename F> struct simd_traits;
+    template<> struct simd_traits<floatx4> { typedef intx4 int_type; typedef floatx4 float_type; };
+    template<> struct simd_traits<floatx8> { typedef intx8 int_type; typedef floatx8 float_type; };
+    template<> struct simd_traits<intx4> { typedef intx4 int_type; typedef floatx4 float_type; };
+    template<> struct simd_traits<intx8> { typedef intx8 int_type; typedef floatx8 float_type; };
+
+    //
+    // Containers used inside kernels. std::vector<int32> grown in two
+    // kernel files is one out-of-line function under one name, and the
+    // linker keeps a single ISA's copy for both. The allocator carries the
+    // ISA namespace into the name, so each kernel file has its own.
+    //
+
+    template<typename T>
+    struct KernelAllocator : std::allocator<T>
+    {
+        template<typename U> struct rebind { typedef KernelAllocator<U> other; };
+
+        KernelAllocator() {}
+        template<typename U> KernelAllocator(const KernelAllocator<U>&) {}
+    };
+
+    template<typename T>
+    using KernelVector = std::vector<T, KernelAllocator<T> >;
+}
+}
@@ -1,22 +1,73 @@
 #pragma once
 
+#include "image.hpp"
+#include "math.hpp"
+#include <vector>
+
 namespace kd
 {
-    static void wobbler(Image& dst, const Image& src, float a, float b, float c)
+    // out[i] = int(wave((first + i + offset) * freq) * amp) for i in
+    // [0, n), where wave is sin or cos from math policy M.
+    template<typename M>
+    static void wobbleTable(int32* out, int first, int n, float offset, float freq, float amp, bool useSin)
+    {
+        for (int i = 0; i < n; i += floatx8::width)
+        {
+            floatx8 t = (ramp(float(first + i), floatx8()) + floatx8(offset)) * floatx8(freq);
+            floatx8 v = useSin ? M::sin(t) : M::cos(t);
+            store(out + i, to_int(v * floatx8(amp)));
+        }
+    }
+
+    // Pixel (x, y) of the frame, black outside src.
+    static inline uint32 wobbleSample(const ImageView& src, int x, int y)
+    {
+        x -= src.x;
+        y -= src.y;
+        if (x < 0 || y < 0 || x >= src.w || y >= src.h)
+            return 0;
+        return src.row(y)[x];
+    }
+
+    static inline uint32 wobbleSample(const TiledImage& src, int x, int y)
     {
-        int i = 0;
+        if (x < 0 || y < 0 || x >= src.w || y >= src.h)
+            return 0;
+        return *src.pixel(x, y);
+    }
+
+    // The displacement is a function of image position, so a view of dst
+    // gets the same pixels it would as part of the whole frame. src is an
+    // ImageView or a TiledImage.
+    template<typename M, typename Src>
+    static void wobbler(const ImageView& dst, const Src& src, float a, float b, float c)
+    {
+        // Two displacement terms depend only on x and two only on y, so
+        // they are evaluated once per column and row instead of per pixel.
+        // The tables are kept between frames.
+        const int pad = floatx8::width;
+        static thread_local KernelVector<int32> colX, colY, rowX, rowY;
+        colX.resize(dst.w + pad);
+        colY.resize(dst.w + pad);
+        rowX.resize(dst.h + pad);
+        rowY.resize(dst.h + pad);
+
+        wobbleTable<M>(&colX[0], dst.x, dst.w, a, 0.123f, c, false);
+        wobbleTable<M>(&colY[0], dst.x, dst.w, a, 0.113f, c, false);
+        wobbleTable<M>(&rowX[0], dst.y, dst.h, a, 0.183f, c, false);
+        wobbleTable<M>(&rowY[0], dst.y, dst.h, b, 0.143f, c, true);
+
         for (int y = 0; y < dst.h; y++)
+        {
+            uint32* d = dst.row(y);
+
             for (int x = 0; x < dst.w; x++)
             {
-                int xx = x + int(cosf((x + a) * 0.123f) * c) + int(cosf((y + a) * 0.183f) * c);
-                int yy = y + int(sinf((y + b) * 0.143f) * c) + int(cosf((x + a) * 0.113f) * c);
-
-                if (xx < 0 || yy < 0 || xx >= dst.w || yy >= dst.h)
-                    dst.data[i] = 0;
-                else
-                    dst.data[i] = src.data[yy*src.w+xx];
+                int xx = dst.x + x + colX[x] + rowX[y];
+                int yy = dst.y + y + rowY[y] + colY[x];
 
-                i++;
+                d[x] = wobbleSample(src, xx, yy);
             }
+        }
     }
 }